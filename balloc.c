@@ -0,0 +1,830 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-01 15:04:21 holzplatten"
+ *
+ *       File:         balloc.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Jun  1 19:35:02 2013
+ *
+ *       Reserva de bloques de datos con mapa de bits.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <balloc.h>
+#include <block.h>
+#include <journal.h>
+#include <misc.h>
+#include <superblock.h>
+
+
+#define BIT_USED_P(map, n) ((map)[(n) / 8] & (1 << ((n) % 8)))
+#define BIT_SET(map, n) ((map)[(n) / 8] |= (1 << ((n) % 8)))
+#define BIT_CLEAR(map, n) ((map)[(n) / 8] &= ~(1 << ((n) % 8)))
+
+/* Libre de verdad: ni ocupado, ni en la ventana de nadie, ni esperando
+   a que se confirme su liberación. */
+#define BLOCK_FREE_P(sb, n) (!BIT_USED_P((sb)->bitmap, n)               \
+                             && !BIT_USED_P((sb)->prealloc, n)          \
+                             && !BIT_USED_P((sb)->freeing, n))
+
+
+
+
+/*-
+ *      Routine:       bitmap_new
+ *
+ *      Purpose:
+ *              Reserva la copia en memoria del mapa de bits, con
+ *              bitmap_blocks bloques, y marca como ocupados los bits que
+ *              sobran tras el último bloque de datos. También reserva,
+ *              vacíos, el mapa de las ventanas de prerreserva y el de los
+ *              bloques pendientes de liberar.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con block_count y
+ *              bitmap_blocks ya puestos.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+bitmap_new(superblock_t * const sb)
+{
+  unsigned long n;
+
+  free(sb->bitmap);
+  free(sb->prealloc);
+  free(sb->freeing);
+  sb->bitmap = calloc(sb->bitmap_blocks, sizeof(struct block));
+  sb->prealloc = calloc(sb->bitmap_blocks, sizeof(struct block));
+  sb->freeing = calloc(sb->bitmap_blocks, sizeof(struct block));
+  if (!sb->bitmap || !sb->prealloc || !sb->freeing)
+    return -1;
+  sb->prealloc_blocks = 0;
+  sb->freeing_blocks = 0;
+
+  for (n = sb->block_count; n < sb->bitmap_blocks * BITS_PER_BLOCK; n++)
+    BIT_SET(sb->bitmap, n);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       bitmap_sync
+ *
+ *      Purpose:
+ *              Pasa a la caché de bloques los bloques del mapa de bits que
+ *              contienen los bits de first a last.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+bitmap_sync(int dev, superblock_t * const sb,
+            unsigned long first, unsigned long last)
+{
+  unsigned long b;
+  int res = 0;
+
+  for (b = first / BITS_PER_BLOCK; b <= last / BITS_PER_BLOCK; b++)
+    if (writemeta(dev, sb, sb->bitmap_base + b,
+                  (block_t *) (sb->bitmap + b * sizeof(struct block)),
+                  B_NO_OWNER) < 0)
+      res = -1;
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bitmap_count_free
+ *
+ *      Purpose:
+ *              Cuenta los bloques libres del mapa de bits en memoria.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *      Returns:
+ *              El número de bloques libres.
+ *
+ */
+static unsigned long
+bitmap_count_free(const superblock_t * const sb)
+{
+  unsigned long n, count = 0;
+
+  for (n = 0; n < sb->block_count; n++)
+    if (!BIT_USED_P(sb->bitmap, n))
+      count++;
+
+  return count;
+}
+
+
+
+
+/*-
+ *      Routine:       run_length
+ *
+ *      Purpose:
+ *              Cuenta cuántos bloques libres seguidos (y fuera de toda
+ *              ventana) hay a partir de n, sin pasar de max.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *      Returns:
+ *              La longitud de la racha (0 si n está ocupado).
+ *
+ */
+static long
+run_length(const superblock_t * const sb, unsigned long n, long max)
+{
+  long len = 0;
+
+  while (len < max && n + len < sb->block_count
+         && BLOCK_FREE_P(sb, n + len))
+    len++;
+
+  return len;
+}
+
+
+
+
+/*-
+ *      Routine:       find_run
+ *
+ *      Purpose:
+ *              Busca, entre los bloques lo y hi-1, el primero a partir del
+ *              cual hay want bloques libres seguidos. Se salta de golpe los
+ *              bytes del mapa que están llenos.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              hi no debe pasar de block_count.
+ *      Returns:
+ *              El número del primer bloque de la racha.
+ *              -1 si no hay ninguna.
+ *
+ */
+static long
+find_run(const superblock_t * const sb, unsigned long lo, unsigned long hi,
+         long want)
+{
+  unsigned long n = lo;
+  long len;
+
+  while (n < hi)
+    {
+      if (n % 8 == 0
+          && (sb->bitmap[n / 8] | sb->prealloc[n / 8]
+              | sb->freeing[n / 8]) == 0xff)
+        {
+          n += 8;
+          continue;
+        }
+
+      len = run_length(sb, n, want);
+      if (len == want)
+        return n;
+
+      n += len + 1;
+    }
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       balloc_init
+ *
+ *      Purpose:
+ *              Crea el mapa de bits de un sistema de archivos nuevo, al
+ *              principio de la zona de bloques, con todo libre salvo el
+ *              propio mapa.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs recién creado.
+ *              sb debe apuntar al superbloque devuelto por
+ *              superblock_init().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+balloc_init(int dev, superblock_t * const sb)
+{
+  unsigned long n;
+
+  sb->bitmap_base = 0;
+  sb->bitmap_blocks = (sb->block_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  if (bitmap_new(sb) < 0)
+    return -1;
+
+  for (n = 0; n < sb->bitmap_blocks; n++)
+    BIT_SET(sb->bitmap, sb->bitmap_base + n);
+
+  sb->free_blocks = sb->block_count - sb->bitmap_blocks;
+  sb->alloc_rotor = sb->bitmap_base + sb->bitmap_blocks;
+
+  return bitmap_sync(dev, sb, 0, sb->block_count - 1);
+}
+
+
+
+
+/*-
+ *      Routine:       balloc_convert
+ *
+ *      Purpose:
+ *              Construye el mapa de bits de un sistema de archivos de la
+ *              revisión 0 o de la 0xCA02 recorriendo su lista encadenada
+ *              de bloques libres y le busca sitio entre los bloques
+ *              libres. Los bloques que guardan la lista se quedan
+ *              apartados hasta que el superbloque deje de señalarla. En
+ *              la 0xCA02 deja el superbloque en la revisión 0xCA03 (la de
+ *              ibitmap_load()); en la 0 no lo escribe, porque todavía
+ *              quedan por convertir los inodos y los directorios.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque de la revisión 0 o de la
+ *              0xCA02.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+balloc_convert(int dev, superblock_t * const sb)
+{
+  unsigned long list[FREE_BLOCK_LIST_SIZE], link, steps;
+  block_t *block;
+  long base;
+  int i, index;
+
+  DEBUG(">> balloc_convert >> Pasando la lista de libres a mapa de bits\n");
+
+  memcpy(list, sb->free_block_list, sizeof(list));
+  index = sb->free_block_index;
+
+  sb->bitmap_blocks = (sb->block_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  if (bitmap_new(sb) < 0)
+    return -1;
+  memset(sb->bitmap, 0xff, sb->bitmap_blocks * sizeof(struct block));
+
+  /* En cada tramo de la lista, las entradas 0 a index están libres, y la
+     0 además guarda el siguiente tramo (completo). El último tramo de
+     mkfs apunta ya fuera de la zona de bloques. */
+  for (steps = 0; steps <= sb->block_count / FREE_BLOCK_LIST_SIZE + 1; steps++)
+    {
+      for (i=0; i <= index && i < FREE_BLOCK_LIST_SIZE; i++)
+        if (list[i] < sb->block_count)
+          BIT_CLEAR(sb->bitmap, list[i]);
+
+      link = list[0];
+      if (link >= sb->block_count)
+        break;
+
+      /* Si se cae antes de cambiar el superbloque, la lista tiene que
+         seguir entera. */
+      if (!BIT_USED_P(sb->freeing, link))
+        {
+          BIT_SET(sb->freeing, link);
+          sb->freeing_blocks++;
+        }
+
+      block = getblk(dev, sb, link);
+      if (!block)
+        return -1;
+      memcpy(list, block->data, sizeof(list));
+      brelse(block);
+      index = FREE_BLOCK_LIST_SIZE - 1;
+    }
+
+  base = find_run(sb, 0, sb->block_count, sb->bitmap_blocks);
+  if (base < 0)
+    {
+      DEBUG(">> balloc_convert >> Error: no hay sitio seguido para el mapa de bits\n");
+      return -1;
+    }
+
+  sb->bitmap_base = base;
+  for (i=0; i < sb->bitmap_blocks; i++)
+    BIT_SET(sb->bitmap, base + i);
+
+  sb->free_blocks = bitmap_count_free(sb);
+  sb->alloc_rotor = 0;
+
+  /* El mapa tiene que estar en disco antes que el superbloque que lo
+     señala. */
+  if (bitmap_sync(dev, sb, 0, sb->block_count - 1) < 0
+      || bflush(dev, sb) < 0)
+    return -1;
+
+  if (sb->magic2 == MAGIC_NUMBER)
+    return 0;
+
+  if (fdatasync(dev) < 0)
+    return -1;
+
+  sb->magic2 = GNORDOFS_REVISION_INODE_LIST;
+  if (superblock_write(dev, sb) < 0 || fdatasync(dev) < 0)
+    return -1;
+
+  bfree_commit(sb, 0, sb->block_count);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       balloc_load
+ *
+ *      Purpose:
+ *              Carga en memoria el mapa de bits de bloques libres,
+ *              convirtiendo antes la lista de libres si el sistema de
+ *              archivos es de la revisión 0 o de la 0xCA02. También
+ *              recalcula free_blocks a partir del mapa.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar al superbloque devuelto por
+ *              superblock_read().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+balloc_load(int dev, superblock_t * const sb)
+{
+  if (sb->magic2 == MAGIC_NUMBER
+      || sb->magic2 == GNORDOFS_REVISION_FREE_LIST)
+    return balloc_convert(dev, sb);
+
+  if (bitmap_new(sb) < 0)
+    return -1;
+
+  if (readblks(dev, sb, sb->bitmap_base, sb->bitmap_blocks,
+               (block_t *) sb->bitmap) < 0)
+    return -1;
+
+  sb->free_blocks = bitmap_count_free(sb);
+  sb->alloc_rotor = 0;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       balloc_search
+ *
+ *      Purpose:
+ *              Elige dónde reservar want bloques: en goal si está libre;
+ *              si no, en el primer hueco a partir de goal donde quepan
+ *              todos, y si no lo hay, en el primer bloque libre. Si no
+ *              queda nada fuera de las ventanas de prerreserva, se les
+ *              quitan a sus dueños y se vuelve a buscar.
+ *      Conditions:
+ *              El llamante debe tener sb->block_lock.
+ *              0 <= goal < block_count.
+ *      Returns:
+ *              El número del primer bloque.
+ *              -1 si no queda sitio.
+ *
+ */
+static long
+balloc_search(superblock_t * const sb, long goal, long want)
+{
+  long n;
+
+  if (BLOCK_FREE_P(sb, goal))
+    return goal;
+
+  n = find_run(sb, goal, sb->block_count, want);
+  if (n < 0)
+    n = find_run(sb, 0, goal, want);
+  if (n < 0 && want > 1)
+    {
+      n = find_run(sb, goal, sb->block_count, 1);
+      if (n < 0)
+        n = find_run(sb, 0, goal, 1);
+    }
+
+  if (n < 0 && sb->prealloc_blocks > 0)
+    {
+      DEBUG_VERBOSE(">> balloc_search >> Recuperando las ventanas de prerreserva\n");
+      memset(sb->prealloc, 0, sb->bitmap_blocks * sizeof(struct block));
+      sb->prealloc_blocks = 0;
+      sb->prealloc_gen++;
+      return balloc_search(sb, goal, want);
+    }
+
+  return n;
+}
+
+
+
+
+/*-
+ *      Routine:       window_drop
+ *
+ *      Purpose:
+ *              Devuelve los bloques de una ventana de prerreserva, si
+ *              siguen siendo suyos.
+ *      Conditions:
+ *              El llamante debe tener sb->block_lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+window_drop(superblock_t * const sb, struct balloc_window *win)
+{
+  long i;
+
+  if (win->len > 0 && win->gen == sb->prealloc_gen)
+    {
+      for (i=0; i < win->len; i++)
+        BIT_CLEAR(sb->prealloc, win->start + i);
+      sb->prealloc_blocks -= win->len;
+    }
+
+  win->len = 0;
+}
+
+
+
+
+/*-
+ *      Routine:       balloc
+ *
+ *      Purpose:
+ *              Reserva hasta *count bloques de datos seguidos, a ser
+ *              posible a partir de goal (ver balloc_search()), sin tocar
+ *              los prometidos con breserve().
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              goal puede ser BALLOC_NO_GOAL.
+ *              count puede ser NULL (un bloque).
+ *      Returns:
+ *              El número del primer bloque, y en *count cuántos se han
+ *              reservado.
+ *              -1 si no queda sitio.
+ *
+ */
+long
+balloc(int dev, superblock_t * const sb, long goal, long *count)
+{
+  return balloc_win(dev, sb, NULL, goal, count, 0);
+}
+
+
+
+
+/*-
+ *      Routine:       balloc_win
+ *
+ *      Purpose:
+ *              Como balloc(), pero para un archivo con su ventana de
+ *              prerreserva: si la ventana empieza donde se pide (o no se
+ *              pide ningún sitio), los bloques salen de ella. Si no, se
+ *              devuelve la ventana y se reservan, seguidos, los bloques
+ *              pedidos más BALLOC_WINDOW para una ventana nueva, que
+ *              nadie más usará mientras no se devuelva (o se acabe el
+ *              sitio). Las ventanas sólo están en memoria: en disco esos
+ *              bloques siguen libres.
+ *              Con reserved distinto de cero, el llamante tiene apartados
+ *              con breserve() los bloques que pide; si no, sólo se dan
+ *              los que no estén prometidos a nadie, y menos de *count
+ *              si no quedan tantos.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              win puede ser NULL (sin ventana).
+ *              goal puede ser BALLOC_NO_GOAL.
+ *              count puede ser NULL (un bloque).
+ *      Returns:
+ *              El número del primer bloque, y en *count cuántos se han
+ *              reservado.
+ *              -1 si no queda sitio.
+ *
+ */
+long
+balloc_win(int dev, superblock_t * const sb, struct balloc_window *win,
+           long goal, long *count, int reserved)
+{
+  long n, i, len, want, avail, extra = 0;
+
+  want = count && *count > 0 ? *count : 1;
+
+  pthread_mutex_lock(&sb->block_lock);
+
+  /* Que no se acaben los prometidos a los bloques retardados: su
+     write() ya ha terminado bien. */
+  avail = (long) sb->free_blocks - (long) sb->freeing_blocks;
+  if (!reserved)
+    avail -= sb->reserved_blocks;
+  if (avail < want)
+    want = avail;
+  if (want <= 0)
+    {
+      pthread_mutex_unlock(&sb->block_lock);
+      DEBUG_VERBOSE(">> balloc >> Error: no quedan bloques libres\n");
+      return -1;
+    }
+
+  if (win && win->gen != sb->prealloc_gen)
+    win->len = 0;
+
+  if (win && win->len > 0 && (goal < 0 || goal == win->start))
+    {
+      /* Del principio de la ventana. */
+      n = win->start;
+      len = want < win->len ? want : win->len;
+      for (i=0; i < len; i++)
+        BIT_CLEAR(sb->prealloc, n + i);
+      sb->prealloc_blocks -= len;
+      win->start += len;
+      win->len -= len;
+    }
+  else
+    {
+      if (win)
+        {
+          window_drop(sb, win);
+          extra = BALLOC_WINDOW;
+        }
+
+      if (goal < 0 || goal >= sb->block_count)
+        goal = sb->alloc_rotor;
+
+      n = balloc_search(sb, goal, want + extra);
+      if (n < 0)
+        {
+          pthread_mutex_unlock(&sb->block_lock);
+          DEBUG_VERBOSE(">> balloc >> Error: no quedan bloques libres\n");
+          return -1;
+        }
+
+      len = run_length(sb, n, want + extra);
+      if (len > want)
+        {
+          /* Lo que sobra, a la ventana. */
+          win->start = n + want;
+          win->len = len - want;
+          win->gen = sb->prealloc_gen;
+          for (i=0; i < win->len; i++)
+            BIT_SET(sb->prealloc, win->start + i);
+          sb->prealloc_blocks += win->len;
+          len = want;
+        }
+      sb->alloc_rotor = n + len + (win ? win->len : 0);
+      if (sb->alloc_rotor >= sb->block_count)
+        sb->alloc_rotor = 0;
+    }
+
+  for (i=0; i < len; i++)
+    BIT_SET(sb->bitmap, n + i);
+  sb->free_blocks -= len;
+  __atomic_store_n(&sb->modified, 1, __ATOMIC_RELAXED);
+
+  bitmap_sync(dev, sb, n, n + len - 1);
+
+  pthread_mutex_unlock(&sb->block_lock);
+
+  if (count)
+    *count = len;
+
+  return n;
+}
+
+
+
+
+/*-
+ *      Routine:       bwindow_release
+ *
+ *      Purpose:
+ *              Devuelve los bloques que le queden a una ventana de
+ *              prerreserva.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *      Returns:
+ *              none
+ *
+ */
+void
+bwindow_release(superblock_t * const sb, struct balloc_window *win)
+{
+  pthread_mutex_lock(&sb->block_lock);
+  window_drop(sb, win);
+  pthread_mutex_unlock(&sb->block_lock);
+}
+
+
+
+
+/*-
+ *      Routine:       bfree
+ *
+ *      Purpose:
+ *              Libera count bloques de datos seguidos a partir de n. En
+ *              el mapa quedan libres en seguida, pero no se vuelven a
+ *              asignar hasta que se confirme la transacción que lo
+ *              apunta: si se perdiera, seguirían siendo del archivo de
+ *              antes, y no deben tener datos de otro.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              Se debe llamar dentro de una transacción (journal_begin()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (algún bloque fuera de rango o ya libre).
+ *
+ */
+int
+bfree(int dev, superblock_t * const sb, long n, long count)
+{
+  long i;
+  int res = 0;
+
+  if (n < 0 || count < 1 || n + count > sb->block_count
+      || (n < sb->bitmap_base + sb->bitmap_blocks
+          && n + count > sb->bitmap_base))
+    {
+      DEBUG(">> bfree >> Error: bloques %ld a %ld fuera de rango\n",
+            n, n + count - 1);
+      return -1;
+    }
+
+  pthread_mutex_lock(&sb->block_lock);
+
+  for (i=0; i<count; i++)
+    {
+      if (!BIT_USED_P(sb->bitmap, n + i))
+        {
+          DEBUG(">> bfree >> Error: el bloque %ld ya estaba libre\n", n + i);
+          res = -1;
+          continue;
+        }
+      BIT_CLEAR(sb->bitmap, n + i);
+      BIT_SET(sb->freeing, n + i);
+      sb->free_blocks++;
+      sb->freeing_blocks++;
+      __atomic_store_n(&sb->modified, 1, __ATOMIC_RELAXED);
+    }
+
+  if (bitmap_sync(dev, sb, n, n + count - 1) < 0)
+    res = -1;
+
+  /* Sin diario no hay nada que esperar, salvo mientras se convierte un
+     sistema de la revisión 0: hasta que cambie el superbloque, siguen
+     siendo del sistema viejo (ver ibitmap_convert()). Si no se puede
+     apuntar, se quedan apartados hasta que se vuelva a montar. */
+  switch (journal_free(sb, n, count))
+    {
+    case 1:
+      if (sb->magic2 == MAGIC_NUMBER)
+        break;
+
+      pthread_mutex_unlock(&sb->block_lock);
+      bfree_commit(sb, n, count);
+      return res;
+    case -1:
+      DEBUG(">> bfree >> Error: no se pueden volver a usar los bloques %ld a %ld\n",
+            n, n + count - 1);
+      break;
+    }
+
+  pthread_mutex_unlock(&sb->block_lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bfree_commit
+ *
+ *      Purpose:
+ *              Deja volver a asignar count bloques a partir de n,
+ *              liberados con bfree(), ahora que se ha confirmado la
+ *              transacción que los liberó.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *      Returns:
+ *              none
+ *
+ */
+void
+bfree_commit(superblock_t * const sb, long n, long count)
+{
+  long i;
+
+  pthread_mutex_lock(&sb->block_lock);
+
+  for (i=0; i<count; i++)
+    if (BIT_USED_P(sb->freeing, n + i))
+      {
+        BIT_CLEAR(sb->freeing, n + i);
+        sb->freeing_blocks--;
+      }
+
+  pthread_mutex_unlock(&sb->block_lock);
+}
+
+
+
+
+/*-
+ *      Routine:       breserve
+ *
+ *      Purpose:
+ *              Aparta count bloques libres sin decir cuáles, para poder
+ *              asignarlos más tarde con la seguridad de que habrá sitio.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *      Returns:
+ *              0 on success.
+ *              -1 si no quedan bloques libres sin prometer.
+ *
+ */
+int
+breserve(superblock_t * const sb, long count)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&sb->block_lock);
+
+  if (sb->free_blocks - sb->freeing_blocks
+      < sb->reserved_blocks + count + BALLOC_META_RESERVE)
+    res = -1;
+  else
+    sb->reserved_blocks += count;
+
+  pthread_mutex_unlock(&sb->block_lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bunreserve
+ *
+ *      Purpose:
+ *              Devuelve count bloques apartados con breserve(), porque ya
+ *              se han asignado con balloc() o porque ya no hacen falta.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              count no debe pasar de lo apartado.
+ *      Returns:
+ *              none
+ *
+ */
+void
+bunreserve(superblock_t * const sb, long count)
+{
+  pthread_mutex_lock(&sb->block_lock);
+  sb->reserved_blocks -= count;
+  pthread_mutex_unlock(&sb->block_lock);
+}
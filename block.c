@@ -29,13 +29,86 @@
 
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <balloc.h>
 #include <block.h>
 #include <inode.h>
+#include <journal.h>
+#include <misc.h>
 #include <superblock.h>
+#include <uring.h>
+#include <writeback.h>
+
+
+#define BHASH(n) ((unsigned long) (n) % BCACHE_HASH_SIZE)
+
+/* Cabecera de buffer. El bloque va el primero para que un block_t devuelto
+   por getblk() se pueda convertir de vuelta a su buffer. */
+struct buffer
+{
+  block_t block;
+
+  long n;
+  int dev;
+  unsigned refcount;
+  char valid;
+  char dirty;
+  /* Hay una lectura de disco en curso sobre este buffer, o una
+     escritura de bsync(). */
+  char io;
+  /* Inodo del archivo al que pertenece un bloque de datos sucio (ver
+     bflush_inode()). */
+  int owner;
+
+  struct buffer *hash_next, *hash_prev;
+  struct buffer *lru_next, *lru_prev;
+};
+
+static struct
+{
+  /* Protege el hash, la lista LRU, las cabeceras y los contadores. */
+  pthread_mutex_t lock;
+  /* Señala el final de las lecturas en curso. */
+  pthread_cond_t io_done;
+
+  struct buffer **hash;
+  /* Todos los buffers, seguidos, para poder registrarlos de una vez como
+     buffers fijos de io_uring (ver uring_register_buffers()). Se van
+     usando por orden; allocated dice cuántos. */
+  struct buffer *pool;
+  /* Cabeza: usado más recientemente. Cola: candidato a reciclar. */
+  struct buffer *lru_head, *lru_tail;
+  unsigned long nbuffers;
+  unsigned long allocated;
+  struct bcache_stats stats;
+} bcache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Lecturas anticipadas pendientes (ver breadahead()). Las protege
+   bcache.lock. Sus buffers están en la caché con io activo y una
+   referencia, que suelta el hilo al terminar de leerlos. */
+struct ra_request
+{
+  int dev;
+  superblock_t *sb;
+  long n;
+  long count;
+};
+
+static struct
+{
+  pthread_t thread;
+  pthread_cond_t wake;
+  int running, stop;
+
+  struct ra_request queue[BCACHE_RA_QUEUE];
+  unsigned head, len;
+} bra = { .wake = PTHREAD_COND_INITIALIZER };
 
 
 
@@ -44,7 +117,8 @@
  *      Routine:       allocblk
  *
  *      Purpose:
- *              Reserva un nuevo bloque de datos.
+ *              Reserva un nuevo bloque de datos, donde quiera que esté
+ *              (ver balloc()).
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
@@ -56,69 +130,338 @@
 long
 allocblk(int dev, superblock_t * const sb)
 {
-  block_t * buff;
-  int block;
+  return balloc(dev, sb, BALLOC_NO_GOAL, NULL);
+}
+
+
+
+
+/*-
+ *      Routine:       freeblk
+ *
+ *      Purpose:
+ *              Libera un bloque de datos.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              block debe apuntar a un bloque absoluto.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+freeblk(int dev, superblock_t * const sb, long block)
+{
+  return bfree(dev, sb, block, 1);
+}
+
 
-  block = sb->free_block_list[sb->free_block_index];
 
-  /* Si la lista parcial de bloques libres sólo contiene un bloque, anotar
-     su número y cargar la lista con lo que haya en el bloque al que apunta. */
-  if (sb->free_block_index == 0)
-    {
-      buff = getblk(dev, sb, block);
-      if (!buff)
-        return -1;
 
-      memcpy(sb->free_block_list, buff, FREE_BLOCK_LIST_SIZE*sizeof(unsigned long));
-      sb->free_block_index = FREE_BLOCK_LIST_SIZE;
+/*-
+ *      Routine:       bcache_init_locked
+ *
+ *      Purpose:
+ *              Como bcache_init(), con el cerrojo de la caché ya cogido.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+bcache_init_locked(unsigned long nbuffers)
+{
+  if (bcache.hash)
+    return -1;
 
-      free(buff);
+  if (nbuffers == 0)
+    nbuffers = BCACHE_DEFAULT_SIZE;
+
+  bcache.hash = calloc(BCACHE_HASH_SIZE, sizeof(struct buffer *));
+  bcache.pool = calloc(nbuffers, sizeof(struct buffer));
+  if (!bcache.hash || !bcache.pool)
+    {
+      free(bcache.hash);
+      free(bcache.pool);
+      bcache.hash = NULL;
+      bcache.pool = NULL;
+      return -1;
     }
+  uring_register_buffers(bcache.pool, nbuffers * sizeof(struct buffer));
 
-  sb->free_block_index--;
+  bcache.nbuffers = nbuffers;
+  bcache.allocated = 0;
+  bcache.lru_head = bcache.lru_tail = NULL;
+  memset(&bcache.stats, 0, sizeof(struct bcache_stats));
 
-  return block;
+  return 0;
 }
 
 
 
 
 /*-
- *      Routine:       freeblk
+ *      Routine:       bcache_init
  *
  *      Purpose:
- *              Añade a la lista de libres un bloque de datos.
+ *              Inicializa la caché de buffers con capacidad para nbuffers
+ *              bloques. Si nbuffers es cero se usa BCACHE_DEFAULT_SIZE.
  *      Conditions:
- *              dev debe corresponder a un gnordofs válido.
- *              sb debe apuntar a un superblock válido.
- *              block debe apuntar a un bloque absoluto.
+ *              La caché no debe estar inicializada.
  *      Returns:
+ *              0 on success.
  *              -1 on error.
  *
  */
 int
-freeblk(int dev, superblock_t * const sb, long block)
+bcache_init(unsigned long nbuffers)
+{
+  int res;
+
+  pthread_mutex_lock(&bcache.lock);
+  res = bcache_init_locked(nbuffers);
+  pthread_mutex_unlock(&bcache.lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bhash_remove
+ *
+ *      Purpose:
+ *              Saca un buffer de su cadena del hash.
+ *      Conditions:
+ *              bp debe apuntar a un buffer que esté en el hash.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+bhash_remove(struct buffer *bp)
+{
+  if (bp->hash_prev)
+    bp->hash_prev->hash_next = bp->hash_next;
+  else
+    bcache.hash[BHASH(bp->n)] = bp->hash_next;
+
+  if (bp->hash_next)
+    bp->hash_next->hash_prev = bp->hash_prev;
+
+  bp->hash_next = bp->hash_prev = NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       bhash_insert
+ *
+ *      Purpose:
+ *              Mete un buffer en la cadena del hash que le corresponde
+ *              según su número de bloque.
+ *      Conditions:
+ *              bp debe apuntar a un buffer que no esté en el hash.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+bhash_insert(struct buffer *bp)
+{
+  struct buffer **head;
+
+  head = &bcache.hash[BHASH(bp->n)];
+
+  bp->hash_prev = NULL;
+  bp->hash_next = *head;
+  if (*head)
+    (*head)->hash_prev = bp;
+  *head = bp;
+}
+
+
+
+
+/*-
+ *      Routine:       blru_touch
+ *
+ *      Purpose:
+ *              Mueve un buffer a la cabeza de la lista LRU (el más
+ *              recientemente usado). Si no estaba en la lista, lo añade.
+ *      Conditions:
+ *              bp debe apuntar a un buffer válido.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+blru_touch(struct buffer *bp)
+{
+  if (bcache.lru_head == bp)
+    return;
+
+  /* Desenganchar de donde esté... */
+  if (bp->lru_prev)
+    bp->lru_prev->lru_next = bp->lru_next;
+  if (bp->lru_next)
+    bp->lru_next->lru_prev = bp->lru_prev;
+  if (bcache.lru_tail == bp)
+    bcache.lru_tail = bp->lru_prev;
+
+  /* ... y ponerlo el primero. */
+  bp->lru_prev = NULL;
+  bp->lru_next = bcache.lru_head;
+  if (bcache.lru_head)
+    bcache.lru_head->lru_prev = bp;
+  bcache.lru_head = bp;
+  if (!bcache.lru_tail)
+    bcache.lru_tail = bp;
+}
+
+
+
+
+/*-
+ *      Routine:       bfind
+ *
+ *      Purpose:
+ *              Busca en la caché el buffer del bloque n, sin referenciarlo
+ *              ni reservar uno nuevo si no está.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *      Returns:
+ *              Un puntero al buffer.
+ *              NULL si el bloque no está en la caché.
+ *
+ */
+static struct buffer *
+bfind(long n)
+{
+  struct buffer *bp;
+
+  if (!bcache.hash)
+    return NULL;
+
+  for (bp = bcache.hash[BHASH(n)]; bp; bp = bp->hash_next)
+    if (bp->n == n)
+      return bp;
+
+  return NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       bwrite
+ *
+ *      Purpose:
+ *              Escribe a disco el contenido de un buffer de datos y lo
+ *              marca como limpio.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *              sb debe apuntar a un superblock válido.
+ *              bp debe apuntar a un buffer válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+bwrite(superblock_t *sb, struct buffer *bp)
+{
+  off_t offset;
+
+  offset = sb->block_zone_base + (off_t) bp->n * sizeof(struct block);
+
+  if (uring_pwrite(bp->dev, &bp->block, sizeof(struct block), offset)
+      < (ssize_t) sizeof(struct block))
+    return -1;
+
+  if (bp->dirty)
+    {
+      bp->dirty = 0;
+      bcache.stats.dirty--;
+    }
+  bcache.stats.writebacks++;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       bget
+ *
+ *      Purpose:
+ *              Busca en la caché el buffer del bloque n. Si no está, recicla
+ *              el buffer libre (sin referencias) usado hace más tiempo,
+ *              salvándolo antes a disco si está sucio. El buffer devuelto
+ *              queda referenciado, pero su contenido sólo es válido si
+ *              bp->valid está activo.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              n debe ser un número de bloque no negativo y VÁLIDO.
+ *      Returns:
+ *              Un puntero al buffer.
+ *              NULL on error.
+ *
+ */
+static struct buffer *
+bget(int dev, superblock_t *sb, long n)
 {
-  block_t buff;
+  struct buffer *bp;
 
-  sb->free_block_index++;
+  if (!bcache.hash && bcache_init_locked(0) < 0)
+    return NULL;
+
+  bp = bfind(n);
+  if (bp)
+    {
+      bp->refcount++;
+      blru_touch(bp);
+      return bp;
+    }
 
-  /* Si la lista parcial de bloques libres está llena, guardarla en el nuevo
-     bloque libre.  */
-  if (sb->free_block_index == FREE_BLOCK_LIST_SIZE)
+  if (bcache.allocated < bcache.nbuffers)
+    bp = &bcache.pool[bcache.allocated++];
+  else
     {
-      memset(&buff, 0, sizeof(block_t));
-      memcpy(&buff, sb->free_block_list, FREE_BLOCK_LIST_SIZE*sizeof(unsigned long));
+      /* Reciclar el buffer libre menos recientemente usado. */
+      for (bp = bcache.lru_tail; bp && (bp->refcount || bp->io); bp = bp->lru_prev)
+        ;
+      if (!bp)
+        {
+          DEBUG_VERBOSE(">> bget >> Todos los buffers están en uso!\n");
+          return NULL;
+        }
 
-      if (writeblk(dev, sb, block, &buff) < 0)
-        return -1;
-      
-      sb->free_block_index = 0;
+      if (bp->dirty && bwrite(sb, bp) < 0)
+        return NULL;
+
+      bhash_remove(bp);
+      bcache.stats.evictions++;
     }
 
-  sb->free_block_list[sb->free_block_index] = block;
+  bp->n = n;
+  bp->dev = dev;
+  bp->refcount = 1;
+  bp->valid = 0;
+  bp->dirty = 0;
+  bp->io = 0;
+  bhash_insert(bp);
+  blru_touch(bp);
 
-  return 0;
+  return bp;
 }
 
 
@@ -128,7 +471,9 @@ freeblk(int dev, superblock_t * const sb, long block)
  *      Routine:       getblk
  *
  *      Purpose:
- *              Lee un bloque de datos de disco.
+ *              Obtiene un bloque de datos, de la caché de buffers si está
+ *              en ella o leyéndolo de disco si no. El bloque devuelto debe
+ *              liberarse con brelse() y NUNCA con free().
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
@@ -141,63 +486,154 @@ freeblk(int dev, superblock_t * const sb, long block)
 block_t *
 getblk(int dev, superblock_t *sb, long n)
 {
-  int offset;
-  block_t *datablock;
+  off_t offset;
+  struct buffer *bp;
+
+  ssize_t res;
 
   if (n<0)
     return NULL;
 
-  offset = sb->block_zone_base + n * sizeof(struct block);
-
-  if (lseek(dev, offset, SEEK_SET) < 0)
-    return NULL;
+  pthread_mutex_lock(&bcache.lock);
 
-  datablock = malloc(sizeof(struct block));
-  if (datablock == NULL)
-    return NULL;
+  bp = bget(dev, sb, n);
+  if (!bp)
+    {
+      pthread_mutex_unlock(&bcache.lock);
+      return NULL;
+    }
 
-  memset(datablock, 0, sizeof(struct block));
+  /* Si otro hilo lo está leyendo, esperar a que termine. */
+  while (bp->io)
+    pthread_cond_wait(&bcache.io_done, &bcache.lock);
 
-  if (read(dev, datablock, sizeof(struct block)) < sizeof(struct block))
+  if (bp->valid)
     {
-      free(datablock);
-      return NULL;
+      bcache.stats.hits++;
+      pthread_mutex_unlock(&bcache.lock);
+      return &bp->block;
     }
 
-  return datablock;
+  bcache.stats.misses++;
+  bp->io = 1;
+  pthread_mutex_unlock(&bcache.lock);
+
+  offset = sb->block_zone_base + (off_t) n * sizeof(struct block);
+  res = journal_read(dev, &bp->block, sizeof(struct block), offset);
+
+  pthread_mutex_lock(&bcache.lock);
+  bp->io = 0;
+  if (res == sizeof(struct block))
+    bp->valid = 1;
+  else
+    bp->refcount--;
+  pthread_cond_broadcast(&bcache.io_done);
+  pthread_mutex_unlock(&bcache.lock);
+
+  return res == sizeof(struct block) ? &bp->block : NULL;
 }
 
 
 
 
 /*-
- *      Routine:       writeblk
+ *      Routine:       brelse
+ *
+ *      Purpose:
+ *              Libera un bloque obtenido con getblk(). El buffer sigue en
+ *              la caché hasta que haga falta reciclarlo.
+ *      Conditions:
+ *              datablock debe ser un bloque devuelto por getblk() o NULL.
+ *      Returns:
+ *              none
+ *
+ */
+void
+brelse(block_t *datablock)
+{
+  struct buffer *bp;
+
+  if (!datablock)
+    return;
+
+  bp = (struct buffer *) datablock;
+
+  pthread_mutex_lock(&bcache.lock);
+  if (bp->refcount > 0)
+    bp->refcount--;
+  pthread_mutex_unlock(&bcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       bdirty
  *
  *      Purpose:
- *              Escribe un bloque de datos de disco.
+ *              Copia un bloque en su buffer de la caché. Si es de datos,
+ *              lo deja sucio y como del inodo owner. Si es de metadatos
+ *              (meta distinto de cero), lo deja limpio y lo manda ya al
+ *              diario, fuera de bcache.lock: el diario lo tiene desde ese
+ *              momento, y un volcado o un reciclado del buffer no tienen
+ *              que escribirlo.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
  *              n debe ser un número de bloque no negativo y VÁLIDO.
- *              datablock debe apuntar a un block_t válido.
+ *              datablock debe apuntar a un block_t válido, ya sea uno
+ *              obtenido con getblk() o cualquier otro.
  *      Returns:
  *              -1 on error.
  *
  */
-int
-writeblk(int dev, superblock_t *sb, long n, block_t *datablock)
+static int
+bdirty(int dev, superblock_t *sb, long n, block_t *datablock, char meta,
+       int owner)
 {
-  int offset;
+  struct buffer *bp;
 
   if (n<0 || datablock==NULL)
     return -1;
 
-  offset = sb->block_zone_base + n * sizeof(struct block);
+  pthread_mutex_lock(&bcache.lock);
 
-  if (lseek(dev, offset, SEEK_SET) < 0)
-    return -1;
+  bp = bget(dev, sb, n);
+  if (!bp)
+    {
+      pthread_mutex_unlock(&bcache.lock);
+      return -1;
+    }
+
+  while (bp->io)
+    pthread_cond_wait(&bcache.io_done, &bcache.lock);
+
+  if (&bp->block != datablock)
+    memcpy(&bp->block, datablock, sizeof(struct block));
+
+  bp->valid = 1;
+  bp->owner = owner;
+  if (!meta && !bp->dirty)
+    {
+      bp->dirty = 1;
+      bcache.stats.dirty++;
+    }
+  else if (meta && bp->dirty)
+    {
+      /* Era de datos: lo que tuviera ya no se debe escribir. */
+      bp->dirty = 0;
+      bcache.stats.dirty--;
+    }
 
-  if (write(dev, datablock, sizeof(struct block)) < sizeof(struct block))
+  bp->refcount--;
+
+  pthread_mutex_unlock(&bcache.lock);
+
+  if (meta
+      && journal_write(dev, datablock, sizeof(struct block),
+                       sb->block_zone_base + (off_t) n * sizeof(struct block),
+                       owner)
+      < sizeof(struct block))
     return -1;
 
   return 0;
@@ -207,107 +643,766 @@ writeblk(int dev, superblock_t *sb, long n, block_t *datablock)
 
 
 /*-
-  *      Routine:       free_block_list_init
-  *
-  *      Purpose:
-  *              Inicializa una lista de inodos.
-  *      Conditions:
-  *              fd debe corresponder a un fichero abierto para escritura.
-  *              sb debe apuntar a un superblock_t inicializado.
-  *      Returns:
-  *              0 on success.
-  *              -1 on error.
-  *
-  */
+ *      Routine:       writeblk
+ *
+ *      Purpose:
+ *              Escribe un bloque de datos. La escritura se hace en la caché
+ *              de buffers y el bloque queda sucio hasta que se recicle su
+ *              buffer o se llame a bflush() o bflush_inode(). owner es el
+ *              número del inodo del archivo al que pertenece.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              n debe ser un número de bloque no negativo y VÁLIDO.
+ *              datablock debe apuntar a un block_t válido, ya sea uno
+ *              obtenido con getblk() o cualquier otro.
+ *      Returns:
+ *              -1 on error.
+ *
+ */
 int
-free_block_list_init(int fd, const superblock_t * const sb)
+writeblk(int dev, superblock_t *sb, long n, block_t *datablock, unsigned owner)
 {
-  unsigned int i;
-  unsigned int offset, block_count;
-  unsigned long sublist[FREE_BLOCK_LIST_SIZE], acc;
-
-  offset = sb->block_zone_base + sb->free_block_list[0] * sizeof(struct block);
+  return bdirty(dev, sb, n, datablock, 0, owner);
+}
 
-  acc = sb->free_block_list[0];
-  block_count = sb->block_count;
-  while(acc < block_count)
-    {
-      for (i=1; i<=FREE_BLOCK_LIST_SIZE; i++)
-        {
-          acc++;
-          sublist[FREE_BLOCK_LIST_SIZE-i] = acc;
-        }
 
-      lseek(fd, offset , SEEK_SET);
-      
-      if (write(fd, &sublist, sizeof(sublist)) < sizeof(sublist))
-        return -1;
 
-      offset += FREE_BLOCK_LIST_SIZE * sizeof(struct block);
-    }
 
-  return 0;
+/*-
+ *      Routine:       writemeta
+ *
+ *      Purpose:
+ *              Como writeblk(), para bloques de metadatos (índices,
+ *              extents, mapas de bits, directorios): en vez de quedarse
+ *              sucio en la caché, el bloque se anota ya en la transacción
+ *              en curso del diario (ver journal_write()). owner es el
+ *              inodo del archivo cuyos bloques señala, o B_NO_OWNER.
+ *      Conditions:
+ *              Las de writeblk().
+ *      Returns:
+ *              -1 on error.
+ *
+ */
+int
+writemeta(int dev, superblock_t *sb, long n, block_t *datablock, int owner)
+{
+  return bdirty(dev, sb, n, datablock, 1, owner);
 }
 
 
 
 
 /*-
-  *      Routine:       print_free_block_list
-  *
-  *      Purpose:
-  *              Muestra en pantalla un volcado de la lista de nodos libres.
-  *      Conditions:
-  *              fd debe corresponder a un fichero abierto para lectura y
-  *              que corresponda a un sistema de archivos inicializado.
-  *              sb debe apuntar al superblock_t correspondiente al sistema
-  *              de archivos de fd.
-  *      Returns:
-  *              none
-  *
-  */
-void
-print_free_block_list(int fd, const superblock_t * const sb)
+ *      Routine:       writeblks
+ *
+ *      Purpose:
+ *              Escribe directamente a disco, en una sola operación, count
+ *              bloques contiguos a partir del bloque n. Las copias de esos
+ *              bloques que haya en la caché se actualizan y quedan limpias.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              n y count deben describir un rango de bloques VÁLIDO.
+ *              data debe apuntar a count bloques de datos.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+writeblks(int dev, superblock_t *sb, long n, long count, const block_t *data)
 {
-  unsigned int i;
-  unsigned int offset, block_count, next;
-  unsigned int block_zone_base;
-  unsigned long sublist[FREE_BLOCK_LIST_SIZE];
-
-  block_zone_base = sb->block_zone_base;
-
-  printf("Superblock free list: ");
-  for (i=0; i<FREE_BLOCK_LIST_SIZE/8-1; i++)
-    {
-      printf("%d,", sb->free_block_list[i]);
-    }
-  printf("%d...\n", sb->free_block_list[i]);
+  long i;
+  off_t offset;
+  size_t size;
+  struct buffer *bp;
 
-  block_count = sb->block_count - FREE_BLOCK_LIST_SIZE;
-  next = sb->free_block_list[0];
+  if (n<0 || count<=0 || data==NULL)
+    return -1;
 
-  offset = block_zone_base + next * sizeof(struct block);
-  while (block_count > 0)
+  pthread_mutex_lock(&bcache.lock);
+  for (i=0; i<count; i++)
     {
-      printf("LEYENDO BLOQUE %u (0x%x): ", next, offset );
+      bp = bfind(n+i);
+      if (!bp)
+        continue;
 
-      lseek(fd, offset, SEEK_SET);
-      if (read(fd, &sublist, sizeof(sublist)) < sizeof(sublist))
+      /* Si se está leyendo, esperar y volver a buscarlo: sin referencia,
+         el buffer puede haberse reciclado mientras tanto. */
+      if (bp->io)
         {
-          printf("########## Error! #########\n");
-          return;
+          pthread_cond_wait(&bcache.io_done, &bcache.lock);
+          i--;
+          continue;
         }
 
-      for (i=0; i<FREE_BLOCK_LIST_SIZE/8-1; i++)
+      memcpy(&bp->block, &data[i], sizeof(struct block));
+      bp->valid = 1;
+      if (bp->dirty)
         {
-          printf("%u,", sublist[i]);
+          bp->dirty = 0;
+          bcache.stats.dirty--;
         }
-      printf("%u...\n", sublist[i]);
-
-      next = sublist[0];
-      offset = block_zone_base + next * sizeof(struct block);
-      block_count -= FREE_BLOCK_LIST_SIZE;
     }
+  bcache.stats.writebacks += count;
+  pthread_mutex_unlock(&bcache.lock);
+
+  offset = sb->block_zone_base + (off_t) n * sizeof(struct block);
+  size = count * sizeof(struct block);
+
+  if (uring_pwrite(dev, data, size, offset) < (ssize_t) size)
+    return -1;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       readblks
+ *
+ *      Purpose:
+ *              Lee count bloques contiguos a partir del bloque n. Los que
+ *              están en la caché (que pueden ser más recientes que los de
+ *              disco, o haberse leído por anticipado) se copian de ella, y
+ *              cada tramo seguido de los que no están se lee directamente
+ *              de disco en una sola operación. Las de todos los tramos
+ *              se mandan a la vez (ver uring_readv()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              n y count deben describir un rango de bloques VÁLIDO.
+ *              data debe apuntar a sitio para count bloques.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+readblks(int dev, superblock_t *sb, long n, long count, block_t *data)
+{
+  long i, j;
+  unsigned long nops = 0;
+  int res = 0;
+  struct buffer *bp, **pinned;
+  struct iovec *iov;
+  struct uring_op *ops;
+
+  if (n<0 || count<=0 || data==NULL)
+    return -1;
+
+  pinned = calloc(count, sizeof(struct buffer *));
+  iov = malloc(count * sizeof(struct iovec));
+  ops = malloc(count * sizeof(struct uring_op));
+  if (!pinned || !iov || !ops)
+    {
+      free(pinned);
+      free(iov);
+      free(ops);
+      return -1;
+    }
+
+  /* Retener los buffers que ya estén en la caché, para que nadie los
+     escriba y los recicle mientras se lee de disco. Los que se estén
+     leyendo (por anticipado, normalmente) se esperan. */
+  pthread_mutex_lock(&bcache.lock);
+  for (i=0; i<count; i++)
+    {
+      bp = bfind(n+i);
+      if (bp && bp->io)
+        {
+          pthread_cond_wait(&bcache.io_done, &bcache.lock);
+          i--;
+          continue;
+        }
+      if (bp && bp->valid)
+        {
+          bp->refcount++;
+          pinned[i] = bp;
+        }
+    }
+  pthread_mutex_unlock(&bcache.lock);
+
+  for (i=0; i<count; i=j)
+    {
+      if (pinned[i])
+        {
+          j = i+1;
+          continue;
+        }
+
+      for (j=i+1; j<count && !pinned[j]; j++)
+        ;
+
+      iov[nops].iov_base = &data[i];
+      iov[nops].iov_len = (j-i) * sizeof(struct block);
+      ops[nops].iov = &iov[nops];
+      ops[nops].iovcnt = 1;
+      ops[nops].offset = sb->block_zone_base + (off_t) (n+i) * sizeof(struct block);
+      nops++;
+    }
+
+  if (nops > 0 && journal_readops(dev, ops, nops) < 0)
+    res = -1;
+
+  pthread_mutex_lock(&bcache.lock);
+  for (i=0; i<count; i++)
+    {
+      if (pinned[i])
+        {
+          memcpy(&data[i], &pinned[i]->block, sizeof(struct block));
+          pinned[i]->refcount--;
+          bcache.stats.hits++;
+        }
+      else
+        bcache.stats.misses++;
+    }
+  pthread_mutex_unlock(&bcache.lock);
+
+  free(pinned);
+  free(iov);
+  free(ops);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       breadahead
+ *
+ *      Purpose:
+ *              Pide que se lean por anticipado a la caché los count
+ *              bloques contiguos a partir del bloque n, sin esperar a que
+ *              se lean. Los que ya estén en la caché se saltan. Es sólo
+ *              una sugerencia: si no hay buffers libres, sitio en la cola
+ *              o hilo de lectura (ver bcache_readahead_start()), se deja
+ *              de pedir sin más.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              n y count deben describir un rango de bloques VÁLIDO.
+ *      Returns:
+ *              Número de bloques pedidos.
+ *
+ */
+long
+breadahead(int dev, superblock_t *sb, long n, long count)
+{
+  long i, start, queued = 0;
+  struct buffer *bp = NULL;
+  struct ra_request *req;
+
+  if (n<0 || count<=0)
+    return 0;
+
+  pthread_mutex_lock(&bcache.lock);
+
+  for (i=0; bra.running && i<count && bra.len<BCACHE_RA_QUEUE; )
+    {
+      if (bfind(n+i))
+        {
+          i++;
+          continue;
+        }
+
+      /* Un tramo seguido de bloques que no están: una petición. */
+      for (start=i; i<count && !bfind(n+i); i++)
+        {
+          bp = bget(dev, sb, n+i);
+          if (!bp)
+            break;
+          bp->io = 1;
+        }
+
+      if (i > start)
+        {
+          req = &bra.queue[(bra.head + bra.len) % BCACHE_RA_QUEUE];
+          req->dev = dev;
+          req->sb = sb;
+          req->n = n+start;
+          req->count = i-start;
+          bra.len++;
+          queued += i-start;
+        }
+
+      if (!bp)
+        break;
+    }
+
+  if (queued)
+    {
+      bcache.stats.readaheads += queued;
+      pthread_cond_signal(&bra.wake);
+    }
+
+  pthread_mutex_unlock(&bcache.lock);
+
+  return queued;
+}
+
+
+
+
+/*-
+ *      Routine:       bra_complete
+ *
+ *      Purpose:
+ *              Da por terminada una lectura anticipada: si no hubo error,
+ *              sus buffers pasan a ser válidos. En cualquier caso, se
+ *              sueltan.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *              req debe apuntar a una petición sacada de la cola.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+bra_complete(const struct ra_request *req, int ok)
+{
+  long i;
+  struct buffer *bp;
+
+  for (i=0; i<req->count; i++)
+    {
+      bp = bfind(req->n+i);
+      if (ok)
+        bp->valid = 1;
+      bp->io = 0;
+      bp->refcount--;
+    }
+
+  pthread_cond_broadcast(&bcache.io_done);
+}
+
+
+
+
+/*-
+ *      Routine:       bra_main
+ *
+ *      Purpose:
+ *              Hilo que atiende las lecturas anticipadas, leyendo cada
+ *              petición de una vez directamente en sus buffers, y todas
+ *              las que haya en cola a la vez, hasta que se le pide que
+ *              pare.
+ *      Conditions:
+ *              Lo arranca bcache_readahead_start().
+ *      Returns:
+ *              NULL
+ *
+ */
+static void *
+bra_main(void *arg __attribute__((unused)))
+{
+  struct ra_request req[BCACHE_RA_QUEUE], r;
+  struct uring_op ops[BCACHE_RA_QUEUE];
+  struct iovec *iov;
+  unsigned k, nreq;
+  long i;
+
+  pthread_mutex_lock(&bcache.lock);
+  while (!bra.stop)
+    {
+      if (bra.len == 0)
+        {
+          pthread_cond_wait(&bra.wake, &bcache.lock);
+          continue;
+        }
+
+      /* Todas las peticiones pendientes del mismo dispositivo van
+         juntas, para que el disco tenga varias lecturas en cola. Con io
+         activo nadie recicla los buffers: se pueden llenar sin tener el
+         cerrojo. */
+      nreq = 0;
+      while (bra.len > 0
+             && (nreq == 0 || bra.queue[bra.head].dev == req[0].dev))
+        {
+          r = bra.queue[bra.head];
+          bra.head = (bra.head + 1) % BCACHE_RA_QUEUE;
+          bra.len--;
+
+          iov = malloc(r.count * sizeof(struct iovec));
+          if (!iov)
+            {
+              bra_complete(&r, 0);
+              continue;
+            }
+          for (i=0; i<r.count; i++)
+            {
+              iov[i].iov_base = &bfind(r.n+i)->block;
+              iov[i].iov_len = sizeof(struct block);
+            }
+
+          req[nreq] = r;
+          ops[nreq].iov = iov;
+          ops[nreq].iovcnt = r.count;
+          ops[nreq].offset = r.sb->block_zone_base
+            + (off_t) r.n * sizeof(struct block);
+          nreq++;
+        }
+      pthread_mutex_unlock(&bcache.lock);
+
+      if (nreq > 0)
+        journal_readops(req[0].dev, ops, nreq);
+
+      pthread_mutex_lock(&bcache.lock);
+      for (k=0; k<nreq; k++)
+        {
+          bra_complete(&req[k], ops[k].res
+                       == (ssize_t) (req[k].count * sizeof(struct block)));
+          free((void *) ops[k].iov);
+        }
+    }
+  pthread_mutex_unlock(&bcache.lock);
+
+  return NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       bcache_readahead_start
+ *
+ *      Purpose:
+ *              Arranca el hilo de las lecturas anticipadas. Hasta
+ *              entonces, breadahead() no hace nada.
+ *      Conditions:
+ *              La caché debe estar inicializada.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+bcache_readahead_start(void)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&bcache.lock);
+  if (!bra.running)
+    {
+      bra.stop = 0;
+      if (pthread_create(&bra.thread, NULL, bra_main, NULL) == 0)
+        bra.running = 1;
+      else
+        res = -1;
+    }
+  pthread_mutex_unlock(&bcache.lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bcache_readahead_stop
+ *
+ *      Purpose:
+ *              Para el hilo de las lecturas anticipadas, y suelta sin
+ *              leerlos los buffers de las peticiones que queden.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+bcache_readahead_stop(void)
+{
+  pthread_mutex_lock(&bcache.lock);
+  if (!bra.running)
+    {
+      pthread_mutex_unlock(&bcache.lock);
+      return;
+    }
+  bra.stop = 1;
+  pthread_cond_signal(&bra.wake);
+  pthread_mutex_unlock(&bcache.lock);
+
+  pthread_join(bra.thread, NULL);
+
+  pthread_mutex_lock(&bcache.lock);
+  while (bra.len > 0)
+    {
+      bra_complete(&bra.queue[bra.head], 0);
+      bra.head = (bra.head + 1) % BCACHE_RA_QUEUE;
+      bra.len--;
+    }
+  bra.running = 0;
+  pthread_mutex_unlock(&bcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       owner_cmp
+ *
+ *      Purpose:
+ *              Compara dos números de inodo, para qsort() y bsearch().
+ *      Conditions:
+ *              a y b deben apuntar a sendos int.
+ *      Returns:
+ *              <0, 0 o >0, como strcmp().
+ *
+ */
+static int
+owner_cmp(const void *a, const void *b)
+{
+  int x = *(const int *) a, y = *(const int *) b;
+
+  return (x > y) - (x < y);
+}
+
+
+
+
+/*-
+ *      Routine:       bsync_want_p
+ *
+ *      Purpose:
+ *              Dice si bsync() tiene que escribir el buffer bp.
+ *      Conditions:
+ *              El llamante debe tener bcache.lock.
+ *      Returns:
+ *              Distinto de cero si está sucio y es de dev y de uno de los
+ *              nowners inodos de owners (o de cualquiera, si es NULL).
+ *
+ */
+static int
+bsync_want_p(const struct buffer *bp, int dev, const int *owners,
+             unsigned long nowners)
+{
+  return bp->dirty && bp->dev == dev
+    && (!owners || bsearch(&bp->owner, owners, nowners, sizeof(int),
+                           owner_cmp));
+}
+
+
+
+
+/*-
+ *      Routine:       bsync
+ *
+ *      Purpose:
+ *              Escribe a disco los buffers de datos sucios de los nowners
+ *              inodos de owners, ordenados de menor a mayor (o de todos,
+ *              si owners es NULL), de una pasada,
+ *              ordenados y juntando los bloques seguidos (ver
+ *              writeback()). Los de metadatos nunca están sucios: ya
+ *              están en el diario. Mientras se escriben, los buffers
+ *              quedan con una referencia y io activo, y bcache.lock
+ *              libre para los demás.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+bsync(int dev, superblock_t *sb, const int *owners, unsigned long nowners)
+{
+  struct buffer *bp, **data;
+  struct wb_extent *v;
+  unsigned long i, n = 0;
+  int res = 0;
+
+  pthread_mutex_lock(&bcache.lock);
+
+  /* Si otro bsync() está escribiendo alguno, esperar a que acabe: al
+     volver, lo que estaba sucio tiene que estar en disco. */
+ again:
+  for (bp = bcache.lru_head; bp; bp = bp->lru_next)
+    if (bp->io && bsync_want_p(bp, dev, owners, nowners))
+      {
+        pthread_cond_wait(&bcache.io_done, &bcache.lock);
+        goto again;
+      }
+
+  data = malloc((bcache.stats.dirty ? bcache.stats.dirty : 1)
+                * sizeof(struct buffer *));
+  v = malloc((bcache.stats.dirty ? bcache.stats.dirty : 1)
+             * sizeof(struct wb_extent));
+  if (!data || !v)
+    {
+      free(data);
+      free(v);
+      pthread_mutex_unlock(&bcache.lock);
+      return -1;
+    }
+
+  for (bp = bcache.lru_head; bp; bp = bp->lru_next)
+    {
+      if (!bsync_want_p(bp, dev, owners, nowners))
+        continue;
+
+      bp->refcount++;
+      bp->io = 1;
+      v[n].offset = sb->block_zone_base + (off_t) bp->n * sizeof(struct block);
+      v[n].data = &bp->block;
+      v[n].len = sizeof(struct block);
+      data[n++] = bp;
+    }
+
+  pthread_mutex_unlock(&bcache.lock);
+
+  if (n > 0 && writeback(dev, v, n) < 0)
+    res = -1;
+
+  pthread_mutex_lock(&bcache.lock);
+  for (i=0; i<n; i++)
+    {
+      if (res == 0)
+        {
+          data[i]->dirty = 0;
+          bcache.stats.dirty--;
+          bcache.stats.writebacks++;
+        }
+      data[i]->io = 0;
+      data[i]->refcount--;
+    }
+  if (n > 0)
+    pthread_cond_broadcast(&bcache.io_done);
+  pthread_mutex_unlock(&bcache.lock);
+
+  free(data);
+  free(v);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       bflush
+ *
+ *      Purpose:
+ *              Escribe a disco todos los buffers sucios de la caché (ver
+ *              bsync()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+bflush(int dev, superblock_t *sb)
+{
+  return bsync(dev, sb, NULL, 0);
+}
+
+
+
+
+/*-
+ *      Routine:       bflush_inode
+ *
+ *      Purpose:
+ *              Escribe a disco los buffers de datos sucios del archivo
+ *              con inodo n. Los de los demás archivos se quedan en la
+ *              caché.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+bflush_inode(int dev, superblock_t *sb, unsigned n)
+{
+  int owner = n;
+
+  return bsync(dev, sb, &owner, 1);
+}
+
+
+
+
+/*-
+ *      Routine:       bflush_owners
+ *
+ *      Purpose:
+ *              Escribe a disco los buffers de datos sucios de los n
+ *              archivos cuyos inodos están en owners (puede haber
+ *              repetidos), de una pasada. Deja owners ordenado.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+bflush_owners(int dev, superblock_t *sb, int *owners, unsigned long n)
+{
+  qsort(owners, n, sizeof(int), owner_cmp);
+
+  return bsync(dev, sb, owners, n);
+}
+
+
+
+
+/*-
+ *      Routine:       bcache_get_stats
+ *
+ *      Purpose:
+ *              Copia los contadores de la caché de buffers.
+ *      Conditions:
+ *              stats debe apuntar a una struct bcache_stats.
+ *      Returns:
+ *              none
+ *
+ */
+void
+bcache_get_stats(struct bcache_stats *stats)
+{
+  pthread_mutex_lock(&bcache.lock);
+  memcpy(stats, &bcache.stats, sizeof(struct bcache_stats));
+  stats->nbuffers = bcache.nbuffers;
+  stats->allocated = bcache.allocated;
+  pthread_mutex_unlock(&bcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       bcache_print_stats_debug
+ *
+ *      Purpose:
+ *              Vuelca al log los contadores de la caché de buffers.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+bcache_print_stats_debug(void)
+{
+  struct bcache_stats stats;
+
+  bcache_get_stats(&stats);
 
-  printf("End of list\n");
+  DEBUG("# bcache: %lu/%lu buffers\n", stats.allocated, stats.nbuffers);
+  DEBUG("# bcache: hits = %lu, misses = %lu\n", stats.hits, stats.misses);
+  DEBUG("# bcache: dirty = %lu, writebacks = %lu, evictions = %lu\n",
+        stats.dirty, stats.writebacks, stats.evictions);
+  DEBUG("# bcache: readaheads = %lu\n", stats.readaheads);
 }
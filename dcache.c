@@ -0,0 +1,406 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-01 15:04:13 holzplatten"
+ *
+ *       File:         dcache.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Jun  1 19:31:18 2013
+ *
+ *       Caché de nombres: (directorio, nombre) -> inodo.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <dcache.h>
+#include <misc.h>
+
+
+struct dentry
+{
+  unsigned parent;
+  char *name;
+  /* Número de inodo, o DCACHE_NEGATIVE si el nombre no existe. */
+  int inode;
+
+  struct dentry *hash_next, *hash_prev;
+  struct dentry *lru_next, *lru_prev;
+};
+
+/* Caché de nombres. Cada directorio es responsable de mantener al día
+   sus entradas: sólo se modifican con el directorio bloqueado en
+   exclusiva (add_dir_entry, del_dir_entry_by_name), y sólo se consultan
+   con él bloqueado al menos en modo compartido. */
+static struct
+{
+  pthread_mutex_t lock;
+
+  struct dentry *hash[DCACHE_HASH_SIZE];
+  /* Usada más recientemente en la cabeza, la siguiente a expulsar en
+     la cola. */
+  struct dentry *lru_head, *lru_tail;
+
+  struct dcache_stats stats;
+} dcache = { PTHREAD_MUTEX_INITIALIZER };
+
+
+
+
+/*-
+ *      Routine:       dhash
+ *
+ *      Purpose:
+ *              Calcula la posición en el hash de una entrada.
+ *      Conditions:
+ *              name debe ser una cadena válida.
+ *      Returns:
+ *              El índice en dcache.hash.
+ *
+ */
+static unsigned
+dhash(unsigned parent, const char * const name)
+{
+  unsigned h = parent;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) name; *p; p++)
+    h = h*31 + *p;
+
+  return h % DCACHE_HASH_SIZE;
+}
+
+
+
+
+/*-
+ *      Routine:       dfind
+ *
+ *      Purpose:
+ *              Busca una entrada en el hash.
+ *      Conditions:
+ *              El llamante debe tener dcache.lock.
+ *      Returns:
+ *              Un puntero a la entrada.
+ *              NULL si no está.
+ *
+ */
+static struct dentry *
+dfind(unsigned parent, const char * const name)
+{
+  struct dentry *d;
+
+  for (d = dcache.hash[dhash(parent, name)]; d; d = d->hash_next)
+    if (d->parent == parent && strcmp(d->name, name) == 0)
+      return d;
+
+  return NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       dlru_unlink
+ *
+ *      Purpose:
+ *              Saca una entrada de la lista LRU.
+ *      Conditions:
+ *              El llamante debe tener dcache.lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+dlru_unlink(struct dentry *d)
+{
+  if (d->lru_prev)
+    d->lru_prev->lru_next = d->lru_next;
+  else
+    dcache.lru_head = d->lru_next;
+
+  if (d->lru_next)
+    d->lru_next->lru_prev = d->lru_prev;
+  else
+    dcache.lru_tail = d->lru_prev;
+}
+
+
+
+
+/*-
+ *      Routine:       dlru_push
+ *
+ *      Purpose:
+ *              Pone una entrada en la cabeza de la lista LRU.
+ *      Conditions:
+ *              El llamante debe tener dcache.lock.
+ *              d no debe estar en la lista.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+dlru_push(struct dentry *d)
+{
+  d->lru_prev = NULL;
+  d->lru_next = dcache.lru_head;
+  if (dcache.lru_head)
+    dcache.lru_head->lru_prev = d;
+  dcache.lru_head = d;
+  if (!dcache.lru_tail)
+    dcache.lru_tail = d;
+}
+
+
+
+
+/*-
+ *      Routine:       dremove
+ *
+ *      Purpose:
+ *              Elimina una entrada de la caché y la libera.
+ *      Conditions:
+ *              El llamante debe tener dcache.lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+dremove(struct dentry *d)
+{
+  if (d->hash_prev)
+    d->hash_prev->hash_next = d->hash_next;
+  else
+    dcache.hash[dhash(d->parent, d->name)] = d->hash_next;
+  if (d->hash_next)
+    d->hash_next->hash_prev = d->hash_prev;
+
+  dlru_unlink(d);
+
+  dcache.stats.entries--;
+
+  free(d->name);
+  free(d);
+}
+
+
+
+
+/*-
+ *      Routine:       dcache_lookup
+ *
+ *      Purpose:
+ *              Busca un nombre de un directorio en la caché.
+ *      Conditions:
+ *              name debe ser una cadena válida.
+ *              inode debe apuntar a un int.
+ *              El directorio parent debe estar bloqueado por el llamante.
+ *      Returns:
+ *              0 si está en la caché, dejando en *inode el número de inodo
+ *              o DCACHE_NEGATIVE si se sabe que el nombre no existe.
+ *              -1 si no está en la caché.
+ *
+ */
+int
+dcache_lookup(unsigned parent, const char * const name, int *inode)
+{
+  struct dentry *d;
+
+  pthread_mutex_lock(&dcache.lock);
+
+  d = dfind(parent, name);
+  if (!d)
+    {
+      dcache.stats.misses++;
+      pthread_mutex_unlock(&dcache.lock);
+      return -1;
+    }
+
+  *inode = d->inode;
+  if (d->inode == DCACHE_NEGATIVE)
+    dcache.stats.negative_hits++;
+  else
+    dcache.stats.hits++;
+
+  dlru_unlink(d);
+  dlru_push(d);
+
+  pthread_mutex_unlock(&dcache.lock);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dcache_enter
+ *
+ *      Purpose:
+ *              Anota en la caché a qué inodo corresponde un nombre de un
+ *              directorio, o que no existe si inode es DCACHE_NEGATIVE.
+ *              Si ya había una entrada para ese nombre se reemplaza.
+ *      Conditions:
+ *              name debe ser una cadena válida.
+ *              El directorio parent debe estar bloqueado por el llamante;
+ *              en exclusiva si se está modificando.
+ *      Returns:
+ *              none
+ *
+ */
+void
+dcache_enter(unsigned parent, const char * const name, int inode)
+{
+  struct dentry *d;
+  unsigned h;
+
+  pthread_mutex_lock(&dcache.lock);
+
+  d = dfind(parent, name);
+  if (d)
+    {
+      d->inode = inode;
+      dlru_unlink(d);
+      dlru_push(d);
+      pthread_mutex_unlock(&dcache.lock);
+      return;
+    }
+
+  /* Hacer sitio si hace falta. */
+  if (dcache.stats.entries >= DCACHE_SIZE && dcache.lru_tail)
+    {
+      dremove(dcache.lru_tail);
+      dcache.stats.evictions++;
+    }
+
+  d = malloc(sizeof(struct dentry));
+  if (!d)
+    {
+      pthread_mutex_unlock(&dcache.lock);
+      return;
+    }
+  d->name = strdup(name);
+  if (!d->name)
+    {
+      free(d);
+      pthread_mutex_unlock(&dcache.lock);
+      return;
+    }
+  d->parent = parent;
+  d->inode = inode;
+
+  h = dhash(parent, name);
+  d->hash_prev = NULL;
+  d->hash_next = dcache.hash[h];
+  if (dcache.hash[h])
+    dcache.hash[h]->hash_prev = d;
+  dcache.hash[h] = d;
+
+  dlru_push(d);
+
+  dcache.stats.entries++;
+
+  pthread_mutex_unlock(&dcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       dcache_purge
+ *
+ *      Purpose:
+ *              Elimina de la caché todas las entradas de un directorio.
+ *              Hay que llamarla cuando se libera su inodo, para que no
+ *              las herede otro que reutilice el mismo número.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+dcache_purge(unsigned parent)
+{
+  struct dentry *d, *next;
+
+  pthread_mutex_lock(&dcache.lock);
+
+  for (d = dcache.lru_head; d; d = next)
+    {
+      next = d->lru_next;
+      if (d->parent == parent)
+        dremove(d);
+    }
+
+  pthread_mutex_unlock(&dcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       dcache_get_stats
+ *
+ *      Purpose:
+ *              Copia los contadores de la caché de nombres.
+ *      Conditions:
+ *              stats debe apuntar a una struct dcache_stats.
+ *      Returns:
+ *              none
+ *
+ */
+void
+dcache_get_stats(struct dcache_stats *stats)
+{
+  pthread_mutex_lock(&dcache.lock);
+  memcpy(stats, &dcache.stats, sizeof(struct dcache_stats));
+  pthread_mutex_unlock(&dcache.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       dcache_print_stats_debug
+ *
+ *      Purpose:
+ *              Vuelca al log los contadores de la caché de nombres.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+dcache_print_stats_debug(void)
+{
+  struct dcache_stats stats;
+
+  dcache_get_stats(&stats);
+
+  DEBUG("# dcache: %lu/%d entries\n", stats.entries, DCACHE_SIZE);
+  DEBUG("# dcache: hits = %lu, negative hits = %lu, misses = %lu, evictions = %lu\n",
+        stats.hits, stats.negative_hits, stats.misses, stats.evictions);
+}
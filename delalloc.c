@@ -0,0 +1,372 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-01 15:04:27 holzplatten"
+ *
+ *       File:         delalloc.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Jun  1 19:38:44 2013
+ *
+ *       Asignación retardada de bloques de datos.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <balloc.h>
+#include <block.h>
+#include <delalloc.h>
+#include <inode.h>
+#include <misc.h>
+#include <superblock.h>
+
+
+/* Bloques retardados entre todos los archivos. */
+static unsigned long delalloc_total;
+
+
+
+
+/*-
+ *      Routine:       delalloc_pending
+ *
+ *      Purpose:
+ *              Dice cuántos bloques retardados hay entre todos los
+ *              archivos.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              El número de bloques.
+ *
+ */
+unsigned long
+delalloc_pending(void)
+{
+  return __atomic_load_n(&delalloc_total, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       dbuf_search
+ *
+ *      Purpose:
+ *              Busca en los bloques retardados de un inodo el primero
+ *              cuyo bloque lógico no es menor que blk.
+ *      Conditions:
+ *              inode debe estar bloqueado por el llamante.
+ *      Returns:
+ *              Su posición en inode->delayed (ndelayed si no hay ninguno).
+ *
+ */
+static unsigned
+dbuf_search(inode_t *inode, long blk)
+{
+  unsigned lo = 0, hi = inode->ndelayed, mid;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (inode->delayed[mid]->blk < blk)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+
+
+
+/*-
+ *      Routine:       delalloc_get
+ *
+ *      Purpose:
+ *              Devuelve la copia en memoria del bloque retardado blk de un
+ *              archivo. Si no la hay y create es distinto de cero, aparta
+ *              un bloque libre y crea la copia, a ceros; si con ella hay
+ *              demasiados bloques retardados, antes vuelca los del propio
+ *              archivo.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS, bloqueado por el
+ *              llamante (en exclusiva si create es distinto de cero).
+ *              blk no debe estar mapeado.
+ *      Returns:
+ *              Un puntero a los datos del bloque, que sólo vale mientras
+ *              se tenga el inodo bloqueado. NO hay que soltarlo.
+ *              NULL si no está (sin create), si no queda sitio o on error.
+ *
+ */
+block_t *
+delalloc_get(int dev, superblock_t * const sb, inode_t *inode,
+             long blk, int create)
+{
+  struct dbuf *db, **delayed;
+  unsigned i, max;
+
+  i = dbuf_search(inode, blk);
+  if (i < inode->ndelayed && inode->delayed[i]->blk == blk)
+    return &inode->delayed[i]->data;
+
+  if (!create)
+    return NULL;
+
+  if (__atomic_load_n(&delalloc_total, __ATOMIC_RELAXED) >= DELALLOC_MAX_BLOCKS
+      && inode->ndelayed > 0)
+    {
+      if (delalloc_flush(dev, sb, inode) < 0)
+        return NULL;
+      i = 0;
+    }
+
+  if (inode->ndelayed == inode->delayed_max)
+    {
+      max = inode->delayed_max ? 2 * inode->delayed_max : 16;
+      delayed = realloc(inode->delayed, max * sizeof(struct dbuf *));
+      if (!delayed)
+        return NULL;
+      inode->delayed = delayed;
+      inode->delayed_max = max;
+    }
+
+  if (breserve(sb, 1) < 0)
+    {
+      DEBUG_VERBOSE(">> delalloc_get >> Error: no queda sitio\n");
+      return NULL;
+    }
+
+  db = malloc(sizeof(struct dbuf));
+  if (!db)
+    {
+      bunreserve(sb, 1);
+      return NULL;
+    }
+  db->blk = blk;
+  memset(&db->data, 0, sizeof(struct block));
+
+  memmove(&inode->delayed[i+1], &inode->delayed[i],
+          (inode->ndelayed - i) * sizeof(struct dbuf *));
+  inode->delayed[i] = db;
+  __atomic_store_n(&inode->ndelayed, inode->ndelayed + 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&delalloc_total, 1, __ATOMIC_RELAXED);
+
+  return &db->data;
+}
+
+
+
+
+/*-
+ *      Routine:       delalloc_next
+ *
+ *      Purpose:
+ *              Devuelve el primer bloque retardado de un archivo que no
+ *              es anterior a blk.
+ *      Conditions:
+ *              inode debe estar bloqueado por el llamante.
+ *      Returns:
+ *              Su número de bloque lógico.
+ *              -1 si no hay ninguno.
+ *
+ */
+long
+delalloc_next(inode_t *inode, long blk)
+{
+  unsigned i;
+
+  i = dbuf_search(inode, blk);
+
+  return i < inode->ndelayed ? inode->delayed[i]->blk : -1;
+}
+
+
+
+
+/*-
+ *      Routine:       delalloc_pending_p
+ *
+ *      Purpose:
+ *              Dice si un inodo tiene bloques retardados sin volcar. Se
+ *              puede llamar sin tener el inodo bloqueado.
+ *      Conditions:
+ *              inode debe apuntar a un inodo válido.
+ *      Returns:
+ *              Distinto de cero si los tiene.
+ *
+ */
+int
+delalloc_pending_p(inode_t *inode)
+{
+  return __atomic_load_n(&inode->ndelayed, __ATOMIC_RELAXED) != 0;
+}
+
+
+
+
+/*-
+ *      Routine:       delalloc_flush
+ *
+ *      Purpose:
+ *              Asigna sitio en disco a los bloques retardados de un
+ *              archivo y los escribe. Cada racha de bloques lógicos
+ *              seguidos se pide de una vez, para que quede seguida en
+ *              disco, y se escribe con una sola operación.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado en exclusiva por el llamante, o
+ *              no tener referencias.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (los bloques que no se hayan podido volcar
+ *              siguen retardados).
+ *
+ */
+int
+delalloc_flush(int dev, superblock_t * const sb, inode_t *inode)
+{
+  struct dbuf **delayed = inode->delayed;
+  block_t *run;
+  unsigned j, done = 0;
+  long ablk, count, k;
+  int res = 0;
+
+  while (done < inode->ndelayed)
+    {
+      /* Racha de bloques lógicos seguidos a partir de done. */
+      for (j = done + 1;
+           j < inode->ndelayed && delayed[j]->blk == delayed[j-1]->blk + 1;
+           j++)
+        ;
+
+      /* Puede que no quepa seguida: se asigna lo que se pueda y se sigue
+         con el resto. */
+      count = j - done;
+      ablk = inode_allocblk(dev, sb, inode, delayed[done]->blk, &count, 1);
+      if (ablk < 0)
+        {
+          res = -1;
+          break;
+        }
+      bunreserve(sb, count);
+
+      run = malloc(count * sizeof(struct block));
+      if (run)
+        {
+          for (k = 0; k < count; k++)
+            memcpy(&run[k], &delayed[done + k]->data, sizeof(struct block));
+          if (writeblks(dev, sb, ablk, count, run) < 0)
+            res = -1;
+          free(run);
+        }
+      else
+        {
+          for (k = 0; k < count; k++)
+            if (writeblk(dev, sb, ablk + k, &delayed[done + k]->data,
+                         inode->n) < 0)
+              res = -1;
+        }
+
+      for (k = 0; k < count; k++)
+        free(delayed[done + k]);
+      done += count;
+    }
+
+  /* Quitar del principio los que ya están en disco. */
+  memmove(&delayed[0], &delayed[done],
+          (inode->ndelayed - done) * sizeof(struct dbuf *));
+  __atomic_store_n(&inode->ndelayed, inode->ndelayed - done, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&delalloc_total, done, __ATOMIC_RELAXED);
+
+  if (done)
+    inode->modified = 1;
+
+  if (inode->ndelayed == 0)
+    {
+      free(inode->delayed);
+      inode->delayed = NULL;
+      inode->delayed_max = 0;
+    }
+
+  if (res < 0)
+    DEBUG(">> delalloc_flush(%d) >> Error: quedan %u bloques sin volcar\n",
+          inode->n, inode->ndelayed);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       delalloc_truncate
+ *
+ *      Purpose:
+ *              Descarta los bloques retardados de un archivo que quedan
+ *              más allá de size, devolviendo sus bloques apartados, y pone
+ *              a ceros el final del que queda cortado.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado en exclusiva por el llamante.
+ *      Returns:
+ *              none
+ *
+ */
+void
+delalloc_truncate(superblock_t * const sb, inode_t *inode, off_t size)
+{
+  unsigned i, j, n;
+  long blk;
+
+  if (inode->ndelayed == 0)
+    return;
+
+  blk = (size + sizeof(struct block) - 1) / sizeof(struct block);
+  i = dbuf_search(inode, blk);
+  n = inode->ndelayed - i;
+
+  if (n)
+    {
+      for (j = i; j < inode->ndelayed; j++)
+        free(inode->delayed[j]);
+      __atomic_store_n(&inode->ndelayed, i, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&delalloc_total, n, __ATOMIC_RELAXED);
+      bunreserve(sb, n);
+    }
+
+  /* El bloque en el que cae size, si está retardado. */
+  if (size % sizeof(struct block) && i > 0
+      && inode->delayed[i-1]->blk == size / sizeof(struct block))
+    memset(&inode->delayed[i-1]->data.data[size % sizeof(struct block)], 0,
+           sizeof(struct block) - size % sizeof(struct block));
+
+  if (inode->ndelayed == 0)
+    {
+      free(inode->delayed);
+      inode->delayed = NULL;
+      inode->delayed_max = 0;
+    }
+}
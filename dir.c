@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <dcache.h>
 #include <dir.h>
 #include <fs.h>
 #include <inode.h>
@@ -39,6 +40,748 @@
 #include <superblock.h>
 
 
+/* Entrada de directorio de la revisión 0 (ver dir_convert()): huecos de
+   tamaño fijo, con inode == -1 en los libres. */
+struct dir_entry_v0 {
+  int inode;
+  unsigned char name[DIR_NAME_MAX+1];
+};
+
+#define DIR_V0_PER_BLOCK (sizeof(struct block) / sizeof(struct dir_entry_v0))
+
+
+
+
+/*-
+ *      Routine:       dirblk_read
+ *
+ *      Purpose:
+ *              Lee el bloque blk de un directorio.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un inodo de directorio válido.
+ *              b debe apuntar a un block_t.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+dirblk_read(int dev, superblock_t *sb, inode_t *inode, unsigned blk, block_t *b)
+{
+  if (do_read(dev, sb, inode, (void *) b, sizeof(struct block),
+              (off_t) blk * sizeof(struct block)) < sizeof(struct block))
+    {
+      DEBUG_VERBOSE("Error leyendo el bloque %u del I_DIR %d", blk, inode->n);
+      return -1;
+    }
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_write
+ *
+ *      Purpose:
+ *              Escribe el bloque blk de un directorio.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un inodo de directorio válido.
+ *              b debe apuntar a un block_t.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+dirblk_write(int dev, superblock_t *sb, inode_t *inode, unsigned blk,
+             const block_t *b)
+{
+  if (do_write(dev, sb, inode, (const char *) b, sizeof(struct block),
+               (off_t) blk * sizeof(struct block)) < sizeof(struct block))
+    return -1;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_init
+ *
+ *      Purpose:
+ *              Prepara un bloque de directorio vacío: un único registro
+ *              libre que lo ocupa entero.
+ *      Conditions:
+ *              b debe apuntar a un block_t.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+dirblk_init(block_t *b)
+{
+  struct dir_record *rec = (struct dir_record *) b->data;
+
+  memset(b, 0, sizeof(struct block));
+  rec->inode = -1;
+  rec->rec_len = sizeof(struct block);
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_next
+ *
+ *      Purpose:
+ *              Recorre los registros de un bloque de directorio. Con
+ *              *offset == 0 devuelve el primero, y deja *offset apuntando
+ *              al siguiente.
+ *      Conditions:
+ *              b debe apuntar a un bloque de directorio.
+ *              offset debe apuntar a un unsigned.
+ *      Returns:
+ *              Un puntero al registro.
+ *              NULL al llegar al final del bloque o si el registro está
+ *              corrupto.
+ *
+ */
+static struct dir_record *
+dirblk_next(block_t *b, unsigned *offset)
+{
+  struct dir_record *rec;
+
+  if (*offset >= sizeof(struct block))
+    return NULL;
+
+  rec = (struct dir_record *) &b->data[*offset];
+  if (rec->rec_len < sizeof(struct dir_record)
+      || rec->rec_len % 4
+      || *offset + rec->rec_len > sizeof(struct block)
+      || (rec->inode != -1 && DIR_RECORD_LEN(rec->name_len) > rec->rec_len))
+    {
+      DEBUG_VERBOSE("Registro de directorio corrupto en el offset %u", *offset);
+      return NULL;
+    }
+
+  *offset += rec->rec_len;
+
+  return rec;
+}
+
+
+
+
+/*-
+ *      Routine:       dirrec_match_p
+ *
+ *      Purpose:
+ *              Comprueba si un registro ocupado corresponde a un nombre.
+ *      Conditions:
+ *              rec debe ser un registro válido.
+ *              name debe ser una cadena válida de longitud len.
+ *      Returns:
+ *              Distinto de cero si coinciden.
+ *
+ */
+static int
+dirrec_match_p(const struct dir_record *rec, const char * const name, size_t len)
+{
+  return rec->inode != -1
+    && rec->name_len == len
+    && memcmp(rec->name, name, len) == 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dirrec_to_entry
+ *
+ *      Purpose:
+ *              Copia un registro de disco en una dir_entry_t.
+ *      Conditions:
+ *              rec debe ser un registro ocupado válido.
+ *              de debe apuntar a una dir_entry_t.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+dirrec_to_entry(const struct dir_record *rec, dir_entry_t *de)
+{
+  de->inode = rec->inode;
+  de->type = rec->type;
+  memcpy(de->name, rec->name, rec->name_len);
+  de->name[rec->name_len] = 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_find
+ *
+ *      Purpose:
+ *              Busca un nombre en un bloque de directorio.
+ *      Conditions:
+ *              b debe apuntar a un bloque de directorio.
+ *              de puede ser NULL.
+ *      Returns:
+ *              0 si se encuentra, copiando la entrada en de.
+ *              1 si no está.
+ *              -1 si el bloque está corrupto.
+ *
+ */
+static int
+dirblk_find(block_t *b, const char * const name, dir_entry_t *de)
+{
+  struct dir_record *rec;
+  unsigned offset = 0;
+  size_t len = strlen(name);
+
+  while ((rec = dirblk_next(b, &offset)))
+    if (dirrec_match_p(rec, name, len))
+      {
+        if (de)
+          dirrec_to_entry(rec, de);
+        return 0;
+      }
+
+  return offset == sizeof(struct block) ? 1 : -1;
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_insert
+ *
+ *      Purpose:
+ *              Mete una entrada en el primer hueco de un bloque de
+ *              directorio donde quepa, partiendo el registro si sobra sitio.
+ *      Conditions:
+ *              b debe apuntar a un bloque de directorio.
+ *              de debe ser una entrada válida, con un nombre que no esté
+ *              ya en el bloque.
+ *      Returns:
+ *              0 on success.
+ *              -1 si no cabe.
+ *
+ */
+static int
+dirblk_insert(block_t *b, const dir_entry_t *de)
+{
+  struct dir_record *rec, *new;
+  unsigned offset = 0, used;
+  size_t len = strlen((char *) de->name);
+  unsigned need = DIR_RECORD_LEN(len);
+
+  while ((rec = dirblk_next(b, &offset)))
+    {
+      used = rec->inode == -1 ? 0 : DIR_RECORD_LEN(rec->name_len);
+      if (rec->rec_len - used < need)
+        continue;
+
+      if (used)
+        {
+          /* Partir el registro: el nuevo va en lo que le sobra. */
+          new = (struct dir_record *) ((char *) rec + used);
+          new->rec_len = rec->rec_len - used;
+          rec->rec_len = used;
+          rec = new;
+        }
+
+      rec->inode = de->inode;
+      rec->name_len = len;
+      rec->type = de->type;
+      memcpy(rec->name, de->name, len);
+
+      return 0;
+    }
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       dirblk_delete
+ *
+ *      Purpose:
+ *              Elimina una entrada de un bloque de directorio. Su espacio
+ *              pasa al registro anterior, o queda como registro libre si
+ *              era el primero del bloque.
+ *      Conditions:
+ *              b debe apuntar a un bloque de directorio.
+ *      Returns:
+ *              0 on success.
+ *              -1 si no está.
+ *
+ */
+static int
+dirblk_delete(block_t *b, const char * const name)
+{
+  struct dir_record *rec, *prev = NULL;
+  unsigned offset = 0;
+  size_t len = strlen(name);
+
+  while ((rec = dirblk_next(b, &offset)))
+    {
+      if (dirrec_match_p(rec, name, len))
+        {
+          if (prev)
+            prev->rec_len += rec->rec_len;
+          else
+            rec->inode = -1;
+          return 0;
+        }
+      prev = rec;
+    }
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_hash
+ *
+ *      Purpose:
+ *              Calcula el hash de un nombre (FNV-1a) para el índice de
+ *              los directorios indexados.
+ *      Conditions:
+ *              name debe apuntar a len bytes.
+ *      Returns:
+ *              El hash del nombre.
+ *
+ */
+static unsigned
+dx_hash(const char * const name, size_t len)
+{
+  unsigned h = 2166136261u;
+  size_t i;
+
+  for (i=0; i < len; i++)
+    {
+      h ^= (unsigned char) name[i];
+      h *= 16777619u;
+    }
+
+  return h;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_read_root
+ *
+ *      Purpose:
+ *              Lee la raíz del índice de un directorio indexado.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio indexado.
+ *              root debe apuntar a una struct dx_root.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+dx_read_root(int dev, superblock_t *sb, inode_t *inode, struct dx_root *root)
+{
+  if (dirblk_read(dev, sb, inode, 0, (block_t *) root) < 0)
+    return -1;
+
+  if (root->magic != DX_MAGIC
+      || root->count == 0 || root->count > DX_MAX_ENTRIES)
+    {
+      DEBUG_VERBOSE("Índice corrupto en el I_DIR %d", inode->n);
+      return -1;
+    }
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_find_leaf
+ *
+ *      Purpose:
+ *              Busca en la raíz del índice la hoja que corresponde a un hash.
+ *      Conditions:
+ *              root debe ser una raíz válida.
+ *      Returns:
+ *              La posición de la hoja en root->entries.
+ *
+ */
+static unsigned
+dx_find_leaf(const struct dx_root *root, unsigned hash)
+{
+  unsigned lo = 0, hi = root->count - 1, mid;
+
+  /* La última entrada con entries[i].hash <= hash. entries[0].hash es 0. */
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (root->entries[mid].hash <= hash)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+  return lo;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_split
+ *
+ *      Purpose:
+ *              Parte en dos una hoja de un directorio indexado. La mitad
+ *              de las entradas con hash más alto pasan a una hoja nueva,
+ *              que se añade al índice. Ambas hojas quedan compactadas.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio indexado.
+ *              root debe ser su raíz, y pos la posición de la hoja.
+ *              leaf debe contener la hoja.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+dx_split(int dev, superblock_t *sb, inode_t *inode, struct dx_root *root,
+         unsigned pos, block_t *leaf)
+{
+  /* Como mucho caben sizeof(struct block) / DIR_RECORD_LEN(1) registros. */
+  struct dir_record *recs[sizeof(struct block) / DIR_RECORD_LEN(1)];
+  unsigned hashes[sizeof(struct block) / DIR_RECORD_LEN(1)];
+  struct dir_record *rec;
+  block_t old, new;
+  dir_entry_t de;
+  unsigned offset = 0, count = 0, i, j, m, h, newblk, split_hash;
+
+  if (root->count == DX_MAX_ENTRIES || root->count + 1 >= BLOCKS_PER_INODE)
+    {
+      DEBUG_VERBOSE(">> dx_split >> Error: índice lleno\n");
+      return -1;
+    }
+
+  /* Ordenar las entradas de la hoja por hash (son pocas: inserción). */
+  while ((rec = dirblk_next(leaf, &offset)))
+    {
+      if (rec->inode == -1)
+        continue;
+      h = dx_hash(rec->name, rec->name_len);
+      for (j=count; j > 0 && hashes[j-1] > h; j--)
+        {
+          recs[j] = recs[j-1];
+          hashes[j] = hashes[j-1];
+        }
+      recs[j] = rec;
+      hashes[j] = h;
+      count++;
+    }
+  if (offset != sizeof(struct block) || count < 2)
+    return -1;
+
+  /* Partir por la mitad, pero nunca entre dos entradas con el mismo hash:
+     todas las de un mismo hash tienen que estar en la misma hoja. */
+  for (m = count/2; m < count && hashes[m] == hashes[m-1]; m++)
+    ;
+  if (m == count)
+    for (m = count/2; m > 0 && hashes[m] == hashes[m-1]; m--)
+      ;
+  if (m == 0)
+    return -1;
+
+  split_hash = hashes[m];
+
+  dirblk_init(&old);
+  dirblk_init(&new);
+  for (i=0; i < count; i++)
+    {
+      dirrec_to_entry(recs[i], &de);
+      dirblk_insert(i < m ? &old : &new, &de);
+    }
+
+  /* Las hojas nunca se liberan, así que la siguiente libre es count+1. */
+  newblk = root->count + 1;
+
+  if (dirblk_write(dev, sb, inode, newblk, &new) < 0
+      || dirblk_write(dev, sb, inode, root->entries[pos].block, &old) < 0)
+    return -1;
+
+  for (i = root->count; i > pos+1; i--)
+    root->entries[i] = root->entries[i-1];
+  root->entries[pos+1].hash = split_hash;
+  root->entries[pos+1].block = newblk;
+  root->count++;
+
+  if (dirblk_write(dev, sb, inode, 0, (block_t *) root) < 0)
+    return -1;
+
+  inode->size = (newblk+1) * sizeof(struct block);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_lookup
+ *
+ *      Purpose:
+ *              Busca un nombre en un directorio indexado. Sólo se leen
+ *              la raíz del índice y una hoja.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio indexado.
+ *              de debe apuntar a una dir_entry_t.
+ *      Returns:
+ *              0 si se encuentra, dejando la entrada en de.
+ *              1 si no existe.
+ *              -1 on error.
+ *
+ */
+static int
+dx_lookup(int dev, superblock_t *sb, inode_t *inode, const char * const name,
+          dir_entry_t *de)
+{
+  struct dx_root root;
+  block_t leaf;
+  unsigned blk;
+
+  if (dx_read_root(dev, sb, inode, &root) < 0)
+    return -1;
+
+  blk = root.entries[dx_find_leaf(&root, dx_hash(name, strlen(name)))].block;
+  if (dirblk_read(dev, sb, inode, blk, &leaf) < 0)
+    return -1;
+
+  return dirblk_find(&leaf, name, de);
+}
+
+
+
+
+/*-
+ *      Routine:       dx_insert
+ *
+ *      Purpose:
+ *              Añade una entrada a un directorio indexado, partiendo la
+ *              hoja que le corresponde si está llena.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio indexado.
+ *              de debe ser la entrada a añadir.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (también si el nombre ya existe).
+ *
+ */
+static int
+dx_insert(int dev, superblock_t *sb, inode_t *inode, const dir_entry_t *de)
+{
+  struct dx_root root;
+  block_t leaf;
+  unsigned pos, blk, hash;
+  int tries;
+
+  if (dx_read_root(dev, sb, inode, &root) < 0)
+    return -1;
+
+  hash = dx_hash((char *) de->name, strlen((char *) de->name));
+
+  for (tries = 0; tries < 3; tries++)
+    {
+      pos = dx_find_leaf(&root, hash);
+      blk = root.entries[pos].block;
+      if (dirblk_read(dev, sb, inode, blk, &leaf) < 0)
+        return -1;
+
+      if (tries == 0 && dirblk_find(&leaf, (char *) de->name, NULL) != 1)
+        return -1;
+
+      if (dirblk_insert(&leaf, de) == 0)
+        return dirblk_write(dev, sb, inode, blk, &leaf);
+
+      /* Hoja llena: partirla y volver a buscar. */
+      if (dx_split(dev, sb, inode, &root, pos, &leaf) < 0)
+        return -1;
+    }
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       dx_delete
+ *
+ *      Purpose:
+ *              Elimina una entrada de un directorio indexado.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio indexado.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (también si el nombre no existe).
+ *
+ */
+static int
+dx_delete(int dev, superblock_t *sb, inode_t *inode, const char * const name)
+{
+  struct dx_root root;
+  block_t leaf;
+  unsigned blk;
+
+  if (dx_read_root(dev, sb, inode, &root) < 0)
+    return -1;
+
+  blk = root.entries[dx_find_leaf(&root, dx_hash(name, strlen(name)))].block;
+  if (dirblk_read(dev, sb, inode, blk, &leaf) < 0
+      || dirblk_delete(&leaf, name) < 0)
+    return -1;
+
+  return dirblk_write(dev, sb, inode, blk, &leaf);
+}
+
+
+
+
+/*-
+ *      Routine:       dx_convert
+ *
+ *      Purpose:
+ *              Convierte en indexado un directorio lineal de un solo
+ *              bloque: sus registros pasan a la hoja 1 y el bloque 0 se
+ *              convierte en la raíz del índice.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un directorio lineal de un bloque.
+ *              b debe contener su bloque 0.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+dx_convert(int dev, superblock_t *sb, inode_t *inode, const block_t *b)
+{
+  struct dx_root root;
+
+  DEBUG_VERBOSE(">> dx_convert(inode->n = %d)\n", inode->n);
+
+  memset(&root, 0, sizeof(struct dx_root));
+  root.magic = DX_MAGIC;
+  root.count = 1;
+  root.entries[0].hash = 0;
+  root.entries[0].block = 1;
+
+  /* Primero la hoja, y sólo después se pisa el bloque 0. */
+  if (dirblk_write(dev, sb, inode, 1, b) < 0
+      || dirblk_write(dev, sb, inode, 0, (block_t *) &root) < 0)
+    return -1;
+
+  inode->flags |= I_INDEXED;
+  inode->size = 2 * sizeof(struct block);
+  inode->modified = 1;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       dir_insert
+ *
+ *      Purpose:
+ *              Mete una entrada en un directorio, lineal o indexado. Es
+ *              la parte de add_dir_entry() que no toca el inodo al que
+ *              señala la entrada.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un inodo de directorio válido.
+ *              de debe ser una entrada válida.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (también si el nombre ya está).
+ *
+ */
+static int
+dir_insert(int dev, superblock_t *sb, inode_t *inode, const dir_entry_t *de)
+{
+  block_t b;
+
+  if (inode->flags & I_INDEXED)
+    {
+      if (dx_insert(dev, sb, inode, de) < 0)
+        return -1;
+    }
+  else
+    {
+      /* Los directorios lineales tienen un único bloque: cuando se llena,
+         el directorio pasa a ser indexado. */
+      if (inode->size == 0)
+        {
+          dirblk_init(&b);
+          inode->size = sizeof(struct block);
+        }
+      else
+        {
+          if (dirblk_read(dev, sb, inode, 0, &b) < 0)
+            return -1;
+
+          /* Estoy completamente seguro de que NO quiero entradas con el mismo nombre. >:( */
+          if (dirblk_find(&b, (const char *) de->name, NULL) != 1)
+            return -1;
+        }
+
+      if (dirblk_insert(&b, de) == 0)
+        {
+          if (dirblk_write(dev, sb, inode, 0, &b) < 0)
+            return -1;
+        }
+      else if (dx_convert(dev, sb, inode, &b) < 0
+               || dx_insert(dev, sb, inode, de) < 0)
+        return -1;
+    }
+
+  inode->modified = 1;
+
+  return 0;
+}
+
+
+
+
 /*-
  *      Routine:       add_dir_entry
  *
@@ -57,7 +800,7 @@ int
 add_dir_entry(int dev, superblock_t *sb, inode_t *dir_inode, inode_t *entry_inode,
               const char * const entry_name)
 {
-  int i;
+  int cached;
   dir_entry_t de;
 
   DEBUG_VERBOSE(">> add_dir_entry(dir_inode->n = %d, entry_inode->n = %d, entry_name = %s)\n",
@@ -69,42 +812,22 @@ add_dir_entry(int dev, superblock_t *sb, inode_t *dir_inode, inode_t *entry_inod
       return -1;
     }
 
-  do_lseek(dev, sb, dir_inode, 0, SEEK_SET);
-  for (i=0; i*sizeof(struct dir_entry) < dir_inode->size; i++)
-    {
-      if (do_read(dev, sb, dir_inode, (void *) &de, sizeof(dir_entry_t)) < sizeof(dir_entry_t))
-        {
-          DEBUG_VERBOSE("Error leyendo entrada número %d del I_DIR %d", i, dir_inode->n);
-          return -1;
-        }
-
-      /* Si encuentra una entrada libre (-1), dejar de buscar. */
-      if (de.inode == -1)
-        break;
-
-      /* Estoy completamente seguro de que NO quiero entradas con el mismo nombre. >:( */
-      if (strcmp(de.name, entry_name) == 0)
-        return -1;
-    }
+  if (strlen(entry_name) > DIR_NAME_MAX)
+    return -1;
 
-  if (i == DIR_MAX_ENTRIES)
-    {
-      DEBUG_VERBOSE(">> add_dir_entry >> Error: directorio lleno\n");
-      return -1;
-    }
+  /* Si la caché sabe que el nombre ya existe, no hace falta buscar. */
+  if (dcache_lookup(dir_inode->n, entry_name, &cached) == 0
+      && cached != DCACHE_NEGATIVE)
+    return -1;
 
-  DEBUG_VERBOSE(">> add_dir_entry >> i = %d\n", i);
   de.inode = entry_inode->n;
-  strcpy(de.name, entry_name);
+  de.type = entry_inode->type;
+  strcpy((char *) de.name, entry_name);
 
-  do_lseek(dev, sb, dir_inode, i*sizeof(dir_entry_t), SEEK_SET);
-  if (do_write(dev, sb, dir_inode, (void *) &de, sizeof(dir_entry_t))
-                                                           < sizeof(dir_entry_t))
+  if (dir_insert(dev, sb, dir_inode, &de) < 0)
     return -1;
 
-  dir_inode->size += sizeof(struct dir_entry);
-  if (iput(dev, sb, dir_inode) != 0)
-    return -1;
+  dcache_enter(dir_inode->n, entry_name, entry_inode->n);
 
   /* Ya sólo falta incrementar en 1 el número de enlaces del inodo apuntado por la
      entrada que se acaba de insertar. */
@@ -121,7 +844,6 @@ add_dir_entry(int dev, superblock_t *sb, inode_t *dir_inode, inode_t *entry_inod
  *
  *      Purpose:
  *              Elimina una entrada en un directorio según su nombre.
- *              NOTA: Decrementa el tamaño del directorio pero NO lo salva a disco.
  *              NOTA: NO decrementa el número de enlaces al inodo referenciado.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
@@ -135,8 +857,7 @@ int
 del_dir_entry_by_name(int dev, superblock_t *sb, inode_t *inode,
                       const char * const entry_name)
 {
-  int i, found;
-  dir_entry_t de;
+  block_t b;
 
   DEBUG_VERBOSE(">> del_dir_entry_by_name(inode->n = %d, entry_name = %s)\n", inode->n, entry_name);
 
@@ -146,40 +867,22 @@ del_dir_entry_by_name(int dev, superblock_t *sb, inode_t *inode,
       return -1;
     }
 
-  do_lseek(dev, sb, inode, 0, SEEK_SET);
-  i = 0;
-  do {
-    if (do_read(dev, sb, inode, (void *) &de, sizeof(dir_entry_t))
-                                                              < sizeof(dir_entry_t))
-      {
-        DEBUG_VERBOSE("Error leyendo entrada número %d del I_DIR %d", i, inode->n);
+  if (inode->flags & I_INDEXED)
+    {
+      if (dx_delete(dev, sb, inode, entry_name) < 0)
         return -1;
-      }
-    
-    /* Las entradas libres no cuentan como el espacio ocupado. */
-    if (de.inode == -1)
-      continue;
-    i++;
-
-    found = strcmp(de.name, entry_name) == 0;
-
-  } while (!found &&  i*sizeof(struct dir_entry) < inode->size);
-
-  /* Fuera de rango. */
-  if (!found)
-    return -1;
-
-  de.inode = -1;
-  /* Un pasito pa'trás... */
-  do_lseek(dev, sb, inode, -sizeof(dir_entry_t), SEEK_CUR);
-  if (do_write(dev, sb, inode, (void *) &de, sizeof(dir_entry_t))
-                                                           < sizeof(dir_entry_t))
-    return -1;
+    }
+  else
+    {
+      if (inode->size == 0
+          || dirblk_read(dev, sb, inode, 0, &b) < 0
+          || dirblk_delete(&b, entry_name) < 0
+          || dirblk_write(dev, sb, inode, 0, &b) < 0)
+        return -1;
+    }
 
-  inode->size -= sizeof(dir_entry_t);
+  dcache_enter(inode->n, entry_name, DCACHE_NEGATIVE);
 
-  DEBUG_VERBOSE(">> del_dir_entry >> i = %d\n", i);
-  
   return 0;
 }
 
@@ -187,26 +890,27 @@ del_dir_entry_by_name(int dev, superblock_t *sb, inode_t *inode,
 
 
 /*-
- *      Routine:       get_dir_entry
+ *      Routine:       get_dir_entry_by_name
  *
  *      Purpose:
- *              Recupera una entrada de directorio
+ *              Recupera una entrada de directorio según su nombre
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
  *              inode debe ser un inodo de directorio válido.
  *      Returns:
+ *              Un puntero a la entrada; con inode == -1 si no existe.
  *              NULL on error.
  *
  */
 dir_entry_t *
-get_dir_entry(int dev, superblock_t *sb, inode_t *inode, int n)
+get_dir_entry_by_name(int dev, superblock_t *sb, inode_t *inode, char * name)
 {
-  int i;
-  dir_entry_t de = { -1, "FIN" };
+  int found, cached;
   dir_entry_t *de_n;
+  block_t b;
 
-  DEBUG_VERBOSE(">> get_dir_entry(n = %d)\n", n);
+  DEBUG_VERBOSE(">> get_dir_entry_by_name(name = %s)\n", name);
 
   if (inode->type != I_DIR)
     {
@@ -214,34 +918,41 @@ get_dir_entry(int dev, superblock_t *sb, inode_t *inode, int n)
       return NULL;
     }
 
-  do_lseek(dev, sb, inode, 0, SEEK_SET);
-  i = 0;
-  do {
-    if (do_read(dev, sb, inode, (void *) &de, sizeof(dir_entry_t)) < sizeof(dir_entry_t))
-      {
-        DEBUG_VERBOSE("Error leyendo entrada número %d del I_DIR %d", i, inode->n);
-        return NULL;
-      }
-    
-    /* Las entradas libres no cuentan como el espacio ocupado. */
-    if (de.inode == -1)
-      continue;
-    i++;
+  de_n = malloc(sizeof(struct dir_entry));
+  if (!de_n)
+    return NULL;
+
+  /* Primero, la caché de nombres. */
+  if (dcache_lookup(inode->n, name, &cached) == 0)
+    {
+      de_n->inode = cached;
+      if (cached != DCACHE_NEGATIVE)
+        strcpy((char *) de_n->name, name);
+      return de_n;
+    }
 
-  } while (i <= n  &&  i*sizeof(struct dir_entry) < inode->size);
+  if (inode->flags & I_INDEXED)
+    found = dx_lookup(dev, sb, inode, name, de_n);
+  else if (inode->size == 0)
+    found = 1;
+  else if (dirblk_read(dev, sb, inode, 0, &b) < 0)
+    found = -1;
+  else
+    found = dirblk_find(&b, name, de_n);
 
-  de_n = malloc(sizeof(struct dir_entry));
+  if (found < 0)
+    {
+      free(de_n);
+      return NULL;
+    }
 
   /* Fuera de rango. */
-  if (i <= n)
+  if (found)
     de_n->inode = -1;
-  else
-    memcpy(de_n, &de, sizeof(struct dir_entry));
 
-  DEBUG_VERBOSE(">> get_dir_entry >> i = %d\n", i);
-  DEBUG_VERBOSE(">> get_dir_entry >> de_n->inode = %d\n", de_n->inode);
-  if (de_n->inode != -1)
-    DEBUG_VERBOSE(">> get_dir_entry >> de_n->name = %s\n", de_n->name);
+  dcache_enter(inode->n, name, found ? DCACHE_NEGATIVE : de_n->inode);
+
+  DEBUG_VERBOSE(">> get_dir_entry_by_name >> de_n->inode = %d\n", de_n->inode);
 
   return de_n;
 }
@@ -250,63 +961,224 @@ get_dir_entry(int dev, superblock_t *sb, inode_t *inode, int n)
 
 
 /*-
- *      Routine:       get_dir_entry_by_name
+ *      Routine:       dir_iterate
  *
  *      Purpose:
- *              Recupera una entrada de directorio según su nombre
+ *              Recorre en una sola pasada las entradas de un directorio a
+ *              partir de un offset, pasándoselas a actor. El offset de cada
+ *              entrada es su posición en el directorio (bloque y registro),
+ *              así que se puede retomar el recorrido con el offset que
+ *              recibió actor.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
  *              inode debe ser un inodo de directorio válido.
+ *              offset debe ser 0 o uno recibido por actor.
  *      Returns:
- *              NULL on error.
+ *              0 on success (también si actor pidió parar).
+ *              -1 on error.
  *
  */
-dir_entry_t *
-get_dir_entry_by_name(int dev, superblock_t *sb, inode_t *inode, char * name)
+int
+dir_iterate(int dev, superblock_t *sb, inode_t *inode, off_t offset,
+            dir_actor_t actor, void *ctx)
 {
-  int i, found;
-  dir_entry_t de = { -1, "FIN" };
-  dir_entry_t *de_n;
+  unsigned blk, first, nblocks, rec_off, start;
+  struct dir_record *rec;
+  dir_entry_t de;
+  block_t b;
 
-  DEBUG_VERBOSE(">> get_dir_entry_by_name(name = %s)\n", name);
+  DEBUG_VERBOSE(">> dir_iterate(inode->n = %d, offset = %lld)\n",
+                inode->n, (long long) offset);
 
   if (inode->type != I_DIR)
     {
       DEBUG_VERBOSE("no es un directorio!\n");
-      return NULL;
+      return -1;
     }
 
-  do_lseek(dev, sb, inode, 0, SEEK_SET);
-  i = 0;
-  do {
-    if (do_read(dev, sb, inode, (void *) &de, sizeof(dir_entry_t)) < sizeof(dir_entry_t))
-      {
-        DEBUG_VERBOSE("Error leyendo entrada número %d del I_DIR %d", i, inode->n);
-        return NULL;
-      }
-    
-    /* Las entradas libres no cuentan como el espacio ocupado. */
-    if (de.inode == -1)
-      continue;
-    i++;
+  /* En los indexados, el bloque 0 es la raíz del índice. */
+  first = (inode->flags & I_INDEXED) ? 1 : 0;
+  if (offset < (off_t) first * sizeof(struct block))
+    offset = (off_t) first * sizeof(struct block);
 
-    found = strcmp(de.name, name) == 0;
+  nblocks = inode->size / sizeof(struct block);
 
-  } while (!found &&  i*sizeof(struct dir_entry) < inode->size);
+  for (blk = offset / sizeof(struct block); blk < nblocks; blk++)
+    {
+      if (dirblk_read(dev, sb, inode, blk, &b) < 0)
+        return -1;
 
-  de_n = malloc(sizeof(struct dir_entry));
+      /* Se recorre el bloque desde el principio, saltando los registros
+         que empiezan antes del offset: si desde la última llamada se ha
+         fusionado algún registro, el offset puede caer en medio de uno. */
+      start = blk == offset / sizeof(struct block) ? offset % sizeof(struct block) : 0;
+      rec_off = 0;
+      while ((rec = dirblk_next(&b, &rec_off)))
+        {
+          if (rec_off - rec->rec_len < start || rec->inode == -1)
+            continue;
 
-  /* Fuera de rango. */
-  if (!found)
-    de_n->inode = -1;
-  else
-    memcpy(de_n, &de, sizeof(struct dir_entry));
+          dirrec_to_entry(rec, &de);
+          if (actor(ctx, &de, (off_t) blk * sizeof(struct block) + rec_off))
+            return 0;
+        }
+      if (rec_off != sizeof(struct block))
+        return -1;
+    }
 
-  DEBUG_VERBOSE(">> get_dir_entry_by_name >> i=%d\n", i);
-  DEBUG_VERBOSE(">> get_dir_entry_by_name >> de_n->inode = %d\n", de_n->inode);
-  if (de_n->inode != -1)
-    DEBUG_VERBOSE(">> get_dir_entry_by_name >> de_n->name = %s\n", de_n->name);
+  return 0;
+}
 
-  return de_n;
+
+
+
+/*-
+ *      Routine:       dir_empty_p
+ *
+ *      Purpose:
+ *              Comprueba si un directorio está vacío (sólo tiene . y ..).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superblock válido.
+ *              inode debe ser un inodo de directorio válido.
+ *      Returns:
+ *              1 si está vacío.
+ *              0 si no.
+ *              -1 on error.
+ *
+ */
+int
+dir_empty_p(int dev, superblock_t *sb, inode_t *inode)
+{
+  unsigned blk, nblocks, offset;
+  struct dir_record *rec;
+  block_t b;
+
+  nblocks = inode->size / sizeof(struct block);
+
+  for (blk = (inode->flags & I_INDEXED) ? 1 : 0; blk < nblocks; blk++)
+    {
+      if (dirblk_read(dev, sb, inode, blk, &b) < 0)
+        return -1;
+
+      offset = 0;
+      while ((rec = dirblk_next(&b, &offset)))
+        if (rec->inode != -1
+            && !dirrec_match_p(rec, ".", 1)
+            && !dirrec_match_p(rec, "..", 2))
+          return 0;
+      if (offset != sizeof(struct block))
+        return -1;
+    }
+
+  return 1;
+}
+
+
+
+
+/*-
+ *      Routine:       dir_convert
+ *
+ *      Purpose:
+ *              Pasa un directorio de la revisión 0, con entradas de tamaño
+ *              fijo, a registros de longitud variable: lee todas las
+ *              entradas, libera los bloques viejos y las vuelve a meter
+ *              una a una. Se descartan las que no señalan a un inodo en
+ *              uso.
+ *              NOTA: No salva el inodo a disco.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque de la revisión 0, con el
+ *              mapa de bloques cargado y los inodos ya en el formato nuevo
+ *              (ver inode_convert()).
+ *              inode debe ser un directorio de la revisión 0.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+dir_convert(int dev, superblock_t *sb, inode_t *inode)
+{
+  struct dir_entry_v0 *slot;
+  dir_entry_t *entries;
+  unsigned long live, count = 0, i;
+  long blk, ablk;
+  block_t *b;
+  inode_t *entry;
+  int res = 0;
+
+  DEBUG_VERBOSE(">> dir_convert(inode->n = %d)\n", inode->n);
+
+  /* size contaba sólo las entradas en uso, aunque hubiese huecos libres
+     entre ellas. */
+  live = inode->size / sizeof(struct dir_entry_v0);
+  entries = malloc((live ? live : 1) * sizeof(dir_entry_t));
+  if (!entries)
+    return -1;
+
+  for (blk = 0; count < live && blk < N_DIRECT_BLOCKS + N_SINGLE_INDIRECT_BLOCKS; blk++)
+    {
+      ablk = inode_getblk(dev, sb, inode, blk);
+      if (ablk < 0)
+        break;
+
+      b = getblk(dev, sb, ablk);
+      if (!b)
+        {
+          free(entries);
+          return -1;
+        }
+
+      slot = (struct dir_entry_v0 *) b->data;
+      for (i = 0; i < DIR_V0_PER_BLOCK && count < live; i++)
+        {
+          if (slot[i].inode == -1)
+            continue;
+
+          entries[count].inode = slot[i].inode;
+          memcpy(entries[count].name, slot[i].name, DIR_NAME_MAX);
+          entries[count].name[DIR_NAME_MAX] = 0;
+          count++;
+        }
+      brelse(b);
+    }
+
+  if (count < live)
+    DEBUG(">> dir_convert >> Al directorio %d le faltan %lu entradas\n",
+          inode->n, live - count);
+
+  if (inode_truncate(dev, sb, inode, 0) < 0)
+    {
+      free(entries);
+      return -1;
+    }
+  inode->flags = 0;
+
+  for (i = 0; i < count; i++)
+    {
+      entry = iget(dev, sb, entries[i].inode);
+      if (!entry || entry->type == I_FREE)
+        {
+          DEBUG(">> dir_convert >> Se descarta la entrada %s del directorio %d\n",
+                entries[i].name, inode->n);
+          if (entry)
+            iput(dev, sb, entry);
+          continue;
+        }
+      entries[i].type = entry->type;
+      iput(dev, sb, entry);
+
+      if (dir_insert(dev, sb, inode, &entries[i]) < 0)
+        {
+          res = -1;
+          break;
+        }
+    }
+
+  free(entries);
+
+  return res;
 }
@@ -0,0 +1,700 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-01 15:04:35 holzplatten"
+ *
+ *       File:         extent.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Jun  1 19:29:47 2013
+ *
+ *       Mapeo de bloques con extents.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <balloc.h>
+#include <block.h>
+#include <extent.h>
+#include <inode.h>
+#include <misc.h>
+#include <superblock.h>
+
+
+#define EXT_ROOT(inode) ((struct extent_header *) (inode)->extent_root)
+#define EXT_EXTENTS(hdr) ((struct extent *) ((hdr) + 1))
+#define EXT_INDEX(hdr) ((struct extent_idx *) ((hdr) + 1))
+
+
+
+
+/*-
+ *      Routine:       extent_init
+ *
+ *      Purpose:
+ *              Pasa un inodo sin bloques a mapearse con extents.
+ *      Conditions:
+ *              inode debe apuntar a un inodo sin bloques asignados.
+ *      Returns:
+ *              none
+ *
+ */
+void
+extent_init(inode_t *inode)
+{
+  struct extent_header *hdr = EXT_ROOT(inode);
+
+  memset(inode->extent_root, 0, EXTENT_ROOT_SIZE);
+  hdr->magic = EXTENT_MAGIC;
+  hdr->entries = 0;
+  hdr->max = EXTENT_ROOT_MAX;
+  hdr->depth = 0;
+
+  inode->flags |= I_EXTENTS;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_search
+ *
+ *      Purpose:
+ *              Busca el último extent que empieza en o antes de blk.
+ *      Conditions:
+ *              hdr debe ser una cabecera válida con depth 0.
+ *      Returns:
+ *              Su posición.
+ *              -1 si todos empiezan después de blk.
+ *
+ */
+static int
+ext_search(struct extent_header *hdr, unsigned long blk)
+{
+  struct extent *ext = EXT_EXTENTS(hdr);
+  int lo = 0, hi = hdr->entries - 1, mid;
+
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (ext[mid].logical <= blk)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+
+  return hi;
+}
+
+
+
+
+/*-
+ *      Routine:       idx_search
+ *
+ *      Purpose:
+ *              Busca la entrada de índice cuya hoja cubre blk.
+ *      Conditions:
+ *              hdr debe ser una raíz válida con depth 1 y alguna entrada.
+ *      Returns:
+ *              Su posición.
+ *
+ */
+static int
+idx_search(struct extent_header *hdr, unsigned long blk)
+{
+  struct extent_idx *idx = EXT_INDEX(hdr);
+  int lo = 1, hi = hdr->entries - 1, mid;
+
+  /* La primera hoja cubre todo lo anterior a la segunda. */
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (idx[mid].logical <= blk)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+
+  return hi < 0 ? 0 : hi;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_leaf_ok_p
+ *
+ *      Purpose:
+ *              Comprueba la cabecera de una hoja leída de disco.
+ *      Conditions:
+ *              hdr debe apuntar al principio de un bloque.
+ *      Returns:
+ *              Distinto de cero si es válida.
+ *
+ */
+static int
+ext_leaf_ok_p(const struct extent_header *hdr)
+{
+  if (hdr->magic != EXTENT_MAGIC || hdr->depth != 0
+      || hdr->max != EXTENT_LEAF_MAX || hdr->entries > hdr->max)
+    {
+      DEBUG_VERBOSE("Hoja de extents corrupta\n");
+      return 0;
+    }
+
+  return 1;
+}
+
+
+
+
+/*-
+ *      Routine:       extent_bmap
+ *
+ *      Purpose:
+ *              Devuelve el bloque absoluto que corresponde a un bloque de
+ *              un archivo mapeado con extents, y cuántos bloques seguidos
+ *              del archivo están contiguos en disco a partir de él (o, si
+ *              es un hueco, cuánto mide el hueco).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS.
+ *              count puede ser NULL.
+ *      Returns:
+ *              El número de bloque absoluto, o BLK_UNASSIGNED si es un hueco.
+ *              -1 on error
+ *
+ */
+long
+extent_bmap(int dev, superblock_t * const sb, inode_t *inode,
+            long blk, long *count)
+{
+  struct extent_header *hdr = EXT_ROOT(inode);
+  struct extent_idx *idx;
+  struct extent *ext;
+  block_t *leaf = NULL;
+  unsigned long limit = EXTENT_MAX_BLOCKS;
+  long ablk, n;
+  int i;
+
+  if (blk < 0 || blk >= EXTENT_MAX_BLOCKS)
+    return -1;
+
+  if (hdr->depth == 1)
+    {
+      idx = EXT_INDEX(hdr);
+      i = idx_search(hdr, blk);
+      if (i+1 < hdr->entries)
+        limit = idx[i+1].logical;
+
+      leaf = getblk(dev, sb, idx[i].block);
+      if (!leaf)
+        return -1;
+      hdr = (struct extent_header *) leaf->data;
+      if (!ext_leaf_ok_p(hdr))
+        {
+          brelse(leaf);
+          return -1;
+        }
+    }
+
+  ext = EXT_EXTENTS(hdr);
+  i = ext_search(hdr, blk);
+  if (i >= 0 && blk < (long) ext[i].logical + ext[i].len)
+    {
+      ablk = ext[i].start + (blk - ext[i].logical);
+      n = ext[i].logical + ext[i].len - blk;
+    }
+  else
+    {
+      ablk = BLK_UNASSIGNED;
+      n = (i+1 < hdr->entries ? ext[i+1].logical : limit) - blk;
+    }
+
+  brelse(leaf);
+
+  if (count)
+    *count = n;
+
+  return ablk;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_leaf_insert
+ *
+ *      Purpose:
+ *              Anota en una lista de extents que los len bloques a partir
+ *              de blk están en disco a partir de ablk, alargando un extent
+ *              vecino si es contiguo.
+ *      Conditions:
+ *              hdr debe ser una cabecera válida con depth 0.
+ *              Ninguno de los bloques de blk a blk+len-1 debe estar mapeado.
+ *      Returns:
+ *              0 on success.
+ *              1 si no hay sitio.
+ *              -1 on error.
+ *
+ */
+static int
+ext_leaf_insert(struct extent_header *hdr, unsigned long blk, long ablk,
+                unsigned len)
+{
+  struct extent *ext = EXT_EXTENTS(hdr);
+  int i;
+
+  i = ext_search(hdr, blk);
+
+  if (i >= 0 && blk < (unsigned long) ext[i].logical + ext[i].len)
+    return -1;
+  if (i+1 < hdr->entries && blk + len > ext[i+1].logical)
+    return -1;
+
+  /* Justo detrás del anterior, en lógico y en disco. */
+  if (i >= 0
+      && ext[i].logical + ext[i].len == blk
+      && ext[i].start + ext[i].len == ablk)
+    {
+      ext[i].len += len;
+
+      /* Si así se junta con el siguiente, fundirlos. */
+      if (i+1 < hdr->entries
+          && ext[i+1].logical == blk+len
+          && ext[i+1].start == ablk+len)
+        {
+          ext[i].len += ext[i+1].len;
+          memmove(&ext[i+1], &ext[i+2],
+                  (hdr->entries - i - 2) * sizeof(struct extent));
+          hdr->entries--;
+        }
+
+      return 0;
+    }
+
+  /* Justo delante del siguiente. */
+  if (i+1 < hdr->entries
+      && ext[i+1].logical == blk+len
+      && ext[i+1].start == ablk+len)
+    {
+      ext[i+1].logical -= len;
+      ext[i+1].start -= len;
+      ext[i+1].len += len;
+      return 0;
+    }
+
+  if (hdr->entries == hdr->max)
+    return 1;
+
+  memmove(&ext[i+2], &ext[i+1], (hdr->entries - i - 1) * sizeof(struct extent));
+  ext[i+1].logical = blk;
+  ext[i+1].len = len;
+  ext[i+1].start = ablk;
+  hdr->entries++;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_grow
+ *
+ *      Purpose:
+ *              Pasa los extents de la raíz a una hoja nueva, y la raíz a
+ *              ser un índice (depth 1) con esa única hoja.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS y depth 0.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error
+ *
+ */
+static int
+ext_grow(int dev, superblock_t * const sb, inode_t *inode)
+{
+  struct extent_header *root = EXT_ROOT(inode), *hdr;
+  struct extent_idx *idx;
+  block_t leaf;
+  long nb;
+
+  nb = allocblk(dev, sb);
+  if (nb < 0)
+    return -1;
+
+  memset(&leaf, 0, sizeof(struct block));
+  hdr = (struct extent_header *) leaf.data;
+  hdr->magic = EXTENT_MAGIC;
+  hdr->entries = root->entries;
+  hdr->max = EXTENT_LEAF_MAX;
+  hdr->depth = 0;
+  memcpy(EXT_EXTENTS(hdr), EXT_EXTENTS(root), root->entries * sizeof(struct extent));
+
+  if (writemeta(dev, sb, nb, &leaf, inode->n) < 0)
+    {
+      freeblk(dev, sb, nb);
+      return -1;
+    }
+
+  root->entries = 1;
+  root->depth = 1;
+  idx = EXT_INDEX(root);
+  idx[0].logical = 0;
+  idx[0].unused = 0;
+  idx[0].block = nb;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_split
+ *
+ *      Purpose:
+ *              Parte en dos la hoja i-ésima del índice de la raíz: la
+ *              mitad superior de sus extents pasa a una hoja nueva.  Si
+ *              blk cae junto a un extremo de la hoja (escritura secuencial,
+ *              hacia delante o hacia atrás), se parte por ahí para no
+ *              dejar hojas a medias.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS, depth 1 y sitio en
+ *              la raíz.
+ *              leaf debe ser la hoja, obtenida con getblk().
+ *              blk es el bloque lógico que no cabía.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error
+ *
+ */
+static int
+ext_split(int dev, superblock_t * const sb, inode_t *inode, int i,
+          block_t *leaf, unsigned long blk)
+{
+  struct extent_header *root = EXT_ROOT(inode), *hdr, *nhdr;
+  struct extent_idx *idx = EXT_INDEX(root);
+  block_t new;
+  long nb;
+  int m;
+
+  nb = allocblk(dev, sb);
+  if (nb < 0)
+    return -1;
+
+  hdr = (struct extent_header *) leaf->data;
+  m = ext_search(hdr, blk) + 1;
+  if (m > 1 && m < hdr->entries - 1)
+    m = hdr->entries / 2;
+
+  memset(&new, 0, sizeof(struct block));
+  nhdr = (struct extent_header *) new.data;
+  nhdr->magic = EXTENT_MAGIC;
+  nhdr->entries = hdr->entries - m;
+  nhdr->max = EXTENT_LEAF_MAX;
+  nhdr->depth = 0;
+  memcpy(EXT_EXTENTS(nhdr), &EXT_EXTENTS(hdr)[m], nhdr->entries * sizeof(struct extent));
+
+  if (writemeta(dev, sb, nb, &new, inode->n) < 0)
+    {
+      freeblk(dev, sb, nb);
+      return -1;
+    }
+
+  hdr->entries = m;
+  writemeta(dev, sb, idx[i].block, leaf, inode->n);
+
+  memmove(&idx[i+2], &idx[i+1], (root->entries - i - 1) * sizeof(struct extent_idx));
+  idx[i+1].logical = nhdr->entries ? EXT_EXTENTS(nhdr)[0].logical : blk;
+  idx[i+1].unused = 0;
+  idx[i+1].block = nb;
+  root->entries++;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_insert
+ *
+ *      Purpose:
+ *              Anota en el árbol de extents de un inodo que los len
+ *              bloques a partir de blk están a partir de ablk, haciendo
+ *              crecer el árbol si hace falta.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error
+ *
+ */
+static int
+ext_insert(int dev, superblock_t * const sb, inode_t *inode,
+           unsigned long blk, long ablk, unsigned len)
+{
+  struct extent_header *root = EXT_ROOT(inode);
+  struct extent_idx *idx = EXT_INDEX(root);
+  block_t *leaf;
+  int i, res, tries;
+
+  if (root->depth == 0)
+    {
+      res = ext_leaf_insert(root, blk, ablk, len);
+      if (res <= 0)
+        return res;
+
+      if (ext_grow(dev, sb, inode) < 0)
+        return -1;
+    }
+
+  for (tries = 0; tries < 2; tries++)
+    {
+      i = idx_search(root, blk);
+      leaf = getblk(dev, sb, idx[i].block);
+      if (!leaf)
+        return -1;
+      if (!ext_leaf_ok_p((struct extent_header *) leaf->data))
+        {
+          brelse(leaf);
+          return -1;
+        }
+
+      res = ext_leaf_insert((struct extent_header *) leaf->data, blk, ablk, len);
+      if (res == 0)
+        res = writemeta(dev, sb, idx[i].block, leaf, inode->n);
+      if (res <= 0)
+        {
+          brelse(leaf);
+          return res;
+        }
+
+      /* Hoja llena: partirla si queda sitio en la raíz. */
+      if (root->entries == root->max)
+        {
+          DEBUG_VERBOSE(">> ext_insert >> Error: árbol de extents lleno\n");
+          brelse(leaf);
+          return -1;
+        }
+      res = ext_split(dev, sb, inode, i, leaf, blk);
+      brelse(leaf);
+      if (res < 0)
+        return -1;
+    }
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       extent_allocblk
+ *
+ *      Purpose:
+ *              Reserva bloques de datos para un archivo mapeado con
+ *              extents, a partir de su bloque blk: hasta *count seguidos,
+ *              y a ser posible justo detrás del bloque que tiene en disco
+ *              el bloque lógico anterior. reserved dice si el llamante
+ *              los tiene apartados con breserve() (ver balloc_win()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS.
+ *              Ninguno de los bloques de blk a blk+*count-1 debe estar
+ *              mapeado.
+ *              count puede ser NULL (un bloque).
+ *      Returns:
+ *              El número de bloque absoluto del primero, y en *count
+ *              cuántos se han reservado.
+ *              -1 on error
+ *
+ */
+long
+extent_allocblk(int dev, superblock_t * const sb, inode_t *inode, long blk,
+                long *count, int reserved)
+{
+  long ablk, goal = BALLOC_NO_GOAL, len;
+
+  len = count && *count > 0 ? *count : 1;
+  if (blk < 0 || blk + len > EXTENT_MAX_BLOCKS)
+    return -1;
+
+  if (blk > 0)
+    {
+      ablk = extent_bmap(dev, sb, inode, blk-1, NULL);
+      if (ablk >= 0)
+        goal = ablk + 1;
+    }
+
+  ablk = balloc_win(dev, sb, &inode->pa, goal, &len, reserved);
+  if (ablk < 0)
+    return -1;
+
+  if (ext_insert(dev, sb, inode, blk, ablk, len) < 0)
+    {
+      bfree(dev, sb, ablk, len);
+      return -1;
+    }
+
+  inode->modified = 1;
+
+  if (count)
+    *count = len;
+
+  return ablk;
+}
+
+
+
+
+/*-
+ *      Routine:       ext_leaf_truncate
+ *
+ *      Purpose:
+ *              Libera los bloques de una lista de extents a partir del
+ *              bloque lógico blk.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              hdr debe ser una cabecera válida con depth 0.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error
+ *
+ */
+static int
+ext_leaf_truncate(int dev, superblock_t * const sb,
+                  struct extent_header *hdr, unsigned long blk)
+{
+  struct extent *ext = EXT_EXTENTS(hdr);
+  unsigned keep, j;
+  int res = 0;
+
+  while (hdr->entries > 0)
+    {
+      ext = &EXT_EXTENTS(hdr)[hdr->entries - 1];
+      if ((unsigned long) ext->logical + ext->len <= blk)
+        break;
+
+      keep = ext->logical < blk ? blk - ext->logical : 0;
+      for (j = keep; j < ext->len; j++)
+        if (freeblk(dev, sb, ext->start + j) < 0)
+          res = -1;
+
+      if (keep)
+        {
+          ext->len = keep;
+          break;
+        }
+      hdr->entries--;
+    }
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       extent_truncate
+ *
+ *      Purpose:
+ *              Libera todos los bloques de un archivo mapeado con extents
+ *              a partir del bloque lógico blk, incluidas las hojas que se
+ *              queden vacías.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe ser un inodo con I_EXTENTS.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error
+ *
+ */
+int
+extent_truncate(int dev, superblock_t * const sb, inode_t *inode, long blk)
+{
+  struct extent_header *root = EXT_ROOT(inode), *hdr;
+  struct extent_idx *idx = EXT_INDEX(root);
+  block_t *leaf;
+  int i, res = 0;
+
+  if (blk < 0)
+    return -1;
+
+  inode->modified = 1;
+
+  if (root->depth == 0)
+    return ext_leaf_truncate(dev, sb, root, blk);
+
+  for (i = root->entries - 1; i >= 0; i--)
+    {
+      leaf = getblk(dev, sb, idx[i].block);
+      if (!leaf)
+        return -1;
+      hdr = (struct extent_header *) leaf->data;
+      if (!ext_leaf_ok_p(hdr))
+        {
+          brelse(leaf);
+          return -1;
+        }
+
+      if (ext_leaf_truncate(dev, sb, hdr, blk) < 0)
+        res = -1;
+
+      if (hdr->entries == 0 && (i > 0 || blk == 0))
+        {
+          /* Hoja vacía: fuera. */
+          brelse(leaf);
+          if (freeblk(dev, sb, idx[i].block) < 0)
+            res = -1;
+          root->entries--;
+        }
+      else
+        {
+          writemeta(dev, sb, idx[i].block, leaf, inode->n);
+          brelse(leaf);
+        }
+
+      /* Las hojas anteriores no tienen nada a partir de blk. */
+      if (idx[i].logical <= blk)
+        break;
+    }
+
+  /* Sin hojas, se vuelve a empezar con los extents en la raíz. */
+  if (root->entries == 0)
+    extent_init(inode);
+
+  return res;
+}
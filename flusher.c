@@ -0,0 +1,415 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-15 18:22:40 holzplatten"
+ *
+ *       File:         flusher.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Sep 15 17:10:05 2013
+ *
+ *       Volcado a disco de todo lo pendiente, de vez en cuando.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <delalloc.h>
+#include <flusher.h>
+#include <inode.h>
+#include <journal.h>
+#include <misc.h>
+#include <superblock.h>
+
+
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* Despierta al hilo: hay que volcar, o parar. */
+  pthread_cond_t wake;
+  /* Señala el final de cada pasada, para los que esperan a que baje lo
+     sucio. */
+  pthread_cond_t flushed;
+  int running, stop, kick;
+
+  int dev;
+  superblock_t *sb;
+  struct flusher_config config;
+  /* Desde cuándo hay algo sucio sin volcar (0 si nada), y pasadas
+     empezadas y terminadas. */
+  time_t dirtied;
+  unsigned long started;
+  unsigned long passes;
+  unsigned long throttled;
+} flusher = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .flushed = PTHREAD_COND_INITIALIZER
+};
+
+
+
+
+/*-
+ *      Routine:       fs_sync
+ *
+ *      Purpose:
+ *              Vuelca a disco todo lo pendiente, en este orden: los
+ *              inodos modificados (y sus bloques retardados), los buffers
+ *              de datos sucios y el superbloque si ha cambiado. Los datos
+ *              van directamente a su sitio; el resto queda en el diario,
+ *              con los índices y mapas de bits que ya estaban en él, y
+ *              por último se confirma todo junto (ver journal_commit()).
+ *              Así los metadatos nunca hablan de datos que no estén ya en
+ *              disco.
+ *              Con periodic distinto de cero, los inodos que sólo tienen
+ *              fechas cambiadas pueden quedarse en memoria (ver iflush()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              No se puede llamar dentro de una operación (ver
+ *              journal_begin()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (si falla algo, no se confirma nada).
+ *
+ */
+int
+fs_sync(int dev, superblock_t * const sb, int periodic)
+{
+  int res = 0;
+
+  /* iflush() hace una operación por inodo: así se puede confirmar entre
+     medias si no caben todos en una transacción. */
+  if (iflush(dev, sb, periodic) < 0)
+    res = -1;
+  if (bflush(dev, sb) < 0)
+    res = -1;
+
+  journal_begin();
+  if (res == 0 && superblock_sync(dev, sb) < 0)
+    res = -1;
+  journal_end();
+
+  if (res < 0)
+    {
+      DEBUG(">> fs_sync >> Error al volcar inodos o buffers\n");
+      return -1;
+    }
+
+  return journal_commit();
+}
+
+
+
+
+/*-
+ *      Routine:       fs_fsync
+ *
+ *      Purpose:
+ *              Vuelca a disco un archivo: sus datos, sus índices y su
+ *              inodo (ver isync()), y confirma el diario. De los demás
+ *              archivos sólo se escriben antes los datos de los que haya
+ *              metadatos en la transacción (ver journal_order()); el
+ *              resto se queda en memoria. Al final, un
+ *              fdatasync() del dispositivo asegura que lo escrito en su
+ *              sitio sin pasar por el diario también ha llegado.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe tener una referencia del llamante, pero no
+ *              estar bloqueado.
+ *              No se puede llamar dentro de una operación (ver
+ *              journal_begin()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+fs_fsync(int dev, superblock_t * const sb, inode_t *inode, int datasync)
+{
+  int res;
+
+  /* Sólo hace falta el inodo para mandarlo al diario; la confirmación,
+     que es lo que tarda, va sin bloquearlo. */
+  journal_begin();
+  ilock(inode, I_EXCLUSIVE);
+  res = isync(dev, sb, inode, datasync);
+  iunlock(inode);
+  if (res == 0 && superblock_sync(dev, sb) < 0)
+    res = -1;
+  journal_end();
+
+  if (res < 0)
+    {
+      DEBUG(">> fs_fsync(%d) >> Error al volcar el archivo\n", inode->n);
+      return -1;
+    }
+
+  if (journal_commit() < 0 || fdatasync(dev) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       fs_dirty_bytes
+ *
+ *      Purpose:
+ *              Calcula cuánto hay pendiente de volcar: buffers sucios,
+ *              bloques con asignación retardada y lo anotado en la
+ *              transacción en curso del diario.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              El número de bytes.
+ *
+ */
+unsigned long
+fs_dirty_bytes(void)
+{
+  struct bcache_stats stats;
+
+  bcache_get_stats(&stats);
+
+  return (stats.dirty + delalloc_pending()) * sizeof(struct block)
+    + journal_pending();
+}
+
+
+
+
+/*-
+ *      Routine:       flusher_main
+ *
+ *      Purpose:
+ *              Hilo que llama a fs_sync() cuando toca según el modo
+ *              (ver flusher.h), o cuando se le despierta porque hay
+ *              demasiado sucio, hasta que se le pide que pare.
+ *      Conditions:
+ *              Lo arranca flusher_start().
+ *      Returns:
+ *              NULL
+ *
+ */
+static void *
+flusher_main(void *arg __attribute__((unused)))
+{
+  struct timespec deadline;
+  int timed;
+
+  pthread_mutex_lock(&flusher.lock);
+  while (!flusher.stop)
+    {
+      timed = 1;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      if (flusher.config.mode == FLUSH_PERIODIC)
+        deadline.tv_sec += flusher.config.interval;
+      else if (flusher.config.mode == FLUSH_ASYNC && flusher.dirtied)
+        deadline.tv_sec = flusher.dirtied + flusher.config.dirty_age;
+      else
+        timed = 0;
+
+      while (!flusher.stop && !flusher.kick)
+        {
+          if (!timed)
+            pthread_cond_wait(&flusher.wake, &flusher.lock);
+          else if (pthread_cond_timedwait(&flusher.wake, &flusher.lock,
+                                          &deadline) == ETIMEDOUT)
+            break;
+          /* Con async, lo primero que se ensucia pone el plazo. */
+          if (!timed && flusher.config.mode == FLUSH_ASYNC && flusher.dirtied)
+            break;
+        }
+      if (flusher.stop)
+        break;
+      if (!timed && !flusher.kick)
+        continue;
+
+      flusher.kick = 0;
+      flusher.dirtied = 0;
+      flusher.started++;
+      pthread_mutex_unlock(&flusher.lock);
+      fs_sync(flusher.dev, flusher.sb, 1);
+      pthread_mutex_lock(&flusher.lock);
+      flusher.passes++;
+      pthread_cond_broadcast(&flusher.flushed);
+    }
+  pthread_mutex_unlock(&flusher.lock);
+
+  return NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       flusher_start
+ *
+ *      Purpose:
+ *              Arranca el hilo que vuelca lo pendiente según config.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              config debe apuntar a una configuración válida (interval
+ *              mayor que cero con FLUSH_PERIODIC).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+flusher_start(int dev, superblock_t * const sb,
+              const struct flusher_config *config)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&flusher.lock);
+  if (!flusher.running)
+    {
+      flusher.dev = dev;
+      flusher.sb = sb;
+      flusher.config = *config;
+      flusher.stop = 0;
+      flusher.kick = 0;
+      flusher.dirtied = 0;
+      if (pthread_create(&flusher.thread, NULL, flusher_main, NULL) == 0)
+        flusher.running = 1;
+      else
+        res = -1;
+    }
+  pthread_mutex_unlock(&flusher.lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       flusher_dirty
+ *
+ *      Purpose:
+ *              Avisa de que una operación ha dejado algo pendiente de
+ *              volcar. Con FLUSH_SYNC se vuelca ya. Si no, se apunta
+ *              desde cuándo hay algo sucio, se despierta al hilo si hay
+ *              más de dirty_bytes y, si hay más del doble, se espera a
+ *              que termine una pasada empezada después.
+ *      Conditions:
+ *              El llamante no debe tener ningún inodo bloqueado, ni
+ *              estar dentro de una operación (ver journal_begin()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (sólo con FLUSH_SYNC, si falla el volcado).
+ *
+ */
+int
+flusher_dirty(void)
+{
+  unsigned long bytes, started;
+
+  pthread_mutex_lock(&flusher.lock);
+  if (!flusher.running)
+    {
+      pthread_mutex_unlock(&flusher.lock);
+      return 0;
+    }
+
+  if (flusher.config.mode == FLUSH_SYNC)
+    {
+      pthread_mutex_unlock(&flusher.lock);
+      return fs_sync(flusher.dev, flusher.sb, 1);
+    }
+
+  if (!flusher.dirtied)
+    {
+      flusher.dirtied = time(NULL);
+      pthread_cond_signal(&flusher.wake);
+    }
+  pthread_mutex_unlock(&flusher.lock);
+
+  bytes = fs_dirty_bytes();
+  if (bytes < flusher.config.dirty_bytes)
+    return 0;
+
+  pthread_mutex_lock(&flusher.lock);
+  started = flusher.started;
+  flusher.kick = 1;
+  pthread_cond_signal(&flusher.wake);
+
+  /* Frenar al que escribe hasta que termine una pasada empezada después
+     de ensuciar: la que esté en curso puede no haber visto lo suyo. */
+  if (bytes >= 2 * flusher.config.dirty_bytes)
+    {
+      flusher.throttled++;
+      while (flusher.running && !flusher.stop
+             && flusher.passes < started + 1)
+        pthread_cond_wait(&flusher.flushed, &flusher.lock);
+    }
+  pthread_mutex_unlock(&flusher.lock);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       flusher_stop
+ *
+ *      Purpose:
+ *              Para el hilo de volcado periódico y espera a que termine.
+ *              No vuelca nada: eso lo hace el llamante con fs_sync().
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+flusher_stop(void)
+{
+  pthread_mutex_lock(&flusher.lock);
+  if (!flusher.running)
+    {
+      pthread_mutex_unlock(&flusher.lock);
+      return;
+    }
+  flusher.stop = 1;
+  pthread_cond_signal(&flusher.wake);
+  pthread_cond_broadcast(&flusher.flushed);
+  pthread_mutex_unlock(&flusher.lock);
+
+  pthread_join(flusher.thread, NULL);
+
+  pthread_mutex_lock(&flusher.lock);
+  flusher.running = 0;
+  DEBUG("# flusher: %lu pasadas, %lu esperas por exceso de sucio\n",
+        flusher.passes, flusher.throttled);
+  pthread_mutex_unlock(&flusher.lock);
+}
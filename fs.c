@@ -30,7 +30,9 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <delalloc.h>
 #include <fs.h>
 #include <misc.h>
 
@@ -39,199 +41,254 @@
  *      Routine:       do_read
  *
  *      Purpose:
- *              Lee (byte a byte) un buffer de datos de tamaño n a partir
- *              del offset apuntado por el puntero (interno) del inodo.
+ *              Lee un buffer de datos de tamaño n a partir del offset
+ *              dado dentro del archivo. Se trabaja
+ *              bloque a bloque: cada bloque del archivo se resuelve una
+ *              sola vez y se copia de golpe el trozo que cae dentro de él.
+ *              Las rachas de bloques enteros contiguos en disco se leen
+ *              del dispositivo de una vez.
+ *              Los huecos (bloques no asignados) se leen como ceros.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
  *              inode debe ser un inodo de directorio válido.
  *              buffer debe apuntar a un bloque de memoria lo bastante grande.
  *              n debe ser mayor que cero.
+ *              offset debe ser no negativo.
  *      Returns:
  *              Un entero con el número de bytes leidos.
+ *              -1 on error.
  *
  */
 int
 do_read(int dev, superblock_t *sb, inode_t *inode,
-        char *buffer, int n)
+        char *buffer, int n, off_t offset)
 {
-  int old_blk = -1;
-  struct block * datablock = NULL;
+  struct block * datablock, * delayed;
   int count=0;
-  int byte;
-  long blk, absolute_blk;
+  int byte, span;
+  long blk, absolute_blk, run, next;
 
   while (n>0)
     {
       /* Calcular bloque interno al archivo. */
-      blk = inode->offset_ptr / sizeof(struct block);
+      blk = offset / sizeof(struct block);
       /* Calcular offset dentro del bloque. */
-      byte = inode->offset_ptr % sizeof(struct block);
-
-      /* Calcular bloque absoluto (todo el fs). */
-      absolute_blk = inode_getblk(dev, sb, inode, blk);
+      byte = offset % sizeof(struct block);
+      /* Calcular cuánto se lee de este bloque. */
+      span = sizeof(struct block) - byte;
+      if (span > n)
+        span = n;
+
+      /* Calcular bloque absoluto (todo el fs), y cuántos le siguen
+         contiguos en disco. */
+      absolute_blk = inode_bmap(dev, sb, inode, blk, &run);
       if (absolute_blk == -1)
-        return -1;
-      
-      /* Si el bloque no es el mismo que el de la última lectura, leerlo. */
-      if (absolute_blk != old_blk)
+        return count ? count : -1;
+
+      /* Un hueco puede tener bloques con asignación retardada: si empieza
+         por uno, se lee de memoria; si no, se corta antes del primero. */
+      delayed = NULL;
+      if (unassigned_p(absolute_blk))
         {
-          old_blk = absolute_blk;
-          if (datablock != NULL)
-            free(datablock);
+          next = delalloc_next(inode, blk);
+          if (next == blk)
+            {
+              delayed = delalloc_get(dev, sb, inode, blk, 0);
+              run = 1;
+            }
+          else if (next > blk && next - blk < run)
+            run = next - blk;
+        }
 
-          datablock = getblk(dev, sb, absolute_blk);
+      /* Si se leen enteros varios bloques contiguos, o un hueco, se
+         hace de una vez. */
+      if (byte == 0 && run > 1 && n >= 2 * (long) sizeof(struct block))
+        {
+          if (run > n / (long) sizeof(struct block))
+            run = n / sizeof(struct block);
+          span = run * sizeof(struct block);
+        }
+      else
+        run = 1;
 
+      if (delayed)
+        {
+          memcpy(buffer + count, &delayed->data[byte], span);
+        }
+      else if (unassigned_p(absolute_blk))
+        {
+          /* Hueco: se lee como ceros. */
+          memset(buffer + count, 0, span);
+        }
+      else if (run > 1)
+        {
+          if (readblks(dev, sb, absolute_blk, run, (block_t *) (buffer + count)) < 0)
+            return count ? count : -1;
+        }
+      else
+        {
+          datablock = getblk(dev, sb, absolute_blk);
           if (!datablock)
             return count;
-        }
 
-      /* Copiar byte al buffer de salida. */
-      buffer[count] = datablock->data[byte];
+          memcpy(buffer + count, &datablock->data[byte], span);
+          brelse(datablock);
+        }
 
-      inode->offset_ptr++;
-      count++;
-      n--;
+      offset += span;
+      count += span;
+      n -= span;
     }
 
-  if (datablock)
-    free(datablock);
-
   return count;
 }
 
 
 
 
-/*-
- *      Routine:       do_lseek
- *
- *      Purpose:
- *              Sitúa el puntero de lectura/escritura en la posición dada.
- *      Conditions:
- *              dev debe corresponder a un gnordofs válido.
- *              sb debe apuntar a un superblock válido.
- *              inode debe ser un inodo de directorio válido.
- *              buffer debe apuntar a un bloque de memoria lo bastante grande.
- *              n debe ser mayor que cero.
- *      Returns:
- *              -1 on error.
- *
- */
-int
-do_lseek(int dev __attribute__((unused)),
-         superblock_t *sb __attribute__((unused)),
-         inode_t *inode, off_t offset, int whence)
-{
-  switch(whence)
-    {
-    case SEEK_SET:
-      inode->offset_ptr = offset;
-      break;
-
-    case SEEK_CUR:
-      inode->offset_ptr += offset;
-      break;
-
-    case SEEK_END:
-      inode->offset_ptr = inode->size + offset;
-      break;
-
-    default:
-      return -1;
-    }
-
-  return 0;
-}
-
-
-
-
 /*-
  *      Routine:       do_write
  *
  *      Purpose:
- *              Escribe (byte a byte) un buffer de datos de tamaño n a partir
- *              del offset apuntado por el puntero (interno) del inodo.
+ *              Escribe un buffer de datos de tamaño n a partir del offset
+ *              dado dentro del archivo. Se trabaja
+ *              bloque a bloque: cada bloque del archivo se resuelve (o se
+ *              reserva) una sola vez. Los bloques que se sobreescriben
+ *              enteros no se leen. Todos se quedan sucios en la caché
+ *              de buffers hasta que se vuelquen (ver bflush()).
+ *              En archivos con extents, los bloques que caen en un hueco
+ *              no se reservan aquí: se quedan retardados en memoria. Los
+ *              de directorio son metadatos y se escriben con writemeta().
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superblock válido.
  *              inode debe ser un inodo de directorio válido.
  *              buffer debe apuntar a un bloque de memoria.
  *              n debe ser mayor que cero y menor o igual que el tamaño de buffer.
+ *              offset debe ser no negativo.
  *      Returns:
  *              Un entero con el número de bytes escritos.
+ *              -1 on error.
  *
  */
 int
 do_write(int dev, superblock_t *sb, inode_t *inode,
-         const char * const buffer, int n)
+         const char * const buffer, int n, off_t offset)
 {
-  int old_blk = -1;
-  struct block * datablock = NULL;
+  struct block * datablock;
+  struct block newblock;
   int count=0;
-  int blk, byte;
-  int absolute_blk;
+  int byte, span, fresh, res;
+  long blk, absolute_blk, hole, want;
 
   /* DEBUG_VERBOSE(">> do_write(n=%d)\n", n); */
-  /* DEBUG_VERBOSE(">> do_write >> offset_ptr = %d\n", inode->offset_ptr); */
+  /* DEBUG_VERBOSE(">> do_write >> offset = %d\n", offset); */
 
   while (n>0)
     {
       /* Calcular bloque interno al archivo. */
-      blk = inode->offset_ptr / sizeof(struct block);
+      blk = offset / sizeof(struct block);
       /* Calcular offset dentro del bloque. */
-      byte = inode->offset_ptr % sizeof(struct block);
-      /* DEBUG_VERBOSE(">> do_write >> blk = %d, offset = %d\n", blk, byte); */
-
-      /* Calcular bloque absoluto (todo el fs). */
-      absolute_blk = inode_getblk(dev, sb, inode, blk);
+      byte = offset % sizeof(struct block);
+      /* Calcular cuánto se escribe en este bloque. */
+      span = sizeof(struct block) - byte;
+      if (span > n)
+        span = n;
+
+      /* Calcular bloque absoluto (todo el fs), y cuánto mide el hueco
+         si no está mapeado. */
+      absolute_blk = inode_bmap(dev, sb, inode, blk, &hole);
       if (absolute_blk == -1)
-        return -1;
-      /* DEBUG_VERBOSE(">> do_write >> absolute_blk = %d\n", absolute_blk); */
+        return count ? count : -1;
 
-      /* Si es un bloque no mapeado todavía, reservar y continuar. */
-      if (unassigned_p(absolute_blk))
+      /* Si es un bloque no mapeado todavía, reservarlo, junto con los
+         que le siguen en el hueco y se van a escribir enteros, para que
+         queden seguidos en disco. */
+      fresh = unassigned_p(absolute_blk);
+      if (fresh && (inode->flags & I_EXTENTS))
+        {
+          /* Asignación retardada: el bloque se queda en memoria, sin
+             sitio en disco, hasta que se vuelque (ver delalloc.c). */
+          datablock = delalloc_get(dev, sb, inode, blk, 1);
+          if (!datablock)
+            return count ? count : -1;
+
+          memcpy(&datablock->data[byte], buffer + count, span);
+
+          offset += span;
+          count += span;
+          n -= span;
+          continue;
+        }
+      if (fresh)
         {
-          /* DEBUG_VERBOSE("do_write -> absolute_blk no mapeado aún\n", absolute_blk); */
-          absolute_blk = inode_allocblk(dev, sb, inode, blk);
-          /* DEBUG_VERBOSE("do_write -> mapeado bloque %d\n", absolute_blk); */
+          want = 1;
+          if (span == sizeof(struct block))
+            {
+              want = n / sizeof(struct block);
+              if (want > hole)
+                want = hole;
+            }
+          absolute_blk = inode_allocblk(dev, sb, inode, blk, &want, 0);
           if (absolute_blk == -1)
-            return -1;
+            return count ? count : -1;
         }
-      
-      /* Si el bloque no es el mismo que el de la última lectura, primero
-         salvar el antiguo (porsiaca) y entonces leer el bloque que toca ahora. */
-      if (absolute_blk != old_blk)
+
+      if (inode->type == I_DIR)
         {
-          if (datablock != NULL)
+          /* Los bloques de directorio son metadatos: van por la caché y
+             el diario, de uno en uno. */
+          if (span == sizeof(struct block) || fresh)
+            memset(&newblock, 0, sizeof(struct block));
+          else if ((datablock = getblk(dev, sb, absolute_blk)))
             {
-              writeblk(dev, sb, old_blk, datablock);
-              free(datablock);
+              memcpy(&newblock, datablock, sizeof(struct block));
+              brelse(datablock);
             }
-          old_blk = absolute_blk;
-          /* DEBUG_VERBOSE("getblk con absolute_blk=%d\n", absolute_blk); */
-          datablock = getblk(dev, sb, absolute_blk);
+          else
+            return count ? count : -1;
 
-          if (!datablock)
-            return count;
+          memcpy(&newblock.data[byte], buffer + count, span);
+          if (writemeta(dev, sb, absolute_blk, &newblock, inode->n) < 0)
+            return count ? count : -1;
+        }
+      else if (span == sizeof(struct block))
+        {
+          /* Bloque entero: no hace falta leerlo. Se queda sucio en la
+             caché, y bsync() junta después los que estén seguidos. */
+          if (writeblk(dev, sb, absolute_blk, (block_t *) (buffer + count),
+                       inode->n) < 0)
+            return count ? count : -1;
         }
+      else if (fresh)
+        {
+          /* Bloque recién reservado: lo que no se escriba ha de leerse
+             como ceros, así que tampoco hace falta leerlo. */
+          memset(&newblock, 0, sizeof(struct block));
+          memcpy(&newblock.data[byte], buffer + count, span);
+          if (writeblk(dev, sb, absolute_blk, &newblock, inode->n) < 0)
+            return count ? count : -1;
+        }
+      else
+        {
+          /* Escritura parcial sobre un bloque con datos: leer, modificar
+             y escribir. */
+          datablock = getblk(dev, sb, absolute_blk);
+          if (!datablock)
+            return count ? count : -1;
 
-      /* Escribir byte en el bloque de marras. */
-      datablock->data[byte] = buffer[count];
+          memcpy(&datablock->data[byte], buffer + count, span);
+          res = writeblk(dev, sb, absolute_blk, datablock, inode->n);
+          brelse(datablock);
+          if (res < 0)
+            return count ? count : -1;
+        }
 
-      inode->offset_ptr++;
-      count++;
-      n--;
+      offset += span;
+      count += span;
+      n -= span;
     }
 
-  if (datablock == NULL)
-    return -1;
-
-  /* Nada de escritura retrasada por ahora. [NHH] */
-  writeblk(dev, sb, absolute_blk, datablock);
-
-  free(datablock);
-
   return count;
 }
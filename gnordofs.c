@@ -35,62 +35,165 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <balloc.h>
+#include <dcache.h>
 #include <dir.h>
+#include <extent.h>
+#include <flusher.h>
 #include <fs.h>
+#include <ibitmap.h>
 #include <inode.h>
+#include <journal.h>
 #include <misc.h>
+#include <perms.h>
+#include <readahead.h>
 #include <superblock.h>
+#include <uring.h>
 
 
 static int dev;
 static superblock_t *sb;
 
+/* Archivo abierto. Se guarda en fi->fh entre open() (o create()) y
+   release(), con una referencia al inodo para no tener que buscarlo por
+   su ruta en cada lectura o escritura. */
+struct handle
+{
+  inode_t *inode;
+  int flags;
+  struct readahead ra;
+};
+
+/* Opciones de montaje propias (-o noatime, etc.). */
+enum {
+  KEY_STRICTATIME,
+  KEY_RELATIME,
+  KEY_NOATIME,
+  KEY_LAZYTIME,
+  KEY_NOLAZYTIME,
+  KEY_SYNC,
+  KEY_ASYNC,
+  KEY_PERIODIC,
+  KEY_DIRTY_AGE,
+  KEY_DIRTY_BYTES,
+  KEY_NOURING
+};
+
+static struct fuse_opt gnordofs_opts[] = {
+  FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+  FUSE_OPT_KEY("relatime", KEY_RELATIME),
+  FUSE_OPT_KEY("noatime", KEY_NOATIME),
+  FUSE_OPT_KEY("lazytime", KEY_LAZYTIME),
+  FUSE_OPT_KEY("nolazytime", KEY_NOLAZYTIME),
+  FUSE_OPT_KEY("sync", KEY_SYNC),
+  FUSE_OPT_KEY("async", KEY_ASYNC),
+  FUSE_OPT_KEY("periodic=", KEY_PERIODIC),
+  FUSE_OPT_KEY("dirty_age=", KEY_DIRTY_AGE),
+  FUSE_OPT_KEY("dirty_bytes=", KEY_DIRTY_BYTES),
+  FUSE_OPT_KEY("nouring", KEY_NOURING),
+  FUSE_OPT_END
+};
+
+/* Cuándo se vuelca lo pendiente (ver flusher.h). */
+static struct flusher_config flush_config = {
+  .mode = FLUSH_PERIODIC,
+  .interval = FLUSHER_INTERVAL,
+  .dirty_age = FLUSHER_DIRTY_AGE,
+  .dirty_bytes = FLUSHER_DIRTY_BYTES
+};
+
+#define HANDLE(fi) ((fi) ? (struct handle *) (uintptr_t) (fi)->fh : NULL)
+
+/* Inodo de un archivo con una referencia, bloqueado en modo mode. Si fi
+   no trae manejador (truncate() sin abrir el archivo, por ejemplo) se
+   busca por su ruta. Se suelta con file_put(). */
+static inode_t *file_get(const char *path, struct fuse_file_info *fi, int mode)
+{
+  inode_t *inode;
+  char *p;
+
+  if (HANDLE(fi))
+    {
+      inode = HANDLE(fi)->inode;
+      ilock(inode, mode);
+      return inode;
+    }
+
+  p = strdup(path);
+  inode = namei(dev, sb, p, mode);
+  free(p);
+
+  return inode;
+}
+
+static void file_put(inode_t *inode, struct fuse_file_info *fi)
+{
+  iunlock(inode);
+  if (!HANDLE(fi))
+    iput(dev, sb, inode);
+}
+
+/* Cada operación va entre journal_begin() y una de estas dos, ya sin
+   inodos bloqueados, para que no se confirme a medias. */
+static int done(int res)
+{
+  journal_end();
+
+  return res;
+}
+
+/* Para terminar una operación que ha modificado algo: además, según el
+   modo de volcado, puede que haya que volcar ya o esperar a que baje lo
+   sucio (ver flusher_dirty()). */
+static int dirtied(int res)
+{
+  journal_end();
+
+  if (res >= 0 && flusher_dirty() < 0)
+    return -EIO;
+
+  return res;
+}
+
 static int gnordofs_access(const char *path,
                            int mask)
 {
   inode_t *inode;
   char *p;
   struct fuse_context * ctxt;
+  int res = 0;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_access(path = %s, mask = %o)\n", path, mask);
 
+  journal_begin();
   p = strdup(path);
-  inode = namei(dev, sb, p);
+  inode = namei(dev, sb, p, I_SHARED);
   free(p);
   if (!inode)
-    {
-      free(p);
-      return -ENOENT;
-    }
+    return done(-ENOENT);
 
   ctxt = fuse_get_context();
   if (ctxt->uid == 0)
-    {
-      free(inode);
-      return 0;
-    }
-
-  if (mask & X_OK == X_OK)
-    if ((inode->perms & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)
-      return -EACCES;
-
-  if (mask & W_OK == W_OK)
-    if ((inode->perms & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0)
-      return -EACCES;
-
-  if (mask & R_OK == R_OK)
-    if ((inode->perms & (S_IRUSR | S_IRGRP | S_IROTH)) == 0)
-      return -EACCES;
-
-  if (inode->perms == 0)
-    return -EACCES;
+    res = 0;
+  else if ((mask & X_OK) && (inode->perms & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)
+    res = -EACCES;
+  else if ((mask & W_OK) && (inode->perms & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0)
+    res = -EACCES;
+  else if ((mask & R_OK) && (inode->perms & (S_IRUSR | S_IRGRP | S_IROTH)) == 0)
+    res = -EACCES;
+  else if (inode->perms == 0)
+    res = -EACCES;
+
+  iunlock(inode);
+  iput(dev, sb, inode);
 
-  return 0;
+  return done(res);
 }
 
 static int gnordofs_chmod(const char *path, mode_t mode)
@@ -101,27 +204,28 @@ static int gnordofs_chmod(const char *path, mode_t mode)
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_chmod(path = %s, mode = %o)\n", path, mode);
 
+  journal_begin();
   p = strdup(path);
-  inode = namei(dev, sb, p);
+  inode = namei(dev, sb, p, I_EXCLUSIVE);
   free(p);
   if (!inode)
-    {
-      res = -ENOENT;
-    }
-  else if (can_write_p(inode))
+    return done(-ENOENT);
+
+  if (can_write_p(inode))
     {
       inode->perms = mode;
       inode->ctime = time(NULL);
-      iput(dev, sb, inode);
-      free(inode);
+      inode->modified = 1;
     }
   else
     {
       res = -EACCES;
-      free(inode);
     }
 
-  return res;
+  iunlock(inode);
+  iput(dev, sb, inode);
+
+  return dirtied(res);
 }
 
 static int gnordofs_chown(const char *path, uid_t uid, gid_t gid)
@@ -132,28 +236,113 @@ static int gnordofs_chown(const char *path, uid_t uid, gid_t gid)
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_chown(path = %s, uid = %d, gid = %d)\n", path, uid, gid);
 
+  journal_begin();
   p = strdup(path);
-  inode = namei(dev, sb, p);
+  inode = namei(dev, sb, p, I_EXCLUSIVE);
   free(p);
   if (!inode)
-    {
-      res = -ENOENT;
-    }
-  else if (can_write_p(inode))
+    return done(-ENOENT);
+
+  if (can_write_p(inode))
     {
       inode->owner = uid;
       inode->group = gid;
       inode->ctime = time(NULL);
-      iput(dev, sb, inode);
-      free(inode);
+      inode->modified = 1;
     }
   else
     {
       res = -EACCES;
-      free(inode);
     }
 
-  return res;
+  iunlock(inode);
+  iput(dev, sb, inode);
+
+  return dirtied(res);
+}
+
+static void gnordofs_destroy(void *private_data __attribute__((unused)))
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_destroy()\n");
+
+  bcache_readahead_stop();
+  flusher_stop();
+  fs_sync(dev, sb, 0);
+  bcache_print_stats_debug();
+  uring_print_stats_debug();
+  dcache_print_stats_debug();
+}
+
+/* Al cerrar cada descriptor: si se abrió para escribir, los datos del
+   archivo se mandan ya a su sitio, sin esperar al volcado. El inodo y
+   el diario se quedan para el siguiente. */
+static int gnordofs_flush(const char *path, struct fuse_file_info *fi)
+{
+  struct handle *h = HANDLE(fi);
+  int res;
+
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_flush(path = %s)\n", path);
+
+  if (!h || (h->flags & O_ACCMODE) == O_RDONLY)
+    return 0;
+
+  journal_begin();
+  ilock(h->inode, I_EXCLUSIVE);
+  res = inode_writeback(dev, sb, h->inode);
+  iunlock(h->inode);
+
+  return done(res < 0 ? -EIO : 0);
+}
+
+/* fsync() y fsyncdir(): sólo lo de ese archivo o directorio, más el
+   diario (ver fs_fsync()). */
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  inode_t *inode;
+  char *p;
+  int res;
+
+  /* fs_fsync() confirma el diario: va fuera de toda operación. */
+  if (HANDLE(fi))
+    inode = HANDLE(fi)->inode;
+  else
+    {
+      journal_begin();
+      p = strdup(path);
+      inode = namei(dev, sb, p, I_SHARED);
+      free(p);
+      if (!inode)
+        return done(-ENOENT);
+      iunlock(inode);
+      journal_end();
+    }
+
+  res = fs_fsync(dev, sb, inode, datasync);
+
+  if (!HANDLE(fi))
+    {
+      journal_begin();
+      iput(dev, sb, inode);
+      journal_end();
+    }
+
+  return res < 0 ? -EIO : 0;
+}
+
+static int gnordofs_fsync(const char *path, int datasync,
+                          struct fuse_file_info *fi)
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_fsync(path = %s, datasync = %d)\n", path, datasync);
+
+  return do_fsync(path, datasync, fi);
+}
+
+static int gnordofs_fsyncdir(const char *path, int datasync,
+                             struct fuse_file_info *fi)
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_fsyncdir(path = %s, datasync = %d)\n", path, datasync);
+
+  return do_fsync(path, datasync, fi);
 }
 
 static int gnordofs_getattr(const char *path, struct stat *stbuf)
@@ -164,274 +353,421 @@ static int gnordofs_getattr(const char *path, struct stat *stbuf)
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_getattr(path = %s)\n", path);
 
+  journal_begin();
   p = strdup(path);
-  inode = namei(dev, sb, p);
+  inode = namei(dev, sb, p, I_SHARED);
   free(p);
   if (!inode)
+    return done(-ENOENT);
+
+  if (inode->type == I_DIR || inode->type == I_FILE)
     {
-      res = -ENOENT;
+      stbuf->st_nlink = inode->link_counter;
+      stbuf->st_size = inode->size;
+
+      stbuf->st_uid = inode->owner;
+      stbuf->st_gid = inode->group;
+
+      stbuf->st_atime = inode->atime;
+      stbuf->st_ctime = inode->ctime;
+      stbuf->st_mtime = inode->mtime;
+
+      stbuf->st_mode = inode->perms;
     }
   else
     {
-      if (inode->type == I_DIR || inode->type == I_FILE)
-        {
-          stbuf->st_nlink = inode->link_counter;
-          stbuf->st_size = inode->size;
+      res = -1;
+    }
+
+  iunlock(inode);
+  iput(dev, sb, inode);
 
-          stbuf->st_uid = inode->owner;
-          stbuf->st_gid = inode->group;
+  return done(res);
+}
 
-          stbuf->st_atime = inode->atime;
-          stbuf->st_ctime = inode->ctime;
-          stbuf->st_mtime = inode->mtime;
+static void *gnordofs_init(struct fuse_conn_info *conn)
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_init()\n");
 
-          stbuf->st_mode = inode->perms;
-        }
-      else
-        {
-          res = -1;
-        }
-    }
+  /* Aquí y no en main(): fuse_main() puede pasar a segundo plano con un
+     fork(), y los hilos no pasarían al hijo. */
+  if (flusher_start(dev, sb, &flush_config) < 0)
+    DEBUG(">> gnordofs_init >> No se pudo arrancar el volcado periódico\n");
+  if (bcache_readahead_start() < 0)
+    DEBUG(">> gnordofs_init >> No se pudo arrancar la lectura anticipada\n");
 
-  return res;
+  return NULL;
 }
 
 static int gnordofs_mkdir(const char *path, mode_t mode)
 {
   inode_t *inode, *iparent;
-  int i;
   char *dirc, *basec, *dname, *bname;
   struct fuse_context * ctxt = fuse_get_context();
+  int res = 0;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_mkdir(path = %s, mode = %o)\n", path, mode);
 
+  journal_begin();
   dirc = strdup(path);
   basec = strdup(path);
 
   dname = dirname(dirc);
   bname = basename(basec);
 
-  /* Reservar un nuevo inodo. */
-  inode = ialloc(dev, sb);
-  if (!inode)
-    {
-      free(dirc);
-      free(basec);
-      return -ENOMEM;
-    }
-
-  /* base_dir */
-  iparent = namei(dev, sb, dname);
+  /* base_dir, bloqueado en exclusiva mientras se le añade la entrada. */
+  iparent = namei(dev, sb, dname, I_EXCLUSIVE);
   free(dirc);
   if (!iparent)
     {
       free(basec);
-      return -1;
+      return done(-ENOENT);
     }
 
-  if (add_dir_entry(dev, sb, iparent, inode, bname)  != 0)
+  /* Reservar un nuevo inodo. */
+  inode = ialloc(dev, sb);
+  if (!inode)
     {
+      iunlock(iparent);
+      iput(dev, sb, iparent);
       free(basec);
-      return -1;
+      return done(-ENOMEM);
     }
 
+  /* El tipo, antes de enlazarlo: la entrada del directorio lo lleva. */
   inode->type = I_DIR;
   inode->size = 0;
   inode->perms = S_IFDIR | mode;
   inode->owner = ctxt->uid;
   inode->group = ctxt->gid;
-  /* Entrada . */
-  if (add_dir_entry(dev, sb, inode, inode, ".")  != 0)
+  inode->atime = inode->ctime = inode->mtime = time(NULL);
+
+  /* Al diario antes que la entrada que lo enlaza (ver make_file()). */
+  if (iwrite(dev, sb, inode) < 0
+      || add_dir_entry(dev, sb, iparent, inode, bname)  != 0)
     {
-      free(basec);
-      return -1;
+      /* Ya está reservado en el mapa de inodos: devolverlo. */
+      ifree(dev, sb, inode);
+      res = -1;
     }
-  /* Entrada . */
-  if (add_dir_entry(dev, sb, inode, iparent, "..")  != 0)
+  else
     {
-      free(basec);
-      return -1;
+      /* Entradas . y .. */
+      if (add_dir_entry(dev, sb, inode, inode, ".")  != 0
+          || add_dir_entry(dev, sb, inode, iparent, "..")  != 0)
+        res = -1;
+
+      iparent->modified = 1;
+      /* Con el tamaño y los bloques de . y .., en la misma
+         transacción. */
+      if (iwrite(dev, sb, inode) < 0)
+        res = -1;
+      DEBUG_VERBOSE("mkdir -> (%d) %s\n", inode->n, bname);
     }
-  inode->atime = inode->ctime = inode->mtime = time(NULL);
 
+  iunlock(iparent);
   iput(dev, sb, iparent);
   iput(dev, sb, inode);
-  DEBUG_VERBOSE("mkdir -> (%d) %s\n", inode->n, bname);
-  
-  superblock_write(dev, sb);
-
   free(basec);
 
-  return 0;
+  return dirtied(res);
 }
 
-static int gnordofs_mknod(const char *path,
-                          mode_t mode,
-                          dev_t inputdev __attribute__((unused)))
+/* Crea un archivo regular vacío en path, dentro de la operación del
+   llamante. Devuelve el inodo con una referencia y sin bloquear, o NULL
+   dejando el error en *res. */
+static inode_t *make_file(const char *path, mode_t mode, int *res)
 {
   inode_t *inode, *iparent;
-  int i;
   char *dirc, *basec, *dname, *bname;
   struct fuse_context * ctxt = fuse_get_context();
 
-  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_mknod(path = %s)\n", path);
-
   dirc = strdup(path);
   basec = strdup(path);
 
   dname = dirname(dirc);
   bname = basename(basec);
 
-  /* Reservar un nuevo inodo. */
-  inode = ialloc(dev, sb);
-  if (!inode)
+  /* base_dir, bloqueado en exclusiva mientras se le añade la entrada. */
+  iparent = namei(dev, sb, dname, I_EXCLUSIVE);
+  free(dirc);
+  if (!iparent)
     {
-      free(dirc);
       free(basec);
-      return -ENOMEM;
+      *res = -ENOENT;
+      return NULL;
     }
 
-  /* base_dir */
-  iparent = namei(dev, sb, dname);
-  free(dirc);
-  if (!iparent)
+  /* Reservar un nuevo inodo. */
+  inode = ialloc(dev, sb);
+  if (!inode)
     {
+      iunlock(iparent);
+      iput(dev, sb, iparent);
       free(basec);
-      return -1;
+      *res = -ENOMEM;
+      return NULL;
     }
 
   if (add_dir_entry(dev, sb, iparent, inode, bname)  != 0)
     {
-      free(basec);
-      return -1;
+      /* Ya está reservado en el mapa de inodos: devolverlo. */
+      ifree(dev, sb, inode);
+      iput(dev, sb, inode);
+      inode = NULL;
+      *res = -1;
+    }
+  else
+    {
+      inode->type = I_FILE;
+      inode->size = 0;
+      /* Los archivos regulares se mapean con extents. */
+      extent_init(inode);
+      inode->perms = mode;
+      inode->owner = ctxt->uid;
+      inode->group = ctxt->gid;
+      inode->atime = inode->ctime = inode->mtime = time(NULL);
+
+      /* Al diario ya: si no, un fsync() del directorio podría
+         confirmar la entrada sin el inodo al que apunta. */
+      iwrite(dev, sb, inode);
+      DEBUG_VERBOSE("mknod -> (%d) %s\n", inode->n, bname);
     }
 
-  inode->type = I_FILE;
-  inode->size = 0;
-  inode->perms = mode;
-  inode->owner = ctxt->uid;
-  inode->group = ctxt->gid;
-  inode->atime = inode->ctime = inode->mtime = time(NULL);
-  
-  iput(dev, sb, inode);
-  DEBUG_VERBOSE("mknod -> (%d) %s\n", inode->n, bname);
-  
-  superblock_write(dev, sb);
-
+  iunlock(iparent);
+  iput(dev, sb, iparent);
   free(basec);
 
+  return inode;
+}
+
+static int gnordofs_mknod(const char *path,
+                          mode_t mode,
+                          dev_t inputdev __attribute__((unused)))
+{
+  inode_t *inode;
+  int res = 0;
+
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_mknod(path = %s)\n", path);
+
+  journal_begin();
+  inode = make_file(path, mode, &res);
+  if (inode)
+    iput(dev, sb, inode);
+
+  return dirtied(res);
+}
+
+/* Abre inode (con una referencia y bloqueado en exclusiva) con los
+   permisos de flags y deja el manejador en fi. Se queda con la
+   referencia si no hay error. */
+static int open_inode(inode_t *inode, struct fuse_file_info *fi, int check)
+{
+  struct handle *h;
+
+  if (inode->type != I_FILE)
+    return -EISDIR;
+
+  if (check
+      && (((fi->flags & O_ACCMODE) != O_WRONLY && !can_read_p(inode))
+          || ((fi->flags & O_ACCMODE) != O_RDONLY && !can_write_p(inode))))
+    return -EACCES;
+
+  h = malloc(sizeof(struct handle));
+  if (!h)
+    return -ENOMEM;
+
+  h->inode = inode;
+  h->flags = fi->flags;
+  readahead_init(&h->ra);
+  inode->opened++;
+  fi->fh = (uintptr_t) h;
+
   return 0;
 }
 
+static int gnordofs_create(const char *path, mode_t mode,
+                           struct fuse_file_info *fi)
+{
+  inode_t *inode;
+  int res = 0;
+
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_create(path = %s)\n", path);
+
+  journal_begin();
+  inode = make_file(path, mode, &res);
+  if (!inode)
+    return done(res);
+
+  /* Quien lo crea puede escribir en él aunque mode diga otra cosa. */
+  ilock(inode, I_EXCLUSIVE);
+  res = open_inode(inode, fi, 0);
+  iunlock(inode);
+  if (res < 0)
+    iput(dev, sb, inode);
+
+  return dirtied(res);
+}
+
 static int gnordofs_open(const char *path, struct fuse_file_info *fi)
 {
+  inode_t *inode;
+  char *p;
+  int res;
+
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_open(path = %s)\n", path);
-  return 0;
+
+  journal_begin();
+  p = strdup(path);
+  inode = namei(dev, sb, p, I_EXCLUSIVE);
+  free(p);
+  if (!inode)
+    return done(-ENOENT);
+
+  res = open_inode(inode, fi, 1);
+  iunlock(inode);
+  if (res < 0)
+    iput(dev, sb, inode);
+
+  return done(res);
 }
 
 static int gnordofs_read(const char *path, char *buf, size_t size, off_t offset,
-                         struct fuse_file_info *fi __attribute__((unused)))
+                         struct fuse_file_info *fi)
 {
   inode_t *inode;
   int count;
-  char *p;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_read(path = %s, size = %d, offset = %d)\n", path, size, offset);
 
-  p = strdup(path);
-  inode = namei(dev, sb, p);
-  free(p);
+  journal_begin();
+  inode = file_get(path, fi, I_SHARED);
   if (!inode)
-    return -1;
+    return done(-1);
 
-  if (!can_read_p(inode))
+  /* Con manejador, los permisos ya se comprobaron al abrir. */
+  if (!HANDLE(fi) && !can_read_p(inode))
     {
-      free(inode);
-      return -EACCES;
+      file_put(inode, fi);
+      return done(-EACCES);
     }
 
   if (offset > inode->size)
     {
-      free(inode);
-      return 0;
+      file_put(inode, fi);
+      return done(0);
     }
 
   if (offset + size > inode->size)
     size = inode->size - offset;
 
-  do_lseek(dev, sb, inode, offset, SEEK_SET);
-  count = do_read(dev, sb, inode, buf, size);
+  /* Pedir lo que venga detrás antes de leer, para que se lea a la vez. */
+  if (HANDLE(fi))
+    readahead(dev, sb, inode, &HANDLE(fi)->ra, offset, size);
 
-  inode->atime = time(NULL);
-  iput(dev, sb, inode);
+  count = do_read(dev, sb, inode, buf, size, offset);
 
-  free(inode);
+  inode_touch(sb, inode);
 
-  return count;
+  file_put(inode, fi);
+
+  return done(count);
+}
+
+/* Contexto de gnordofs_readdir para readdir_actor. */
+struct readdir_ctx
+{
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int readdir_actor(void *ctx, const dir_entry_t *de, off_t next)
+{
+  struct readdir_ctx *rc = ctx;
+  struct stat status;
+
+  memset(&status, 0, sizeof(struct stat));
+  status.st_ino = de->inode;
+  status.st_mode = (de->type == I_DIR ? S_IFDIR : S_IFREG) | 0777;
+
+  /* filler devuelve 1 cuando se llena el buffer: ahí se para, y el kernel
+     volverá a llamar con next como offset. */
+  return rc->filler(rc->buf, (const char *) de->name, &status, next);
 }
 
 static int gnordofs_readdir(const char *path,
                             void *buf,
                             fuse_fill_dir_t filler,
-                            off_t offset __attribute__((unused)),
+                            off_t offset,
                             struct fuse_file_info *fi __attribute__((unused)))
 {
   inode_t *inode;
-  dir_entry_t *de;
-  int i;
+  struct readdir_ctx rc = { buf, filler };
   char *p;
+  int res;
 
-  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_readdir(path = %s)\n", path);
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_readdir(path = %s, offset = %lld)\n",
+        path, (long long) offset);
 
+  journal_begin();
   p = strdup(path);
-  inode = namei(dev, sb, p);
+  inode = namei(dev, sb, p, I_SHARED);
   free(p);
   if (!inode)
     {
-      return -1;
+      return done(-1);
     }
 
   if (!can_read_p(inode))
     {
-      free(inode);
-      return -EACCES;
+      iunlock(inode);
+      iput(dev, sb, inode);
+      return done(-EACCES);
     }
 
-  free(p);
-  
-  i=1;
-  de = get_dir_entry(dev, sb, inode, 0);
-  if (!de)
-    return -1;
-
-  while (de->inode != -1)
-    {
-      struct stat status;
-
-      status.st_ino = de->inode;
-      status.st_mode = 0777;
-
-      filler(buf, de->name, &status, 0);
-      free(de);
-
-      de = get_dir_entry(dev, sb, inode, i++);
-      if (!de)
-        return -1;
-    }
+  res = dir_iterate(dev, sb, inode, offset, readdir_actor, &rc);
+  if (res == 0)
+    inode_touch(sb, inode);
 
-  inode->atime = time(NULL);
+  iunlock(inode);
   iput(dev, sb, inode);
 
-  free(de);
-  free(inode);
-
-  return 0;
+  return done(res);
 }
 
 static int gnordofs_release(const char *path, struct fuse_file_info *fi)
 {
+  struct handle *h = HANDLE(fi);
+  inode_t *inode;
+  int freed;
+
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_release(path = %s)\n", path);
-  return 0;
+
+  if (!h)
+    return 0;
+
+  journal_begin();
+  inode = h->inode;
+  ilock(inode, I_EXCLUSIVE);
+
+  /* Al cerrar se devuelve lo que quede de la ventana de prerreserva. Los
+     bloques retardados que falten por volcar seguirán buscando sitio
+     justo detrás del último asignado, que es donde empezaba. */
+  bwindow_release(sb, &inode->pa);
+
+  /* Si se borró mientras estaba abierto, ahora es cuando se libera. */
+  freed = --inode->opened == 0 && inode->link_counter == 0;
+  if (freed)
+    ifree(dev, sb, inode);
+
+  iunlock(inode);
+  iput(dev, sb, inode);
+
+  readahead_destroy(&h->ra);
+  free(h);
+  fi->fh = 0;
+
+  return freed ? dirtied(0) : done(0);
 }
 
 static int gnordofs_rmdir(const char *path)
@@ -439,129 +775,131 @@ static int gnordofs_rmdir(const char *path)
   char *dirc, *basec, *bname, *dname;
   inode_t *idir, *inode;
   dir_entry_t *de;
+  int res = 0;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_rmdir(path = %s)\n", path);
 
+  journal_begin();
   dirc = strdup(path);
   basec = strdup(path);
 
   dname = dirname(dirc);
   bname = basename(basec);
 
-  idir = namei(dev, sb, dname);
+  /* Directorio padre en exclusiva, y después el hijo. */
+  idir = namei(dev, sb, dname, I_EXCLUSIVE);
   free(dirc);
   if (!idir)
     {
       free(basec);
-      return -1;
+      return done(-ENOENT);
     }
 
   de = get_dir_entry_by_name(dev, sb, idir, bname);
-  if (!de)
+  if (!de || de->inode < 0)
     {
-      free(idir);
+      free(de);
+      iunlock(idir);
+      iput(dev, sb, idir);
       free(basec);
 
-      return -1;
+      return done(-ENOENT);
     }
 
   inode = iget(dev, sb, de->inode);
   if (!inode)
     {
       free(de);
-      free(idir);
-      free(dirc);
+      iunlock(idir);
+      iput(dev, sb, idir);
       free(basec);
 
-      return -1;
+      return done(-1);
     }
+  ilock(inode, I_EXCLUSIVE);
 
   if (!can_write_p(inode))
     {
-      free(inode);
-      free(de);
-      free(idir);
-      free(basec);
-
-      return -EACCES;
+      res = -EACCES;
     }
-
   /* ¡Si el directorio no está vacío, no se puede borrar! */
-  if (inode->size > 2*sizeof(struct dir_entry))
+  else if (dir_empty_p(dev, sb, inode) != 1)
     {
-      free(inode);
-      free(de);
-      free(idir);
-      free(basec);
-
-      return -ENOTEMPTY;
+      res = -ENOTEMPTY;
     }
-
-  if (del_dir_entry_by_name(dev, sb, idir, bname) < 0)
+  else if (del_dir_entry_by_name(dev, sb, idir, bname) < 0)
     {
-      free(inode);
-      free(de);
-      free(idir);
-      free(basec);
-
-      return -1;
+      res = -1;
     }
+  else
+    {
+      idir->link_counter--;
+      idir->modified = 1;
 
-  idir->link_counter--;
-  iput(dev, sb, idir);
-
-  free(idir);
-  free(basec);
-
-
-  inode->link_counter--;
-  iput(dev, sb, inode);
+      inode->link_counter--;
+      inode->modified = 1;
 
-  if (inode->link_counter == 0)
-    {
-      ifree(dev, sb, inode);
+      if (inode->link_counter == 0)
+        {
+          ifree(dev, sb, inode);
+        }
     }
 
-  superblock_write(dev, sb);
-
-  free(inode);
+  iunlock(inode);
+  iput(dev, sb, inode);
   free(de);
+  iunlock(idir);
+  iput(dev, sb, idir);
+  free(basec);
 
-  return 0;
+  return dirtied(res);
 }
 
-static int gnordofs_truncate(const char *path, off_t size)
+static int do_truncate(const char *path, off_t size,
+                       struct fuse_file_info *fi)
 {
-  char *p;
   inode_t *inode;
+  int res = 0;
 
-  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_truncate(path = %s, size = %d)\n", path, size);
-
-  p = strdup(path);
-  inode = namei(dev, sb, p);
-  free(p);
+  journal_begin();
+  inode = file_get(path, fi, I_EXCLUSIVE);
   if (!inode)
     {
-      return -ENOENT;
+      return done(-ENOENT);
     }
 
-  if (!can_write_p(inode))
+  if (!HANDLE(fi) && !can_write_p(inode))
     {
-      free(inode);
-      return -EACCES;
+      res = -EACCES;
     }
-
-  if (inode_truncate(dev, sb, inode, size) < 0)
+  else if (inode_truncate(dev, sb, inode, size) < 0)
+    {
+      res = -1;
+    }
+  else
     {
-      free(inode);
-      return -1;
+      inode->mtime = time(NULL);
+      inode->modified = 1;
     }
 
-  inode->mtime = time(NULL);
-  iput(dev, sb, inode);
-  superblock_write(dev, sb);
+  file_put(inode, fi);
 
-  return 0;
+  return dirtied(res);
+}
+
+static int gnordofs_truncate(const char *path, off_t size)
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_truncate(path = %s, size = %lld)\n", path, (long long) size);
+
+  return do_truncate(path, size, NULL);
+}
+
+static int gnordofs_ftruncate(const char *path, off_t size,
+                              struct fuse_file_info *fi)
+{
+  DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_ftruncate(path = %s, size = %lld)\n", path, (long long) size);
+
+  return do_truncate(path, size, fi);
 }
 
 static int gnordofs_unlink(const char *path)
@@ -569,125 +907,128 @@ static int gnordofs_unlink(const char *path)
   char *dirc, *basec, *bname, *dname;
   inode_t *idir, *inode;
   dir_entry_t *de;
+  int res = 0;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_unlink(path = %s)\n", path);
 
+  journal_begin();
   dirc = strdup(path);
   basec = strdup(path);
 
   dname = dirname(dirc);
   bname = basename(basec);
 
-  idir = namei(dev, sb, dname);
+  /* Directorio padre en exclusiva, y después el hijo. */
+  idir = namei(dev, sb, dname, I_EXCLUSIVE);
   free(dirc);
   if (!idir)
     {
       free(basec);
-      return -1;
+      return done(-ENOENT);
     }
 
   de = get_dir_entry_by_name(dev, sb, idir, bname);
-  if (!de)
+  if (!de || de->inode < 0)
     {
-      free(idir);
+      free(de);
+      iunlock(idir);
+      iput(dev, sb, idir);
       free(basec);
 
-      return -1;
+      return done(-ENOENT);
     }
 
   inode = iget(dev, sb, de->inode);
   if (!inode)
     {
       free(de);
-      free(idir);
+      iunlock(idir);
+      iput(dev, sb, idir);
       free(basec);
 
-      return -1;
+      return done(-1);
     }
+  ilock(inode, I_EXCLUSIVE);
 
   if (!can_write_p(inode))
     {
-      free(inode);
-      free(de);
-      free(idir);
-      free(basec);
-
-      return -EACCES;
+      res = -EACCES;
     }
-
-
-  if (del_dir_entry_by_name(dev, sb, idir, bname) < 0)
+  else if (del_dir_entry_by_name(dev, sb, idir, bname) < 0)
     {
-      free(inode);
-      free(de);
-      free(idir);
-      free(basec);
-
-      return -1;
+      res = -1;
     }
+  else
+    {
+      idir->modified = 1;
 
-  iput(dev, sb, idir);
-
-  free(idir);
-  free(basec);
-
-  inode->link_counter--;
-  iput(dev, sb, inode);
+      inode->link_counter--;
+      inode->modified = 1;
 
-  if (inode->link_counter == 0)
-    {
-      ifree(dev, sb, inode);
+      /* Si sigue abierto, lo libera el último release(). */
+      if (inode->link_counter == 0 && inode->opened == 0)
+        {
+          ifree(dev, sb, inode);
+        }
     }
 
-  superblock_write(dev, sb);
-
-  free(inode);
+  iunlock(inode);
+  iput(dev, sb, inode);
   free(de);
+  iunlock(idir);
+  iput(dev, sb, idir);
+  free(basec);
 
-  return 0;
+  return dirtied(res);
 }
 
 static int gnordofs_write(const char *path, const char *buf, size_t size, off_t offset,
-                          struct fuse_file_info *fi __attribute__((unused)))
+                          struct fuse_file_info *fi)
 {
   inode_t *inode;
+  time_t now;
   int count;
-  char *p;
 
   DEBUG(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> gnordofs_write(path = %s, size = %d, offset = %d)\n", path, size, offset);
 
-  p = strdup(path);
-  inode = namei(dev, sb, p);
-  free(p);
+  journal_begin();
+  inode = file_get(path, fi, I_EXCLUSIVE);
   if (!inode)
     {
-      return -1;
+      return done(-1);
     }
 
-  if (!can_write_p(inode))
+  if (!HANDLE(fi) && !can_write_p(inode))
     {
-      free(inode);
-      return -EACCES;
+      file_put(inode, fi);
+      return done(-EACCES);
     }
 
-  do_lseek(dev, sb, inode, offset, SEEK_SET);
-  count = do_write(dev, sb, inode, buf, size);
+  count = do_write(dev, sb, inode, buf, size, offset);
   if (count < 0)
     {
-      free(inode);
-      return -ENOSPC;
+      file_put(inode, fi);
+      return done(-ENOSPC);
     }
 
-  /* Actualizar campo de tamaño si es necesario. */
+  /* Actualizar campo de tamaño si es necesario. Si cambia la asignación
+     de bloques, do_write() ya lo ha marcado como modificado. */
   if (offset + count > inode->size)
-    inode->size = offset + count;
+    {
+      inode->size = offset + count;
+      inode->modified = 1;
+    }
 
-  iput(dev, sb, inode);
-  superblock_write(dev, sb);
+  now = time(NULL);
+  if (inode->mtime != now || inode->ctime != now)
+    {
+      inode->mtime = inode->ctime = now;
+      inode_dirty_times(sb, inode);
+    }
 
-  free(inode);
+  file_put(inode, fi);
 
-  return count;
+  return dirtied(count);
 }
 
 
@@ -697,7 +1038,14 @@ static struct fuse_operations oper = {
   .access       = gnordofs_access,
   .chmod        = gnordofs_chmod,
   .chown        = gnordofs_chown,
+  .create       = gnordofs_create,
+  .destroy      = gnordofs_destroy,
+  .flush        = gnordofs_flush,
+  .fsync        = gnordofs_fsync,
+  .fsyncdir     = gnordofs_fsyncdir,
+  .ftruncate    = gnordofs_ftruncate,
   .getattr	= gnordofs_getattr,
+  .init         = gnordofs_init,
   .mkdir        = gnordofs_mkdir,
   .mknod        = gnordofs_mknod,
   .open		= gnordofs_open,
@@ -713,8 +1061,79 @@ static struct fuse_operations oper = {
 
 
 
+static int gnordofs_opt_proc(void *data __attribute__((unused)),
+                             const char *arg,
+                             int key,
+                             struct fuse_args *outargs __attribute__((unused)))
+{
+  const char *value = strchr(arg, '=');
+  char *end;
+  unsigned long n = 0;
+
+  if (key == KEY_PERIODIC || key == KEY_DIRTY_AGE || key == KEY_DIRTY_BYTES)
+    {
+      n = strtoul(value + 1, &end, 10);
+      if (end == value + 1 || *end != '\0')
+        {
+          fprintf(stderr, "Valor no válido en la opción %s\n", arg);
+          return -1;
+        }
+    }
+
+  switch (key)
+    {
+    case KEY_STRICTATIME:
+      sb->atime_mode = ATIME_STRICT;
+      return 0;
+    case KEY_RELATIME:
+      sb->atime_mode = ATIME_RELATIME;
+      return 0;
+    case KEY_NOATIME:
+      sb->atime_mode = ATIME_NOATIME;
+      return 0;
+    case KEY_LAZYTIME:
+      sb->lazytime = 1;
+      return 0;
+    case KEY_NOLAZYTIME:
+      sb->lazytime = 0;
+      return 0;
+    case KEY_SYNC:
+      flush_config.mode = FLUSH_SYNC;
+      return 0;
+    case KEY_ASYNC:
+      flush_config.mode = FLUSH_ASYNC;
+      return 0;
+    case KEY_PERIODIC:
+      if (n == 0)
+        {
+          fprintf(stderr, "periodic tiene que ser mayor que cero\n");
+          return -1;
+        }
+      flush_config.mode = FLUSH_PERIODIC;
+      flush_config.interval = n;
+      return 0;
+    case KEY_DIRTY_AGE:
+      flush_config.dirty_age = n;
+      return 0;
+    case KEY_DIRTY_BYTES:
+      flush_config.dirty_bytes = n;
+      return 0;
+    case KEY_NOURING:
+      uring_disable();
+      return 0;
+    }
+
+  /* Lo demás, para fuse. */
+  return 1;
+}
+
+
+
+
 int main(int argc, char *argv[])
 {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
   openlog("GNORDOFS", LOG_PID, LOG_LOCAL0);
   DEBUG("#########################################################################\n");
   DEBUG("########################## GNORDOFS v0.0.1 beta #########################\n");
@@ -722,6 +1141,40 @@ int main(int argc, char *argv[])
 
   dev = open("./gnordofs.img", O_RDWR);
   sb = superblock_read(dev);
+  if (!sb)
+    {
+      fprintf(stderr, "gnordofs.img no es un gnordofs válido (o es de una versión anterior)\n");
+      return 1;
+    }
+  bcache_init(BCACHE_DEFAULT_SIZE);
+  if (journal_replay(dev, sb) < 0)
+    {
+      fprintf(stderr, "No se pudo recuperar el diario de gnordofs.img\n");
+      return 1;
+    }
+  if (balloc_load(dev, sb) < 0)
+    {
+      fprintf(stderr, "No se pudo cargar el mapa de bloques libres de gnordofs.img\n");
+      return 1;
+    }
+  if (inode_convert(dev, sb) < 0)
+    {
+      fprintf(stderr, "No se pudieron convertir los inodos de gnordofs.img\n");
+      return 1;
+    }
+  if (ibitmap_load(dev, sb) < 0)
+    {
+      fprintf(stderr, "No se pudo cargar el mapa de inodos libres de gnordofs.img\n");
+      return 1;
+    }
+  if (journal_start(dev, sb) < 0)
+    {
+      fprintf(stderr, "No se pudo poner en marcha el diario de gnordofs.img\n");
+      return 1;
+    }
+  if (fuse_opt_parse(&args, NULL, gnordofs_opts, gnordofs_opt_proc) < 0)
+    return 1;
+  superblock_print_dump_debug(sb);
 
-  return fuse_main(argc, argv, &oper, NULL);
+  return fuse_main(args.argc, args.argv, &oper, NULL);
 }
@@ -0,0 +1,421 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-08 12:41:09 holzplatten"
+ *
+ *       File:         ibitmap.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Sep  8 11:02:37 2013
+ *
+ *       Reserva de inodos con mapa de bits.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <balloc.h>
+#include <block.h>
+#include <ibitmap.h>
+#include <inode.h>
+#include <misc.h>
+#include <superblock.h>
+
+
+#define BIT_USED_P(map, n) ((map)[(n) / 8] & (1 << ((n) % 8)))
+#define BIT_SET(map, n) ((map)[(n) / 8] |= (1 << ((n) % 8)))
+#define BIT_CLEAR(map, n) ((map)[(n) / 8] &= ~(1 << ((n) % 8)))
+
+
+
+
+/*-
+ *      Routine:       ibitmap_new
+ *
+ *      Purpose:
+ *              Reserva la copia en memoria del mapa de bits de inodos, con
+ *              ibitmap_blocks bloques, y marca como ocupados los bits que
+ *              sobran tras el último inodo.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con inode_count e
+ *              ibitmap_blocks ya puestos.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+ibitmap_new(superblock_t * const sb)
+{
+  unsigned long n;
+
+  free(sb->ibitmap);
+  sb->ibitmap = calloc(sb->ibitmap_blocks, sizeof(struct block));
+  if (!sb->ibitmap)
+    return -1;
+
+  for (n = sb->inode_count; n < sb->ibitmap_blocks * BITS_PER_BLOCK; n++)
+    BIT_SET(sb->ibitmap, n);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_sync
+ *
+ *      Purpose:
+ *              Pasa a la caché de bloques los bloques del mapa de bits de
+ *              inodos que contienen los bits de first a last.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+ibitmap_sync(int dev, superblock_t * const sb,
+             unsigned long first, unsigned long last)
+{
+  unsigned long b;
+  int res = 0;
+
+  for (b = first / BITS_PER_BLOCK; b <= last / BITS_PER_BLOCK; b++)
+    if (writemeta(dev, sb, sb->ibitmap_base + b,
+                  (block_t *) (sb->ibitmap + b * sizeof(struct block)),
+                  B_NO_OWNER) < 0)
+      res = -1;
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_place
+ *
+ *      Purpose:
+ *              Calcula cuántos bloques necesita el mapa de bits de inodos,
+ *              les busca sitio seguido en la zona de bloques y lo escribe
+ *              entero.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa de bloques
+ *              cargado.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+ibitmap_place(int dev, superblock_t * const sb)
+{
+  unsigned long blocks;
+  long base, count;
+
+  blocks = (sb->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  count = blocks;
+  base = balloc(dev, sb, BALLOC_NO_GOAL, &count);
+  if (base < 0)
+    return -1;
+  if (count < blocks)
+    {
+      DEBUG(">> ibitmap_place >> Error: no hay sitio seguido para el mapa de inodos\n");
+      bfree(dev, sb, base, count);
+      return -1;
+    }
+
+  sb->ibitmap_base = base;
+  sb->ibitmap_blocks = blocks;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_init
+ *
+ *      Purpose:
+ *              Crea el mapa de bits de inodos de un sistema de archivos
+ *              nuevo, con todos los inodos libres.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs recién creado.
+ *              sb debe apuntar al superbloque devuelto por
+ *              superblock_init(), después de balloc_init().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+ibitmap_init(int dev, superblock_t * const sb)
+{
+  if (ibitmap_place(dev, sb) < 0 || ibitmap_new(sb) < 0)
+    return -1;
+
+  sb->free_inodes = sb->inode_count;
+  sb->ialloc_rotor = 0;
+
+  return ibitmap_sync(dev, sb, 0, sb->inode_count - 1);
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_convert
+ *
+ *      Purpose:
+ *              Construye el mapa de bits de inodos de un sistema de
+ *              archivos de la revisión 0 o de la 0xCA03 leyendo de una
+ *              pasada la zona de inodos, le busca sitio y deja el
+ *              superbloque en la revisión 0xCA04 (la de journal_start()).
+ *              En la 0 es la única escritura del superbloque de toda la
+ *              conversión: hasta aquí sólo se ha escrito en bloques que
+ *              estaban libres, y los que se han liberado por el camino no
+ *              se dejan volver a usar hasta ahora.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque de la revisión 0xCA03, o
+ *              de la 0 con los inodos ya en el formato nuevo, con el mapa
+ *              de bloques cargado.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+ibitmap_convert(int dev, superblock_t * const sb)
+{
+  struct persistent_inode *chunk;
+  unsigned long n, i, count;
+  ssize_t size;
+  int v0;
+
+  DEBUG(">> ibitmap_convert >> Pasando la lista de inodos libres a mapa de bits\n");
+
+  chunk = malloc(IBITMAP_SCAN_CHUNK * sizeof(struct persistent_inode));
+  if (!chunk)
+    return -1;
+
+  /* Desde aquí ya no vale free_inode_list. */
+  if (ibitmap_place(dev, sb) < 0 || ibitmap_new(sb) < 0)
+    {
+      free(chunk);
+      return -1;
+    }
+
+  for (n = 0; n < sb->inode_count; n += count)
+    {
+      count = sb->inode_count - n;
+      if (count > IBITMAP_SCAN_CHUNK)
+        count = IBITMAP_SCAN_CHUNK;
+
+      size = count * sizeof(struct persistent_inode);
+      if (pread(dev, chunk, size,
+                sb->inode_zone_base
+                + (off_t) n * sizeof(struct persistent_inode)) < size)
+        {
+          DEBUG(">> ibitmap_convert >> Error al leer los inodos desde el %lu\n", n);
+          free(chunk);
+          return -1;
+        }
+
+      for (i = 0; i < count; i++)
+        if (chunk[i].type != I_FREE)
+          BIT_SET(sb->ibitmap, n + i);
+    }
+
+  free(chunk);
+
+  for (n = 0, sb->free_inodes = 0; n < sb->inode_count; n++)
+    if (!BIT_USED_P(sb->ibitmap, n))
+      sb->free_inodes++;
+  sb->ialloc_rotor = 0;
+
+  /* El mapa tiene que estar en disco antes que el superbloque que lo
+     señala. */
+  if (ibitmap_sync(dev, sb, 0, sb->inode_count - 1) < 0
+      || bflush(dev, sb) < 0
+      || fdatasync(dev) < 0)
+    return -1;
+
+  v0 = sb->magic2 == MAGIC_NUMBER;
+  sb->magic2 = GNORDOFS_REVISION_NO_JOURNAL;
+  if (superblock_write(dev, sb) < 0 || fdatasync(dev) < 0)
+    return -1;
+
+  /* Ya no queda nada del sistema viejo que proteger. */
+  if (v0)
+    bfree_commit(sb, 0, sb->block_count);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_load
+ *
+ *      Purpose:
+ *              Carga en memoria el mapa de bits de inodos, construyéndolo
+ *              antes si el sistema de archivos es de la revisión 0 o de
+ *              la 0xCA03.
+ *              También recalcula free_inodes a partir del mapa.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa de bloques
+ *              cargado (ver balloc_load()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+ibitmap_load(int dev, superblock_t * const sb)
+{
+  unsigned long n;
+
+  if (sb->magic2 == MAGIC_NUMBER
+      || sb->magic2 == GNORDOFS_REVISION_INODE_LIST)
+    return ibitmap_convert(dev, sb);
+
+  if (ibitmap_new(sb) < 0)
+    return -1;
+
+  if (readblks(dev, sb, sb->ibitmap_base, sb->ibitmap_blocks,
+               (block_t *) sb->ibitmap) < 0)
+    return -1;
+
+  for (n = 0, sb->free_inodes = 0; n < sb->inode_count; n++)
+    if (!BIT_USED_P(sb->ibitmap, n))
+      sb->free_inodes++;
+  sb->ialloc_rotor = 0;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_alloc
+ *
+ *      Purpose:
+ *              Marca como ocupado el primer inodo libre a partir del
+ *              último que se dio, dando la vuelta al llegar al final. Se
+ *              salta de golpe los bytes del mapa que están llenos.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              El llamante debe tener sb->inode_lock.
+ *      Returns:
+ *              El número del inodo.
+ *              -1 si no quedan inodos libres.
+ *
+ */
+long
+ibitmap_alloc(int dev, superblock_t * const sb)
+{
+  unsigned long n, seen;
+
+  if (!sb->free_inodes)
+    return -1;
+
+  n = sb->ialloc_rotor < sb->inode_count ? sb->ialloc_rotor : 0;
+  for (seen = 0; seen < sb->inode_count; )
+    {
+      if (n % 8 == 0 && sb->ibitmap[n / 8] == 0xff)
+        {
+          n += 8;
+          seen += 8;
+        }
+      else if (BIT_USED_P(sb->ibitmap, n))
+        {
+          n++;
+          seen++;
+        }
+      else
+        {
+          BIT_SET(sb->ibitmap, n);
+          sb->free_inodes--;
+          __atomic_store_n(&sb->modified, 1, __ATOMIC_RELAXED);
+          sb->ialloc_rotor = n + 1;
+          ibitmap_sync(dev, sb, n, n);
+          return n;
+        }
+
+      if (n >= sb->inode_count)
+        n = 0;
+    }
+
+  DEBUG(">> ibitmap_alloc >> Error: free_inodes = %lu, pero el mapa está lleno\n",
+        sb->free_inodes);
+  sb->free_inodes = 0;
+
+  return -1;
+}
+
+
+
+
+/*-
+ *      Routine:       ibitmap_free
+ *
+ *      Purpose:
+ *              Marca como libre el inodo n.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa cargado.
+ *              El llamante debe tener sb->inode_lock.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (fuera de rango o ya libre).
+ *
+ */
+int
+ibitmap_free(int dev, superblock_t * const sb, unsigned long n)
+{
+  if (n >= sb->inode_count || !BIT_USED_P(sb->ibitmap, n))
+    {
+      DEBUG(">> ibitmap_free >> Error: el inodo %lu no está ocupado\n", n);
+      return -1;
+    }
+
+  BIT_CLEAR(sb->ibitmap, n);
+  sb->free_inodes++;
+  __atomic_store_n(&sb->modified, 1, __ATOMIC_RELAXED);
+
+  /* Que se reutilicen antes los huecos que quedan atrás. */
+  if (n < sb->ialloc_rotor)
+    sb->ialloc_rotor = n;
+
+  return ibitmap_sync(dev, sb, n, n);
+}
@@ -0,0 +1,65 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __BALLOC_H__
+#define __BALLOC_H__
+
+#include <block.h>
+#include <superblock.h>
+
+/*
+ * Bloques libres. Un bit por bloque de la zona de bloques (1 = ocupado),
+ * guardado en bitmap_blocks bloques consecutivos a partir de bitmap_base,
+ * que están marcados como ocupados en el propio mapa. En memoria se
+ * tiene una copia entera, protegida por sb->block_lock.
+ */
+#define BITS_PER_BLOCK (8 * sizeof(struct block))
+
+/* Sin bloque preferido: seguir por donde se quedó la última reserva. */
+#define BALLOC_NO_GOAL -1
+
+/* Ventana de prerreserva de un archivo: len bloques a partir de start,
+   apartados para él. Si gen no coincide con sb->prealloc_gen, es que se
+   le han quitado para otros. */
+struct balloc_window {
+  long start;
+  long len;
+  unsigned long gen;
+};
+
+/* Bloques de más que se apartan para la ventana de un archivo. */
+#define BALLOC_WINDOW 64
+
+/* Bloques que breserve() no promete nunca, para los bloques de índice
+   que hagan falta al asignar los reservados. */
+#define BALLOC_META_RESERVE 32
+
+int balloc_init(int dev, superblock_t * const sb);
+int balloc_load(int dev, superblock_t * const sb);
+long balloc(int dev, superblock_t * const sb, long goal, long *count);
+long balloc_win(int dev, superblock_t * const sb, struct balloc_window *win,
+                long goal, long *count, int reserved);
+void bwindow_release(superblock_t * const sb, struct balloc_window *win);
+int bfree(int dev, superblock_t * const sb, long n, long count);
+void bfree_commit(superblock_t * const sb, long n, long count);
+int breserve(superblock_t * const sb, long count);
+void bunreserve(superblock_t * const sb, long count);
+
+#endif
@@ -25,6 +25,13 @@
 
 #define BLOCK_SIZE 4096
 
+/* Número de buffers por defecto de la caché de bloques (4 MiB). */
+#define BCACHE_DEFAULT_SIZE 1024
+#define BCACHE_HASH_SIZE 1021
+
+/* Peticiones de lectura anticipada que puede haber pendientes. */
+#define BCACHE_RA_QUEUE 64
+
 struct block
 {
   unsigned char data[BLOCK_SIZE];
@@ -32,13 +39,39 @@ struct block
 
 typedef struct block block_t;
 
+/* Dueño de los bloques de metadatos que no son de ningún archivo
+   (mapas de bits, superbloque). */
+#define B_NO_OWNER -1
+
+struct bcache_stats
+{
+  unsigned long nbuffers;
+  unsigned long allocated;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long dirty;
+  unsigned long writebacks;
+  unsigned long evictions;
+  unsigned long readaheads;
+};
+
 long allocblk(int dev, superblock_t * const sb);
 block_t * getblk(int dev, superblock_t *sb, long n);
-int writeblk(int dev, superblock_t *sb, long n, block_t *datablock);
+int writeblk(int dev, superblock_t *sb, long n, block_t *datablock, unsigned owner);
+int writemeta(int dev, superblock_t *sb, long n, block_t *datablock, int owner);
+int readblks(int dev, superblock_t *sb, long n, long count, block_t *data);
+int writeblks(int dev, superblock_t *sb, long n, long count, const block_t *data);
+long breadahead(int dev, superblock_t *sb, long n, long count);
 int freeblk(int dev, superblock_t * const sb, long block);
+void brelse(block_t *datablock);
+int bflush(int dev, superblock_t *sb);
+int bflush_inode(int dev, superblock_t *sb, unsigned n);
+int bflush_owners(int dev, superblock_t *sb, int *owners, unsigned long n);
 
-int free_block_list_init(int fd, const superblock_t * const sb);
-
-void print_free_block_list(int fd, const superblock_t * const sb);
+int bcache_init(unsigned long nbuffers);
+int bcache_readahead_start(void);
+void bcache_readahead_stop(void);
+void bcache_get_stats(struct bcache_stats *stats);
+void bcache_print_stats_debug(void);
 
 #endif
@@ -0,0 +1,47 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+/* Número máximo de entradas de la caché de nombres. */
+#define DCACHE_SIZE 4096
+#define DCACHE_HASH_SIZE 1021
+
+/* Número de inodo de una entrada negativa (el nombre no existe). */
+#define DCACHE_NEGATIVE -1
+
+struct dcache_stats
+{
+  unsigned long entries;
+  unsigned long hits;
+  unsigned long negative_hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+int dcache_lookup(unsigned parent, const char * const name, int *inode);
+void dcache_enter(unsigned parent, const char * const name, int inode);
+void dcache_purge(unsigned parent);
+
+void dcache_get_stats(struct dcache_stats *stats);
+void dcache_print_stats_debug(void);
+
+#endif
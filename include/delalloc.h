@@ -0,0 +1,54 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __DELALLOC_H__
+#define __DELALLOC_H__
+
+#include <sys/types.h>
+
+#include <block.h>
+#include <inode.h>
+#include <superblock.h>
+
+/*
+ * Asignación retardada. Los bloques de un archivo con I_EXTENTS que se
+ * escriben sobre un hueco no se asignan en el momento: se guardan en
+ * memoria, en inode->delayed (ordenados por bloque lógico), con un
+ * bloque apartado con breserve(). Al volcarlos se asignan de una vez las
+ * rachas de bloques lógicos seguidos, para que queden seguidas en disco.
+ */
+struct dbuf {
+  long blk;
+  block_t data;
+};
+
+/* Si entre todos los archivos hay más bloques retardados que estos
+   (16 MiB), se vuelcan los del archivo que se está escribiendo. */
+#define DELALLOC_MAX_BLOCKS 4096
+
+block_t * delalloc_get(int dev, superblock_t * const sb, inode_t *inode,
+                       long blk, int create);
+long delalloc_next(inode_t *inode, long blk);
+int delalloc_pending_p(inode_t *inode);
+unsigned long delalloc_pending(void);
+int delalloc_flush(int dev, superblock_t * const sb, inode_t *inode);
+void delalloc_truncate(superblock_t * const sb, inode_t *inode, off_t size);
+
+#endif
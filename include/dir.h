@@ -21,24 +21,78 @@
 #ifndef __DIR_H__
 #define __DIR_H__
 
+#include <sys/types.h>
+
 #include <inode.h>
 #include <superblock.h>
 
+/* Longitud máxima de un nombre. */
+#define DIR_NAME_MAX 251
+
+/* Entrada de directorio, tal y como la devuelven las funciones de este
+   módulo. */
 typedef struct dir_entry {
   int inode;
-  unsigned char name[252];
+  unsigned char type;           /* itype_t del inodo. */
+  unsigned char name[DIR_NAME_MAX+1];
 } dir_entry_t;
 
-#define DIR_MAX_ENTRIES 4*BLOCKS_PER_INODE
+/*
+ * Registro de directorio en disco. Cada bloque de un directorio es una
+ * cadena de registros que lo cubre entero; rec_len es la distancia hasta
+ * el siguiente. Los libres tienen inode == -1. El nombre no lleva '\0'.
+ *
+ *  - inode (4 bytes)
+ *  - rec_len (2 bytes)
+ *  - name_len (1 byte)
+ *  - type (1 byte)
+ *  - name (name_len bytes, redondeado a múltiplo de 4)
+ */
+struct dir_record {
+  int inode;
+  unsigned short rec_len;
+  unsigned char name_len;
+  unsigned char type;
+  char name[];
+};
+
+#define DIR_RECORD_LEN(name_len)                                   \
+  ((sizeof(struct dir_record) + (name_len) + 3) & ~3)
+
+/* Directorios indexados (I_INDEXED): el bloque 0 guarda la raíz del
+   índice, y los bloques 1..count son hojas con registros normales. La
+   hoja entries[i].block contiene los nombres cuyo hash está en
+   [entries[i].hash, entries[i+1].hash). */
+#define DX_MAGIC 0x49584447     /* "GDXI" */
+
+struct dx_entry {
+  unsigned hash;
+  unsigned block;
+};
+
+#define DX_MAX_ENTRIES ((sizeof(struct block) - 2*sizeof(unsigned))  \
+                        / sizeof(struct dx_entry))
+
+struct dx_root {
+  unsigned magic;
+  unsigned count;
+  struct dx_entry entries[DX_MAX_ENTRIES];
+};
+
+/* Función a la que dir_iterate() pasa cada entrada, junto con el offset
+   desde el que seguir. Si devuelve distinto de cero, se para. */
+typedef int (*dir_actor_t)(void *ctx, const dir_entry_t *de, off_t next);
 
 int add_dir_entry(int dev, superblock_t *, inode_t *,
                   inode_t * entry_inode,
                   const char * const entry_name);
 int del_dir_entry_by_name(int dev, superblock_t *, inode_t *,
                           const char * const entry_name);
-dir_entry_t * get_dir_entry(int dev, superblock_t *,
-                            inode_t *, int n);
 dir_entry_t * get_dir_entry_by_name(int dev, superblock_t *,
                                     inode_t *, char *name);
+int dir_iterate(int dev, superblock_t *, inode_t *, off_t offset,
+                dir_actor_t actor, void *ctx);
+int dir_empty_p(int dev, superblock_t *, inode_t *);
+int dir_convert(int dev, superblock_t *, inode_t *);
 
 #endif
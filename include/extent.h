@@ -0,0 +1,74 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+#include <block.h>
+#include <inode.h>
+#include <superblock.h>
+
+/*
+ * Árbol de extents de un inodo con I_EXTENTS. La raíz va en el propio
+ * inodo (extent_root). Con depth 0 la raíz guarda directamente los
+ * extents; con depth 1 guarda entradas de índice que apuntan a bloques
+ * hoja, cada uno con su cabecera y sus extents. En ambos niveles las
+ * entradas están ordenadas por bloque lógico.
+ */
+#define EXTENT_MAGIC 0xE47E
+
+struct extent_header {
+  unsigned short magic;
+  unsigned short entries;
+  unsigned short max;
+  unsigned short depth;
+};
+
+/* len bloques del archivo, a partir de logical, están en disco a partir
+   del bloque absoluto start. */
+struct extent {
+  unsigned logical;
+  unsigned len;
+  long start;
+};
+
+/* La hoja block tiene los extents desde el bloque lógico logical. */
+struct extent_idx {
+  unsigned logical;
+  unsigned unused;
+  long block;
+};
+
+#define EXTENT_ROOT_MAX ((EXTENT_ROOT_SIZE - sizeof(struct extent_header)) \
+                         / sizeof(struct extent))
+#define EXTENT_LEAF_MAX ((sizeof(struct block) - sizeof(struct extent_header)) \
+                         / sizeof(struct extent))
+
+/* Bloques que se pueden direccionar con el campo logical de un extent. */
+#define EXTENT_MAX_BLOCKS (1UL << (8*sizeof(unsigned)))
+
+void extent_init(inode_t *inode);
+long extent_bmap(int dev, superblock_t * const sb, inode_t *inode,
+                 long blk, long *count);
+long extent_allocblk(int dev, superblock_t * const sb, inode_t *inode, long blk,
+                     long *count, int reserved);
+int extent_truncate(int dev, superblock_t * const sb, inode_t *inode, long blk);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __FLUSHER_H__
+#define __FLUSHER_H__
+
+#include <inode.h>
+#include <superblock.h>
+
+/*
+ * Cuándo se vuelca lo pendiente (opciones de montaje sync, async y
+ * periodic=N). En cualquier modo se vuelca también si hay más de
+ * dirty_bytes sucios, y quien escribe se para a esperar una pasada si
+ * hay más del doble.
+ */
+#define FLUSH_PERIODIC 0        /* Cada interval segundos. */
+#define FLUSH_ASYNC 1           /* Cuando lo sucio tiene dirty_age segundos. */
+#define FLUSH_SYNC 2            /* Antes de terminar cada operación. */
+
+struct flusher_config {
+  int mode;
+  unsigned interval;
+  unsigned dirty_age;
+  unsigned long dirty_bytes;
+};
+
+/* Valores por defecto. */
+#define FLUSHER_INTERVAL 5
+#define FLUSHER_DIRTY_AGE 30
+#define FLUSHER_DIRTY_BYTES (8UL << 20)
+
+int fs_sync(int dev, superblock_t * const sb, int periodic);
+int fs_fsync(int dev, superblock_t * const sb, inode_t *inode, int datasync);
+unsigned long fs_dirty_bytes(void);
+int flusher_start(int dev, superblock_t * const sb,
+                  const struct flusher_config *config);
+int flusher_dirty(void);
+void flusher_stop(void);
+
+#endif
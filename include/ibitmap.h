@@ -0,0 +1,42 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __IBITMAP_H__
+#define __IBITMAP_H__
+
+#include <superblock.h>
+
+/*
+ * Inodos libres. Un bit por inodo (1 = ocupado), guardado en
+ * ibitmap_blocks bloques consecutivos de la zona de bloques a partir de
+ * ibitmap_base. En memoria se tiene una copia entera, protegida por
+ * sb->inode_lock, igual que el mapa de bloques (ver balloc.h).
+ */
+
+/* Inodos que se leen de golpe al construir el mapa de una revisión
+   anterior. */
+#define IBITMAP_SCAN_CHUNK 256
+
+int ibitmap_init(int dev, superblock_t * const sb);
+int ibitmap_load(int dev, superblock_t * const sb);
+long ibitmap_alloc(int dev, superblock_t * const sb);
+int ibitmap_free(int dev, superblock_t * const sb, unsigned long n);
+
+#endif
@@ -21,6 +21,10 @@
 #ifndef __INODE_H__
 #define __INODE_H__
 
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <balloc.h>
 #include <block.h>
 
 #define BLK_UNASSIGNED -1492
@@ -34,10 +38,14 @@ typedef enum {
 
 #define N_DIRECT_BLOCKS 10
 #define N_SINGLE_INDIRECT_BLOCKS (sizeof(struct block) / sizeof(long))
+#define N_DOUBLE_INDIRECT_BLOCKS (N_SINGLE_INDIRECT_BLOCKS * N_SINGLE_INDIRECT_BLOCKS)
+#define N_TRIPLE_INDIRECT_BLOCKS (N_DOUBLE_INDIRECT_BLOCKS * N_SINGLE_INDIRECT_BLOCKS)
+
+#define EXTENT_ROOT_SIZE ((N_DIRECT_BLOCKS + 3) * sizeof(long))
 
 #define INODE_PERSISTENT_DATA                                      \
   itype_t type;                                                    \
-  unsigned size;                                                   \
+  unsigned long long size;                                         \
   unsigned link_counter;                                           \
                                                                    \
   time_t atime;                                                    \
@@ -48,35 +56,106 @@ typedef enum {
   unsigned group;                                                  \
                                                                    \
   unsigned perms;                                                  \
+  unsigned flags;                                                  \
                                                                    \
-  long direct_blocks[N_DIRECT_BLOCKS];                             \
-  long single_indirect_blocks;
+  union {                                                          \
+    struct {                                                       \
+      long direct_blocks[N_DIRECT_BLOCKS];                         \
+      long single_indirect_blocks;                                 \
+      long double_indirect_blocks;                                 \
+      long triple_indirect_blocks;                                 \
+    };                                                             \
+    /* Con I_EXTENTS, raíz del árbol de extents (ver extent.h). */ \
+    unsigned char extent_root[EXTENT_ROOT_SIZE];                   \
+  };
+
+/* Valores de flags. */
+#define I_INDEXED 0x1           /* Directorio con índice hash. */
+#define I_EXTENTS 0x2           /* Bloques mapeados con extents. */
+
+#define BLOCKS_PER_INODE (N_DIRECT_BLOCKS + N_SINGLE_INDIRECT_BLOCKS    \
+                          + N_DOUBLE_INDIRECT_BLOCKS                 \
+                          + N_TRIPLE_INDIRECT_BLOCKS)
+
+/* Lo que se guarda de cada inodo en la zona de inodos. */
+struct persistent_inode {
+  INODE_PERSISTENT_DATA
 
-#define BLOCKS_PER_INODE (N_DIRECT_BLOCKS + 1*N_SINGLE_INDIRECT_BLOCKS)
+  unsigned n;
+};
+
+/* Tamaño de la tabla de inodos en memoria. */
+#define ICACHE_SIZE 1024
+#define ICACHE_HASH_SIZE 509
 
+/* Inodo en memoria. Empieza con los mismos campos que persistent_inode
+   para poder leerlo y escribirlo directamente de disco. */
 struct inode {
   INODE_PERSISTENT_DATA
   
   unsigned n;
-  unsigned offset_ptr;
+
+  pthread_rwlock_t lock;
+  unsigned refcount;
+  char valid, error;
+  /* Distinto de cero si hay que guardarlo en disco. */
+  char modified;
+  /* Con lazytime, desde cuándo tiene fechas cambiadas que no se han
+     guardado (0 si ninguna). Sólo con esto no se marca modified. */
+  time_t times_dirty;
+
+  /* Bloques con asignación retardada, ordenados (ver delalloc.h). */
+  struct dbuf **delayed;
+  unsigned ndelayed, delayed_max;
+
+  /* Ventana de prerreserva para las escrituras al final (ver balloc.h). */
+  struct balloc_window pa;
+
+  /* Descriptores abiertos sobre el inodo. Mientras haya alguno no se
+     libera aunque se quede sin enlaces. */
+  unsigned opened;
+
+  struct inode *hash_next;
+  struct inode *free_next, *free_prev;
 };
 
 typedef struct inode inode_t;
 
-inode_t * namei(int fd, superblock_t * const sb, char * path);
-inode_t * iget(int dev, const superblock_t * const sb, int n);
+/* Con lazytime, lo más que pueden pasar en memoria las fechas cambiadas
+   de un inodo antes de que el volcado periódico las guarde (12 horas). */
+#define LAZYTIME_MAX_AGE (12 * 60 * 60)
+
+/* Modos de bloqueo de un inodo. */
+#define I_SHARED 0
+#define I_EXCLUSIVE 1
+
+void ilock(inode_t *inode, int mode);
+void iunlock(inode_t *inode);
+
+inode_t * namei(int fd, superblock_t * const sb, char * path, int mode);
+inode_t * iget(int dev, superblock_t * const sb, int n);
 inode_t * ialloc(int dev, superblock_t * const sb);
-int iput(int dev, const superblock_t * const sb, inode_t * inode);
+int ifree(int dev, superblock_t * const sb, inode_t *inode);
+int iput(int dev, superblock_t * const sb, inode_t * inode);
+int iwrite(int dev, const superblock_t * const sb, inode_t * inode);
+int iflush(int dev, superblock_t * const sb, int periodic);
+int isync(int dev, superblock_t * const sb, inode_t *inode, int datasync);
+int inode_writeback(int dev, superblock_t * const sb, inode_t *inode);
 
 long inode_getblk(int dev, superblock_t * const sb,
                   inode_t * inode, long blk);
+long inode_bmap(int dev, superblock_t * const sb,
+                inode_t * inode, long blk, long *count);
 long inode_allocblk(int dev, superblock_t * const sb,
-                    inode_t * inode, long blk);
+                    inode_t * inode, long blk, long *count, int reserved);
 int inode_freeblk(int dev, superblock_t * const sb,
                   inode_t * inode, long blk);
-int inode_truncate(int dev, superblock_t * const sb, inode_t *inode, int size);
+void inode_dirty_times(superblock_t * const sb, inode_t *inode);
+void inode_touch(superblock_t * const sb, inode_t *inode);
+int inode_truncate(int dev, superblock_t * const sb, inode_t *inode, off_t size);
 
 int inode_list_init(int fd, const superblock_t * const sb);
+int inode_convert(int dev, superblock_t * const sb);
 
 
 #endif
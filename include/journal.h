@@ -0,0 +1,87 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <superblock.h>
+#include <uring.h>
+
+/*
+ * Diario de metadatos. Ocupa journal_blocks bloques seguidos de la zona
+ * de bloques a partir de journal_base:
+ *  - bloque 0: struct journal_super, con la última transacción que ya
+ *    está escrita en su sitio.
+ *  - bloque 1: struct journal_header de la última transacción confirmada.
+ *  - a continuación, sus etiquetas (struct journal_tag) y, tras ellas,
+ *    los datos de cada etiqueta, seguidos.
+ * Cada etiqueta es una escritura en el dispositivo: un bloque de
+ * metadatos (índices, extents, mapas de bits, directorios), un inodo o
+ * el superbloque. Las escrituras se acumulan en memoria y se confirman
+ * todas juntas en journal_commit(); hasta que no están en su sitio, las
+ * lecturas las ven a través de journal_read(). Cada operación que
+ * modifica metadatos va entre journal_begin() y journal_end(), y nunca
+ * se confirma una transacción con una operación a medias.
+ */
+#define JOURNAL_MAGIC 0x474A4E4C
+
+/* Tamaño del diario que crea mkfs (4 MiB), si el disco da para ello. */
+#define JOURNAL_DEFAULT_BLOCKS 1024
+#define JOURNAL_MIN_BLOCKS 16
+
+#define JOURNAL_HASH_SIZE 1021
+
+struct journal_super {
+  unsigned magic;
+  unsigned long long sequence;
+};
+
+struct journal_header {
+  unsigned magic;
+  unsigned long long sequence;
+  unsigned long ntags;
+  unsigned long tag_blocks;
+  unsigned long payload_blocks;
+  unsigned checksum;
+};
+
+struct journal_tag {
+  off_t offset;
+  unsigned len;
+};
+
+int journal_init(int dev, superblock_t * const sb);
+int journal_replay(int dev, superblock_t * const sb);
+int journal_start(int dev, superblock_t * const sb);
+void journal_begin(void);
+void journal_end(void);
+int journal_readops(int dev, struct uring_op *v, unsigned long n);
+ssize_t journal_read(int dev, void *buf, size_t len, off_t offset);
+ssize_t journal_readv(int dev, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t journal_write(int dev, const void *buf, size_t len, off_t offset,
+                      int owner);
+unsigned long journal_pending(void);
+int journal_free(superblock_t * const sb, long n, long count);
+int journal_commit(void);
+
+#endif
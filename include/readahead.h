@@ -0,0 +1,58 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <inode.h>
+#include <superblock.h>
+
+/*
+ * Lectura anticipada de un archivo abierto. Mientras las lecturas vayan
+ * seguidas, se piden a la caché (ver breadahead()) los bloques que
+ * vienen detrás, en una ventana que crece al doble cada vez hasta
+ * RA_MAX_BLOCKS. Cuando el lector llega al principio de la última
+ * ventana pedida, se pide la siguiente. Las lecturas a saltos la van
+ * reduciendo a la mitad, hasta quitarla.
+ */
+struct readahead {
+  pthread_mutex_t lock;
+  /* Donde empezaría la siguiente lectura si van seguidas. */
+  off_t next;
+  /* Tamaño de la ventana, en bloques (0 si no se lee por anticipado). */
+  long size;
+  /* Primer bloque del archivo que no se ha pedido todavía, y principio
+     de la última ventana pedida. */
+  long end;
+  long mark;
+};
+
+#define RA_MIN_BLOCKS 8         /* 32 KiB. */
+#define RA_MAX_BLOCKS 128       /* 512 KiB. */
+
+void readahead_init(struct readahead *ra);
+void readahead_destroy(struct readahead *ra);
+void readahead(int dev, superblock_t * const sb, inode_t *inode,
+               struct readahead *ra, off_t offset, size_t size);
+
+#endif
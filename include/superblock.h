@@ -21,6 +21,8 @@
 #ifndef __SUPERBLOCK_H__
 #define __SUPERBLOCK_H__
 
+#include <pthread.h>
+
 /* 
  * Estructura del superbloque en disco:
  *  - datablock_count (4 bytes)
@@ -28,19 +30,37 @@
  *  - free_datablocks (4 bytes)
  *  - free_datablock_list (4 bytes * FREE_DATABLOCK_LIST_SIZE)
  *  - free_datablock_index (2 bytes)
+ *    (o, desde la revisión 0xCA03, bitmap_base y bitmap_blocks, y desde
+ *    la 0xCA05, journal_base y journal_blocks)
  * 
  *  - inode_list_size (4 bytes)
  *  - free_inode_count (4 bytes)
  *  - free_inode_list (4 bytes * FREE_INODE_LIST_SIZE)
  *  - free_inode_index (2 bytes)
+ *    (o, desde la revisión 0xCA04, ibitmap_base e ibitmap_blocks)
  * 
  *  - block_zone_base (4 bytes)
  *  - inode_zone_base (4 bytes)
+ *    (en los convertidos de la revisión 0, dentro de la zona de bloques)
  * 
  */
 
 #define MAGIC_NUMBER 0xCACA
 
+/* magic2 identifica la revisión del formato en disco. La 0 (magic2 ==
+   MAGIC_NUMBER) usaba entradas de directorio de tamaño fijo e inodos sin
+   flags, con tamaño de 32 bits y sin indirectos dobles ni triples: al
+   montar se pasa entera a la 0xCA04, cambiando el superbloque una sola
+   vez (ver inode_convert()). La 0xCA01, que ya no se admite, tenía
+   inodos como los de la 0; la 0xCA02, lista encadenada de bloques
+   libres, que se convierte a mapa de bits al montar; la 0xCA03, lista
+   de inodos libres en el superbloque, que se convierte también a mapa
+   de bits; la 0xCA04, sin diario, que se le crea al montar. */
+#define GNORDOFS_REVISION 0xCA05
+#define GNORDOFS_REVISION_NO_JOURNAL 0xCA04
+#define GNORDOFS_REVISION_INODE_LIST 0xCA03
+#define GNORDOFS_REVISION_FREE_LIST 0xCA02
+
 #define FREE_INODE_LIST_SIZE 16
 #define FREE_BLOCK_LIST_SIZE 64
 
@@ -50,14 +70,37 @@
   unsigned long block_count;                                            \
   /* */                                                                 \
   unsigned long free_blocks;                                            \
-  unsigned long free_block_list[FREE_BLOCK_LIST_SIZE];                  \
-  unsigned short free_block_index;                                      \
+  union {                                                               \
+    /* Hasta la revisión 0xCA02. */                                     \
+    struct {                                                            \
+      unsigned long free_block_list[FREE_BLOCK_LIST_SIZE];              \
+      unsigned short free_block_index;                                  \
+    };                                                                  \
+    /* Mapa de bits de bloques ocupados y diario, en la zona de         \
+       bloques. */                                                      \
+    struct {                                                            \
+      unsigned long bitmap_base;                                        \
+      unsigned long bitmap_blocks;                                      \
+      unsigned long journal_base;                                       \
+      unsigned long journal_blocks;                                     \
+    };                                                                  \
+  };                                                                    \
   /* Número de inodos */                                                \
   unsigned long inode_count;                                            \
   /* */                                                                 \
   unsigned long free_inodes;                                            \
-  unsigned long free_inode_list[FREE_INODE_LIST_SIZE];                  \
-  unsigned short free_inode_index;                                      \
+  union {                                                               \
+    /* Hasta la revisión 0xCA03. */                                     \
+    struct {                                                            \
+      unsigned long free_inode_list[FREE_INODE_LIST_SIZE];              \
+      unsigned short free_inode_index;                                  \
+    };                                                                  \
+    /* Mapa de bits de inodos ocupados, en la zona de bloques. */       \
+    struct {                                                            \
+      unsigned long ibitmap_base;                                       \
+      unsigned long ibitmap_blocks;                                     \
+    };                                                                  \
+  };                                                                    \
                                                                         \
   unsigned long first_inode;                                            \
   unsigned long inode_zone_base;                                        \
@@ -66,17 +109,57 @@
 struct superblock {
   SUPERBLOCK_PERSISTENT_DATA
   
-  char lock;	/* ¿Mejor usar un pthread_spinlock_t? */
+  /* Cerrojos de los bloques libres y de la lista de inodos libres. */
+  pthread_mutex_t block_lock;
+  pthread_mutex_t inode_lock;
+  /* Distinto de cero si ha cambiado algo que hay que guardar. Se pone
+     (de forma atómica) con alguno de los dos cerrojos, y se quita con
+     los dos. */
   char modified;
+
+  /* Copia en memoria del mapa de bits (ver balloc.c), y bloque a partir
+     del cual buscar cuando no se pide ninguno en concreto. */
+  unsigned char *bitmap;
+  unsigned long alloc_rotor;
+  /* Bloques apartados en las ventanas de prerreserva de los archivos, y
+     número de veces que se les han quitado (ver balloc.c). */
+  unsigned char *prealloc;
+  unsigned long prealloc_blocks;
+  unsigned long prealloc_gen;
+  /* Bloques ya libres en el mapa que no se pueden volver a usar hasta
+     que se confirme la transacción que los liberó (ver bfree()). */
+  unsigned char *freeing;
+  unsigned long freeing_blocks;
+  /* Bloques prometidos a escrituras con asignación retardada, que
+     todavía no se han sacado del mapa. */
+  unsigned long reserved_blocks;
+
+  /* Copia en memoria del mapa de bits de inodos (ver ibitmap.c), y
+     inodo a partir del cual buscar. Los protege inode_lock. */
+  unsigned char *ibitmap;
+  unsigned long ialloc_rotor;
+
+  /* Opciones de montaje: cuándo se actualiza la fecha de acceso, y si
+     los cambios que sólo afectan a las fechas de un inodo se quedan en
+     memoria (ver inode_dirty_times()). */
+  char atime_mode;
+  char lazytime;
 };
 
 typedef struct superblock superblock_t;
 
+/* Valores de atime_mode. */
+#define ATIME_STRICT 0          /* En cada lectura. */
+#define ATIME_RELATIME 1        /* Si no es posterior a mtime y ctime, o
+                                   tiene más de un día. */
+#define ATIME_NOATIME 2         /* Nunca. */
+
 struct persistent_superblock {
   SUPERBLOCK_PERSISTENT_DATA
 };
 
-int superblock_write(int fd, const superblock_t * const sb);
+int superblock_write(int fd, superblock_t * const sb);
+int superblock_sync(int fd, superblock_t * const sb);
 superblock_t * superblock_read(int fd);
 superblock_t * superblock_init(unsigned long size);
 
@@ -0,0 +1,68 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * E/S del dispositivo con io_uring. Cada hilo tiene su propio anillo,
+ * que se monta la primera vez que lo usa: uring_readv() y uring_writev()
+ * meten en él todas las operaciones que se les pasan, hasta
+ * URING_DEPTH a la vez, y recogen las terminadas de golpe. Las de un
+ * solo trozo sobre la zona registrada con uring_register_buffers() (los
+ * buffers de la caché de bloques) usan las variantes con buffers fijos.
+ * Si el núcleo no tiene io_uring, o se desactiva con uring_disable(),
+ * todo se hace con preadv() y pwritev(), de una en una.
+ */
+
+/* Una lectura o escritura del dispositivo. */
+struct uring_op {
+  const struct iovec *iov;
+  int iovcnt;
+  off_t offset;
+  /* Lo que devolvería preadv() o pwritev(). */
+  ssize_t res;
+};
+
+/* Operaciones en vuelo, como mucho, por anillo. */
+#define URING_DEPTH 64
+
+struct uring_stats
+{
+  unsigned long rings;
+  unsigned long ops;
+  unsigned long fixed;
+  unsigned long enters;
+  unsigned long sync;
+};
+
+void uring_disable(void);
+void uring_register_buffers(void *base, size_t len);
+int uring_readv(int dev, struct uring_op *v, unsigned long n);
+int uring_writev(int dev, struct uring_op *v, unsigned long n);
+ssize_t uring_pread(int dev, void *buf, size_t len, off_t offset);
+ssize_t uring_pwrite(int dev, const void *buf, size_t len, off_t offset);
+void uring_get_stats(struct uring_stats *stats);
+void uring_print_stats_debug(void);
+
+#endif
@@ -0,0 +1,38 @@
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __WRITEBACK_H__
+#define __WRITEBACK_H__
+
+#include <sys/types.h>
+
+/* Un trozo que hay que escribir en el dispositivo. */
+struct wb_extent {
+  off_t offset;
+  const void *data;
+  size_t len;
+};
+
+/* Trozos seguidos que se escriben, como mucho, en una sola llamada. */
+#define WRITEBACK_MAX_IOV 256
+
+int writeback(int dev, struct wb_extent *v, unsigned long n);
+
+#endif
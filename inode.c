@@ -29,36 +29,141 @@
 
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <balloc.h>
 #include <block.h>
+#include <dcache.h>
+#include <delalloc.h>
 #include <dir.h>
+#include <extent.h>
+#include <ibitmap.h>
 #include <inode.h>
+#include <journal.h>
 #include <misc.h>
 #include <superblock.h>
 
 
+#define IHASH(n) ((unsigned) (n) % ICACHE_HASH_SIZE)
+
+/* Inodo tal y como se guardaba en la revisión 0 (ver inode_convert()). */
+struct inode_v0 {
+  itype_t type;
+  unsigned size;
+  unsigned link_counter;
+
+  time_t atime;
+  time_t ctime;
+  time_t mtime;
+
+  unsigned owner;
+  unsigned group;
+
+  unsigned perms;
+
+  long direct_blocks[N_DIRECT_BLOCKS];
+  long single_indirect_blocks;
+
+  unsigned n;
+  unsigned offset_ptr;
+};
+
+/* Inodos que inode_convert() pasa de golpe. */
+#define INODE_CONVERT_CHUNK 256
+
+/* Tabla de inodos en memoria. */
+static struct
+{
+  /* Protege el hash, la lista de libres, los contadores de referencias
+     y el estado de carga de los inodos. */
+  pthread_mutex_t lock;
+  /* Señala el final de las lecturas de inodos en curso. */
+  pthread_cond_t loaded;
+
+  inode_t *hash[ICACHE_HASH_SIZE];
+  /* Inodos sin referencias, del usado más recientemente (cabeza) al
+     candidato a expulsar (cola). */
+  inode_t *free_head, *free_tail;
+  unsigned long count;
+} icache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+
+
+/*-
+ *      Routine:       ilock
+ *
+ *      Purpose:
+ *              Bloquea un inodo en modo compartido (I_SHARED) o
+ *              exclusivo (I_EXCLUSIVE).
+ *      Conditions:
+ *              inode debe ser un inodo obtenido con iget().
+ *      Returns:
+ *              none
+ *
+ */
+void
+ilock(inode_t *inode, int mode)
+{
+  if (mode == I_EXCLUSIVE)
+    pthread_rwlock_wrlock(&inode->lock);
+  else
+    pthread_rwlock_rdlock(&inode->lock);
+}
+
+
+
+
+/*-
+ *      Routine:       iunlock
+ *
+ *      Purpose:
+ *              Libera el cerrojo de un inodo.
+ *      Conditions:
+ *              inode debe estar bloqueado por el llamante.
+ *      Returns:
+ *              none
+ *
+ */
+void
+iunlock(inode_t *inode)
+{
+  pthread_rwlock_unlock(&inode->lock);
+}
+
+
+
+
 /*-
  *      Routine:       namei
  *
  *      Purpose:
- *              Obtiene el inodo correspondiente a un path.
+ *              Obtiene el inodo correspondiente a un path. Los directorios
+ *              intermedios se bloquean en modo compartido mano sobre mano
+ *              (el hijo antes de soltar el padre), de modo que ninguna
+ *              entrada desaparezca entre que se lee y se sigue.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superbloque válido.
  *              El path debe ser válido.
+ *              mode indica cómo se bloquea el inodo devuelto (I_SHARED o
+ *              I_EXCLUSIVE).
  *      Returns:
- *              Un puntero al inodo ya bloqueado.
+ *              Un puntero al inodo ya bloqueado. Hay que soltarlo con
+ *              iunlock() e iput().
  *              NULL on error.
  *
  */
 inode_t *
-namei(int dev, superblock_t * const sb, char * path)
+namei(int dev, superblock_t * const sb, char * path, int mode)
 {
   char *p;
-  inode_t *inode;
+  inode_t *inode, *child;
   dir_entry_t *de;
 
   DEBUG_VERBOSE(">> namei(%s)", path);
@@ -67,46 +172,749 @@ namei(int dev, superblock_t * const sb, char * path)
      el inodo de / y actualizando path para que apunte al primer caracter
      de la ruta relativo a /. */
   inode = iget(dev, sb, sb->first_inode);
+  if (!inode)
+    return NULL;
 
   /* Caso especial de haber pedido el /. */
   if (strcmp(path, "/") == 0)
-    return inode;
+    {
+      ilock(inode, mode);
+      return inode;
+    }
+
+  ilock(inode, I_SHARED);
 
   path++;
-  p = strchr(path, '/');
-  while (p)
+  while (1)
     {
       /* Marcar fin de string en path. */
-      *p = 0;
+      p = strchr(path, '/');
+      if (p)
+        *p = 0;
 
       /* Sacar dirent del subdirectorio objetivo. */
       de = get_dir_entry_by_name(dev, sb, inode, path);
-      free(inode);
       if (!de || de->inode < 0)
         {
           free(de);
+          iunlock(inode);
+          iput(dev, sb, inode);
           return NULL;
         }
+
       /* Abrir inodo del subdirectorio objetivo. */
-      inode = iget(dev, sb, de->inode);
+      child = iget(dev, sb, de->inode);
       free(de);
+      if (!child)
+        {
+          iunlock(inode);
+          iput(dev, sb, inode);
+          return NULL;
+        }
+
+      /* Bloquear el hijo antes de soltar el padre. */
+      if (child != inode)
+        {
+          ilock(child, p ? I_SHARED : mode);
+          iunlock(inode);
+        }
+      iput(dev, sb, inode);
+      inode = child;
+
+      if (!p)
+        return inode;
 
       path = p+1;
-      p = strchr(path, '/');
     }
+}
+
+
+
+
+/*-
+ *      Routine:       iwrite
+ *
+ *      Purpose:
+ *              Guarda en disco (a través del diario) la parte persistente
+ *              de un inodo.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe apuntar a un inode_t válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+iwrite(int dev, const superblock_t * const sb, inode_t * inode)
+{
+  /* int i; */
 
-  /* Sacar dirent del subdirectorio objetivo. */
-  de = get_dir_entry_by_name(dev, sb, inode, path);
-  free(inode);
-  if (!de || de->inode < 0)
+  DEBUG_VERBOSE(">> iwrite(%d)\n", inode->n);
+
+  inode->modified = 0;
+  inode->times_dirty = 0;
+
+  if (journal_write(dev, inode, sizeof(struct persistent_inode),
+                    sb->inode_zone_base + (off_t) inode->n * sizeof(struct persistent_inode),
+                    inode->n)
+      < sizeof(struct persistent_inode))
     {
-      free(de);
+      inode->modified = 1;
+      return -1;
+    }
+
+  /* DEBUG_VERBOSE(">>>> n = %d", inode->n); */
+  /* DEBUG_VERBOSE(">>>> type = %x", inode->type); */
+  /* DEBUG_VERBOSE(">>>> size = %d", inode->size); */
+  /* DEBUG_VERBOSE(">>>> direct_blocks = {"); */
+  /* for (i=0; i<10; i++) */
+  /*   DEBUG_VERBOSE("\t%d", inode->direct_blocks[i]); */
+  /* DEBUG_VERBOSE("}"); */
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       ifree_list_add
+ *
+ *      Purpose:
+ *              Pone un inodo a la cabeza de la lista de inodos sin
+ *              referencias.
+ *      Conditions:
+ *              El llamante debe tener icache.lock.
+ *              inode no debe estar en la lista.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+ifree_list_add(inode_t *inode)
+{
+  inode->free_prev = NULL;
+  inode->free_next = icache.free_head;
+  if (icache.free_head)
+    icache.free_head->free_prev = inode;
+  icache.free_head = inode;
+  if (!icache.free_tail)
+    icache.free_tail = inode;
+}
+
+
+
+
+/*-
+ *      Routine:       ifree_list_remove
+ *
+ *      Purpose:
+ *              Saca un inodo de la lista de inodos sin referencias.
+ *      Conditions:
+ *              El llamante debe tener icache.lock.
+ *              inode debe estar en la lista.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+ifree_list_remove(inode_t *inode)
+{
+  if (inode->free_prev)
+    inode->free_prev->free_next = inode->free_next;
+  else
+    icache.free_head = inode->free_next;
+
+  if (inode->free_next)
+    inode->free_next->free_prev = inode->free_prev;
+  else
+    icache.free_tail = inode->free_prev;
+
+  inode->free_next = inode->free_prev = NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       ihash_remove
+ *
+ *      Purpose:
+ *              Saca un inodo de su cadena del hash.
+ *      Conditions:
+ *              El llamante debe tener icache.lock.
+ *              inode debe estar en el hash.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+ihash_remove(inode_t *inode)
+{
+  inode_t **pp;
+
+  for (pp = &icache.hash[IHASH(inode->n)]; *pp; pp = &(*pp)->hash_next)
+    if (*pp == inode)
+      {
+        *pp = inode->hash_next;
+        break;
+      }
+}
+
+
+
+
+/*-
+ *      Routine:       iget
+ *
+ *      Purpose:
+ *              Obtiene el inodo correspondiente a un número de inodo. Si
+ *              está en la tabla de inodos en memoria se comparte; si no, se
+ *              lee de disco. En ambos casos se incrementa su contador de
+ *              referencias.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              n debe ser un numero de inodo válido.
+ *      Returns:
+ *              Un puntero al inodo, sin bloquear. Hay que soltarlo con
+ *              iput() y NUNCA con free().
+ *              NULL on error.
+ *
+ */
+inode_t *
+iget(int dev, superblock_t * const sb, int n)
+{
+  inode_t *inode;
+  ssize_t res;
+
+  DEBUG_VERBOSE(">> iget(%d)", n);
+
+  if (n < 0 || n >= sb->inode_count)
+    return NULL;
+
+  pthread_mutex_lock(&icache.lock);
+
+  for (inode = icache.hash[IHASH(n)]; inode; inode = inode->hash_next)
+    if (inode->n == n)
+      break;
+
+  if (inode)
+    {
+      if (inode->refcount++ == 0)
+        ifree_list_remove(inode);
+
+      /* Si otro hilo lo está leyendo, esperar a que termine. */
+      while (!inode->valid && !inode->error)
+        pthread_cond_wait(&icache.loaded, &icache.lock);
+
+      pthread_mutex_unlock(&icache.lock);
+
+      if (inode->error)
+        {
+          iput(dev, sb, inode);
+          return NULL;
+        }
+
+      return inode;
+    }
+
+  inode = calloc(1, sizeof(struct inode));
+  if (!inode)
+    {
+      pthread_mutex_unlock(&icache.lock);
+      return NULL;
+    }
+
+  pthread_rwlock_init(&inode->lock, NULL);
+  inode->n = n;
+  inode->refcount = 1;
+  inode->hash_next = icache.hash[IHASH(n)];
+  icache.hash[IHASH(n)] = inode;
+  icache.count++;
+
+  pthread_mutex_unlock(&icache.lock);
+
+  res = journal_read(dev, inode, sizeof(struct persistent_inode),
+                     sb->inode_zone_base + (off_t) n * sizeof(struct persistent_inode));
+
+  pthread_mutex_lock(&icache.lock);
+  if (res == sizeof(struct persistent_inode))
+    {
+      inode->valid = 1;
+    }
+  else
+    {
+      /* Que los que estén esperando se enteren, y que el último en
+         soltarlo lo saque de la tabla. */
+      inode->error = 1;
+      inode->n = n;
+    }
+  pthread_cond_broadcast(&icache.loaded);
+  pthread_mutex_unlock(&icache.lock);
+
+  if (!inode->valid)
+    {
+      iput(dev, sb, inode);
       return NULL;
     }
 
-  /* Abrir inodo del subdirectorio objetivo. */
-  inode = iget(dev, sb, de->inode);
-  free(de);
+  return inode;
+}
+
+
+
+
+/*-
+ *      Routine:       ievict_flush
+ *
+ *      Purpose:
+ *              Vuelca a disco, antes de expulsarlo de la tabla, un inodo
+ *              sin más referencias que la del llamante: sus bloques con
+ *              asignación retardada y el propio inodo.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe tener una referencia del llamante.
+ *              El llamante no debe tener icache.lock.
+ *      Returns:
+ *              0 on success.
+ *              -1 si alguien lo tiene bloqueado o no se ha podido volcar.
+ *
+ */
+static int
+ievict_flush(int dev, superblock_t * const sb, inode_t *inode)
+{
+  int res = 0;
+
+  /* Sin esperar: el llamante puede tener bloqueado otro inodo. */
+  if (pthread_rwlock_trywrlock(&inode->lock) != 0)
+    return -1;
+
+  if (delalloc_pending_p(inode) && delalloc_flush(dev, sb, inode) < 0)
+    res = -1;
+  else if ((inode->modified || inode->times_dirty)
+           && iwrite(dev, sb, inode) < 0)
+    res = -1;
+
+  iunlock(inode);
+
+  if (res < 0)
+    DEBUG(">> iput >> Error al volcar el inodo %d: se queda en la tabla\n",
+          inode->n);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       iput
+ *
+ *      Purpose:
+ *              Suelta una referencia a un inodo. Cuando se suelta la última,
+ *              el inodo se queda en la tabla (si está modificado, se guarda
+ *              antes en disco) hasta que haga falta sitio. Sus bloques con
+ *              asignación retardada se quedan en memoria hasta entonces, y
+ *              si no se pueden volcar al expulsarlo, sigue en la tabla
+ *              (ver ievict_flush()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe apuntar a un inode_t obtenido con iget().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+iput(int dev, superblock_t * const sb, inode_t * inode)
+{
+  int res = 0, evicted;
+  inode_t *victim;
+
+  if (!inode)
+    return -1;
+
+  DEBUG_VERBOSE(">> iput(%d)\n", inode->n);
+
+  pthread_mutex_lock(&icache.lock);
+
+  if (--inode->refcount > 0)
+    {
+      pthread_mutex_unlock(&icache.lock);
+      return 0;
+    }
+
+  if (inode->error)
+    {
+      ihash_remove(inode);
+      icache.count--;
+      pthread_rwlock_destroy(&inode->lock);
+      free(inode);
+      pthread_mutex_unlock(&icache.lock);
+      return -1;
+    }
+
+  if (inode->modified)
+    res = iwrite(dev, sb, inode);
+
+  /* A la cabeza de la lista de inodos sin referencias. */
+  ifree_list_add(inode);
+
+  /* Expulsar los que lleven más tiempo sin usarse si sobran. Cada uno
+     se vuelca fuera de icache.lock, con una referencia para que nadie
+     más lo expulse; si alguien lo coge mientras tanto, o no se puede
+     volcar, se queda en la tabla. */
+  while (icache.count > ICACHE_SIZE && icache.free_tail)
+    {
+      victim = icache.free_tail;
+      ifree_list_remove(victim);
+      victim->refcount++;
+      pthread_mutex_unlock(&icache.lock);
+
+      evicted = ievict_flush(dev, sb, victim) == 0;
+
+      pthread_mutex_lock(&icache.lock);
+      if (evicted && victim->refcount == 1 && !victim->modified
+          && !victim->times_dirty && !delalloc_pending_p(victim))
+        {
+          bwindow_release(sb, &victim->pa);
+          ihash_remove(victim);
+          icache.count--;
+          pthread_rwlock_destroy(&victim->lock);
+          free(victim);
+          continue;
+        }
+
+      if (--victim->refcount == 0)
+        ifree_list_add(victim);
+      break;
+    }
+
+  pthread_mutex_unlock(&icache.lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       iflush
+ *
+ *      Purpose:
+ *              Guarda en disco todos los inodos modificados de la tabla,
+ *              volcando antes sus bloques con asignación retardada. Si
+ *              periodic es distinto de cero, los que sólo tienen fechas
+ *              cambiadas (con lazytime) se dejan en memoria mientras no
+ *              lleven así más de LAZYTIME_MAX_AGE segundos. Cada inodo va
+ *              en su propia operación (ver journal_begin()), para que el
+ *              diario se pueda confirmar entre uno y otro.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              El llamante no debe tener bloqueado ningún inodo.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+iflush(int dev, superblock_t * const sb, int periodic)
+{
+  unsigned i, count, max;
+  inode_t *inode, **dirty;
+  time_t since, now = time(NULL);
+  int clean, res = 0;
+
+  /* Coger una referencia a cada inodo bajo el cerrojo de la tabla, y
+     mirar fuera de él, bloqueando cada inodo, cuáles hay que escribir:
+     así no se escribe un inodo a medio modificar, y el volcado puede ir
+     a la vez que las operaciones que los modifican. */
+  pthread_mutex_lock(&icache.lock);
+  max = icache.count;
+  dirty = malloc((max ? max : 1) * sizeof(inode_t *));
+  if (!dirty)
+    {
+      pthread_mutex_unlock(&icache.lock);
+      return -1;
+    }
+  count = 0;
+  for (i=0; i < ICACHE_HASH_SIZE; i++)
+    for (inode = icache.hash[i]; inode; inode = inode->hash_next)
+      if (inode->valid && count < max)
+        {
+          if (inode->refcount++ == 0)
+            ifree_list_remove(inode);
+          dirty[count++] = inode;
+        }
+  pthread_mutex_unlock(&icache.lock);
+
+  for (i=0; i < count; i++)
+    {
+      journal_begin();
+      ilock(dirty[i], I_SHARED);
+      since = __atomic_load_n(&dirty[i]->times_dirty, __ATOMIC_RELAXED);
+      clean = !__atomic_load_n(&dirty[i]->modified, __ATOMIC_RELAXED)
+        && !delalloc_pending_p(dirty[i])
+        && (!since || (periodic && now - since < LAZYTIME_MAX_AGE));
+      iunlock(dirty[i]);
+      if (clean)
+        {
+          iput(dev, sb, dirty[i]);
+          journal_end();
+          continue;
+        }
+
+      ilock(dirty[i], I_EXCLUSIVE);
+      if (delalloc_pending_p(dirty[i])
+          && delalloc_flush(dev, sb, dirty[i]) < 0)
+        res = -1;
+      if ((dirty[i]->modified || dirty[i]->times_dirty)
+          && iwrite(dev, sb, dirty[i]) < 0)
+        res = -1;
+      iunlock(dirty[i]);
+      iput(dev, sb, dirty[i]);
+      journal_end();
+    }
+
+  free(dirty);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       inode_writeback
+ *
+ *      Purpose:
+ *              Escribe en su sitio los datos de un archivo que estén en
+ *              memoria: asigna y vuelca sus bloques retardados y escribe
+ *              sus buffers de datos sucios. No toca el inodo ni los
+ *              metadatos.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado en exclusiva por el llamante.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+inode_writeback(int dev, superblock_t * const sb, inode_t *inode)
+{
+  int res = 0;
+
+  if (delalloc_pending_p(inode) && delalloc_flush(dev, sb, inode) < 0)
+    res = -1;
+  if (bflush_inode(dev, sb, inode->n) < 0)
+    res = -1;
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       isync
+ *
+ *      Purpose:
+ *              Deja listo para confirmar en el diario todo lo de un
+ *              archivo: escribe sus datos (ver inode_writeback()) y manda
+ *              al diario el propio inodo; sus índices o extents ya están
+ *              en él desde que se escribieron (ver writemeta()). Con
+ *              datasync, un inodo al que sólo le han cambiado las fechas
+ *              no se escribe. Hay que llamar después a journal_commit()
+ *              (ver fs_fsync()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado en exclusiva por el llamante.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+isync(int dev, superblock_t * const sb, inode_t *inode, int datasync)
+{
+  int res;
+
+  res = inode_writeback(dev, sb, inode);
+  if ((inode->modified || (!datasync && inode->times_dirty))
+      && iwrite(dev, sb, inode) < 0)
+    res = -1;
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       inode_dirty_times
+ *
+ *      Purpose:
+ *              Marca que han cambiado las fechas de un inodo. Con
+ *              lazytime sólo se apunta desde cuándo: el inodo no se
+ *              guarda por esto hasta que se expulsa de la tabla, se
+ *              vuelca todo o pasan LAZYTIME_MAX_AGE segundos (ver
+ *              iflush()). Si no, se marca como modificado. Se puede
+ *              llamar teniendo el inodo bloqueado sólo en modo
+ *              compartido.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado por el llamante.
+ *      Returns:
+ *              none
+ *
+ */
+void
+inode_dirty_times(superblock_t * const sb, inode_t *inode)
+{
+  time_t zero = 0;
+
+  if (sb->lazytime)
+    __atomic_compare_exchange_n(&inode->times_dirty, &zero, time(NULL), 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n(&inode->modified, 1, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       inode_touch
+ *
+ *      Purpose:
+ *              Actualiza la fecha de último acceso de un inodo, según
+ *              sb->atime_mode: siempre, nunca, o (relatime) sólo si no es
+ *              posterior a la de modificación o a la de cambio, o si
+ *              tiene más de un día. Se puede llamar teniendo el inodo
+ *              bloqueado sólo en modo compartido: varios lectores pueden
+ *              hacerlo a la vez.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado por el llamante.
+ *      Returns:
+ *              none
+ *
+ */
+void
+inode_touch(superblock_t * const sb, inode_t *inode)
+{
+  time_t atime, now;
+
+  if (sb->atime_mode == ATIME_NOATIME)
+    return;
+
+  now = time(NULL);
+  atime = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);
+  if (sb->atime_mode == ATIME_RELATIME
+      && atime > inode->mtime && atime > inode->ctime
+      && now - atime < 24 * 60 * 60)
+    return;
+
+  if (atime == now)
+    return;
+
+  __atomic_store_n(&inode->atime, now, __ATOMIC_RELAXED);
+  inode_dirty_times(sb, inode);
+}
+
+
+
+
+/*-
+ *      Routine:       ialloc_locked
+ *
+ *      Purpose:
+ *              Asigna un nuevo inodo del mapa de inodos libres.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              El llamante debe tener sb->inode_lock.
+ *      Returns:
+ *              Un puntero al inodo.
+ *              NULL on error.
+ *
+ */
+static inode_t *
+ialloc_locked(int dev, superblock_t * const sb)
+{
+  inode_t *inode;
+  long in;
+  int i;
+
+  DEBUG_VERBOSE(">> ialloc\n");
+
+  in = ibitmap_alloc(dev, sb);
+  if (in < 0)
+    {
+      DEBUG_VERBOSE(">>>> NO QUEDAN INODOS LIBRES!\n");
+      return NULL;
+    }
+
+  inode = iget(dev, sb, in);
+
+  if (inode)
+    {
+      /* Marcar como no asignados cada uno de los elementos de la lista de bloques. */
+      for (i=0; i<10; i++)
+        inode->direct_blocks[i] = BLK_UNASSIGNED;
+      inode->single_indirect_blocks = BLK_UNASSIGNED;
+      inode->double_indirect_blocks = BLK_UNASSIGNED;
+      inode->triple_indirect_blocks = BLK_UNASSIGNED;
+
+      /* Tipo provisional, hasta que el llamante le ponga el suyo. */
+      inode->type = I_FILE;
+      inode->size = 0;
+      inode->flags = 0;
+      inode->modified = 1;
+
+      DEBUG_VERBOSE(">> ialloc >> inode = %d\n", inode->n);
+    }
+  else
+    ibitmap_free(dev, sb, in);
+
+  DEBUG_VERBOSE(">> ialloc >> sb->free_inodes = %d\n", sb->free_inodes);
+
+  return inode;
+}
+
+
+
+
+/*-
+ *      Routine:       ialloc
+ *
+ *      Purpose:
+ *              Asigna un nuevo inodo del mapa de inodos libres.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *      Returns:
+ *              Un puntero al inodo.
+ *              NULL on error.
+ *
+ */
+inode_t *
+ialloc(int dev, superblock_t * const sb)
+{
+  inode_t *inode;
+
+  pthread_mutex_lock(&sb->inode_lock);
+  inode = ialloc_locked(dev, sb);
+  pthread_mutex_unlock(&sb->inode_lock);
 
   return inode;
 }
@@ -115,210 +923,241 @@ namei(int dev, superblock_t * const sb, char * path)
 
 
 /*-
- *      Routine:       iget
+ *      Routine:       bmap_path
  *
  *      Purpose:
- *              Obtiene el inodo correspondiente a un número de inodo.
+ *              Traduce un bloque relativo al archivo en el camino que hay
+ *              que seguir por el mapa de bloques del inodo: path[0] es la
+ *              entrada del propio inodo (0..N_DIRECT_BLOCKS-1 directos,
+ *              y luego indirecto simple, doble y triple) y path[1..] las
+ *              posiciones dentro de cada bloque indirecto.
  *      Conditions:
- *              dev debe corresponder a un gnordofs válido.
- *              sb debe apuntar a un superbloque válido.
- *              n debe ser un numero de inodo válido.
+ *              path debe tener sitio para 4 entradas.
  *      Returns:
- *              Un puntero al inodo ya bloqueado.
- *              NULL on error.
+ *              La longitud del camino (1 a 4).
+ *              -1 si blk está fuera de rango.
  *
  */
-inode_t *
-iget(int dev, const superblock_t * const sb, int n)
+static int
+bmap_path(long blk, long path[4])
 {
-  /* int i; */
-  inode_t *inode;
+  const long p = N_SINGLE_INDIRECT_BLOCKS;
 
-  DEBUG_VERBOSE(">> iget(%d)", n);
+  if (blk < 0)
+    return -1;
 
-  if (n < 0 || n >= sb->inode_count)
-    return NULL;
-  
-  lseek(dev, sb->inode_zone_base + n * sizeof(struct inode), SEEK_SET);
+  if (blk < N_DIRECT_BLOCKS)
+    {
+      path[0] = blk;
+      return 1;
+    }
 
-  inode = malloc(sizeof(struct inode));
-  if (!inode)
-    return NULL;
+  blk -= N_DIRECT_BLOCKS;
+  if (blk < N_SINGLE_INDIRECT_BLOCKS)
+    {
+      path[0] = N_DIRECT_BLOCKS;
+      path[1] = blk;
+      return 2;
+    }
 
-  if (read(dev, inode, sizeof(struct inode)) < sizeof(struct inode))
+  blk -= N_SINGLE_INDIRECT_BLOCKS;
+  if (blk < N_DOUBLE_INDIRECT_BLOCKS)
     {
-      free(inode);
-      return NULL;
+      path[0] = N_DIRECT_BLOCKS + 1;
+      path[1] = blk / p;
+      path[2] = blk % p;
+      return 3;
     }
 
-  /* DEBUG_VERBOSE(">>>> n = %d", inode->n); */
-  /* DEBUG_VERBOSE(">>>> type = %x", inode->type); */
-  /* DEBUG_VERBOSE(">>>> size = %d", inode->size); */
-  /* DEBUG_VERBOSE(">>>> direct_blocks = {"); */
-  /* for (i=0; i<10; i++) */
-  /*   DEBUG_VERBOSE("\t%d", inode->direct_blocks[i]); */
-  /* DEBUG_VERBOSE("}\n"); */
+  blk -= N_DOUBLE_INDIRECT_BLOCKS;
+  if (blk < N_TRIPLE_INDIRECT_BLOCKS)
+    {
+      path[0] = N_DIRECT_BLOCKS + 2;
+      path[1] = blk / (p * p);
+      path[2] = (blk / p) % p;
+      path[3] = blk % p;
+      return 4;
+    }
 
-  return inode;
+  return -1;
 }
 
 
 
 
 /*-
- *      Routine:       iput
+ *      Routine:       bmap_slot
+ *
+ *      Purpose:
+ *              Devuelve la entrada i-ésima del mapa de bloques del inodo,
+ *              según la numeración de bmap_path().
+ *      Conditions:
+ *              inode debe apuntar a un inodo sin I_EXTENTS.
+ *              0 <= i < N_DIRECT_BLOCKS + 3.
+ *      Returns:
+ *              Un puntero a la entrada.
+ *
+ */
+static long *
+bmap_slot(inode_t *inode, long i)
+{
+  if (i < N_DIRECT_BLOCKS)
+    return &inode->direct_blocks[i];
+  if (i == N_DIRECT_BLOCKS)
+    return &inode->single_indirect_blocks;
+  if (i == N_DIRECT_BLOCKS + 1)
+    return &inode->double_indirect_blocks;
+  return &inode->triple_indirect_blocks;
+}
+
+
+
+
+/*-
+ *      Routine:       bmap_new_indirect
  *
  *      Purpose:
- *              Guarda en disco un inodo.
+ *              Reserva un bloque indirecto con todas sus entradas a
+ *              BLK_UNASSIGNED.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superbloque válido.
- *              inode debe apuntar a un inode_t válido.
  *      Returns:
- *              0 on success.
- *              -1 on error.
+ *              El número de bloque absoluto.
+ *              -1 on error
  *
  */
-int
-iput(int dev, const superblock_t * const sb, inode_t * inode)
+static long
+bmap_new_indirect(int dev, superblock_t * const sb)
 {
-  /* int i; */
+  block_t buff;
+  long iblk, *entry;
+  int i;
 
-  if (!inode)
+  iblk = allocblk(dev, sb);
+  if (iblk < 0)
     return -1;
 
-  DEBUG_VERBOSE(">> iput()\n");
-  
-  lseek(dev, sb->inode_zone_base + inode->n * sizeof(struct inode), SEEK_SET);
-
-  if (write(dev, inode, sizeof(struct inode)) < sizeof(struct inode))
-    return -1;
+  entry = (long *) buff.data;
+  for (i=0; i<N_SINGLE_INDIRECT_BLOCKS; i++)
+    entry[i] = BLK_UNASSIGNED;
 
-  /* DEBUG_VERBOSE(">>>> n = %d", inode->n); */
-  /* DEBUG_VERBOSE(">>>> type = %x", inode->type); */
-  /* DEBUG_VERBOSE(">>>> size = %d", inode->size); */
-  /* DEBUG_VERBOSE(">>>> direct_blocks = {"); */
-  /* for (i=0; i<10; i++) */
-  /*   DEBUG_VERBOSE("\t%d", inode->direct_blocks[i]); */
-  /* DEBUG_VERBOSE("}"); */
+  if (writemeta(dev, sb, iblk, &buff, B_NO_OWNER) < 0)
+    {
+      freeblk(dev, sb, iblk);
+      return -1;
+    }
 
-  return 0;
+  return iblk;
 }
 
 
 
 
 /*-
- *      Routine:       ialloc
+ *      Routine:       bmap_truncate_indirect
  *
  *      Purpose:
- *              Asigna un nuevo inodo de la lista de inodos libres.
+ *              Libera, del subárbol que cuelga de *slot (un indirecto de
+ *              nivel level, o un bloque de datos si level es 0), los
+ *              bloques de datos a partir del from-ésimo. Si no queda
+ *              ninguno (from == 0), libera también el propio indirecto
+ *              y deja *slot a BLK_UNASSIGNED. owner es el inodo del
+ *              archivo.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superbloque válido.
  *      Returns:
- *              Un puntero al inodo ya bloqueado.
- *              NULL on error.
+ *              -1 on error.
  *
  */
-inode_t *
-ialloc(int dev, superblock_t * const sb)
+static int
+bmap_truncate_indirect(int dev, superblock_t * const sb, unsigned owner,
+                       long *slot, int level, long from)
 {
-  inode_t *inode;
-  unsigned long in, i, j, *aux_list;
-
-  DEBUG_VERBOSE(">> ialloc\n");
+  block_t *block;
+  long span, i, *entry;
+  int l, res = 0;
 
-  if (!sb->free_inodes)
-    {
-      DEBUG_VERBOSE(">>>> NO QUEDAN INODOS LIBRES!\n");
-      return NULL;
-    }
+  if (unassigned_p(*slot))
+    return 0;
 
-  /* Si la lista está vacía, recorrer la zona de inodos en busca de inodos libres. */
-  if (sb->free_inode_index == 0)
+  if (level > 0)
     {
-      DEBUG_VERBOSE(">> ialloc >> Lista de inodos libres vacía. Rellenando...\n");
+      /* Bloques de datos que cubre cada entrada de este indirecto. */
+      for (span=1, l=1; l<level; l++)
+        span *= N_SINGLE_INDIRECT_BLOCKS;
 
-      aux_list = malloc(FREE_INODE_LIST_SIZE * sizeof(unsigned long));
+      block = getblk(dev, sb, *slot);
+      if (!block)
+        return -1;
 
-      in = sb->free_inode_list[0];
-      /* Comienza por el último que se asignó, que probablemente haya más después de él. */
-      for (j = 0, i = in;
-           j < FREE_INODE_LIST_SIZE && i < sb->inode_count;
-           i++)
+      entry = (long *) block->data;
+      for (i = from / span; i < N_SINGLE_INDIRECT_BLOCKS; i++)
         {
-          inode = iget(dev, sb, i);
-          if (!inode)
-            {
-              DEBUG_VERBOSE(">> ialloc >> ERROR al rellenar la lista de inodos libres!\n");
-              return NULL;
-            }
-          
-          if (inode->type == I_FREE)
-            {
-              aux_list[j++] = i;
-            }
-
-          free(inode);
+          if (bmap_truncate_indirect(dev, sb, owner, &entry[i], level-1,
+                                     i == from / span ? from % span : 0) < 0)
+            res = -1;
         }
 
-      /* Si no se llenó con los que había del final, recorrer la lista hasta el último
-         que se asignó. */
-      for (i=0;
-           j < FREE_INODE_LIST_SIZE && i < in;
-           i++)
-        {
-          inode = iget(dev, sb, i);
-          if (!inode)
-            {
-              DEBUG_VERBOSE(">> ialloc >> ERROR al rellenar la lista de inodos libres!\n");
-              return NULL;
-            }
-          
-          if (inode->type = I_FREE)
-            {
-              aux_list[j++] = i;
-            }
+      if (from > 0)
+        writemeta(dev, sb, *slot, block, owner);
+      brelse(block);
+    }
 
-          free(inode);
-        }
+  if (from == 0)
+    {
+      if (freeblk(dev, sb, *slot) < 0)
+        return -1;
+      *slot = BLK_UNASSIGNED;
+    }
 
-      /* Sería un detalle que free_inode_index indicase cuántos inodos hay anotados en
-         la dichosa lista. (¡¬¬) */
-      sb->free_inode_index = j;
-      /* Anotar en el superblock la lista en orden inverso. */
-      for (i=0, j--; i <= j; i++)
-        sb->free_inode_list[j-i] = aux_list[i];
+  return res;
+}
 
-      free(aux_list);
 
-      DEBUG_VERBOSE(">> ialloc >> Lista de inodos libres con %d nuevas entradas...\n",
-            sb->free_inode_index);
-    }
 
-  /* Obtener primer inodo libre de la lista de idem. */
-  sb->free_inode_index--;
-  in = sb->free_inode_list[sb->free_inode_index];
 
-  inode = iget(dev, sb, in);
+/*-
+ *      Routine:       bmap_truncate
+ *
+ *      Purpose:
+ *              Libera los bloques de un inodo sin I_EXTENTS a partir del
+ *              bloque relativo blk, junto con los indirectos que se
+ *              queden vacíos.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe apuntar a un inodo sin I_EXTENTS.
+ *              blk debe ser no negativo.
+ *      Returns:
+ *              -1 on error.
+ *
+ */
+static int
+bmap_truncate(int dev, superblock_t * const sb, inode_t *inode, long blk)
+{
+  long base = 0, span = 1;
+  int i, res = 0;
 
-  if (inode)
+  inode->modified = 1;
+
+  for (i=0; i < N_DIRECT_BLOCKS + 3; i++)
     {
-      /* Decrementar contador de inodos libres. */
-      sb->free_inodes--;
+      /* La entrada i cubre span bloques a partir de base. */
+      if (i >= N_DIRECT_BLOCKS)
+        span *= N_SINGLE_INDIRECT_BLOCKS;
 
-      /* Marcar como no asignados cada uno de los elementos de la lista de bloques. */
-      for (i=0; i<10; i++)
-        inode->direct_blocks[i] = BLK_UNASSIGNED;
-      inode->single_indirect_blocks = BLK_UNASSIGNED;
-    }
+      if (blk < base + span
+          && bmap_truncate_indirect(dev, sb, inode->n, bmap_slot(inode, i),
+                                    i < N_DIRECT_BLOCKS ? 0 : i - N_DIRECT_BLOCKS + 1,
+                                    blk > base ? blk - base : 0) < 0)
+        res = -1;
 
-  DEBUG_VERBOSE(">> ialloc >> inode = %d\n", inode->n);
-  DEBUG_VERBOSE(">> ialloc >> sb->free_inode_index = %d\n", sb->free_inode_index);
-  DEBUG_VERBOSE(">> ialloc >> sb->free_inodes = %d\n", sb->free_inodes);
+      base += span;
+    }
 
-  return inode;
+  return res;
 }
 
 
@@ -328,9 +1167,9 @@ ialloc(int dev, superblock_t * const sb)
  *      Routine:       ifree
  *
  *      Purpose:
- *              Libera un inodo y lo añade a la lista de inodos libres.
+ *              Libera un inodo y lo marca como libre en el mapa de inodos.
  *              Si este inodo referencia a algún bloque de datos, también
- *              lo libera y lo añade a su lista correspondiente
+ *              lo libera.
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superbloque válido.
@@ -342,55 +1181,34 @@ ialloc(int dev, superblock_t * const sb)
 int
 ifree(int dev, superblock_t * const sb, inode_t *inode)
 {
-  int i, block;
+  int res;
 
   DEBUG_VERBOSE(">> ifree(inode->n = %d)\n", inode->n);
 
-  for (i=0; i < N_DIRECT_BLOCKS; i++)
-    {
-      block = inode_getblk(dev, sb, inode, i);
-      if (!unassigned_p(block))
-        freeblk(dev, sb, block);
-    }
-  if (!unassigned_p(inode->single_indirect_blocks))
+  bwindow_release(sb, &inode->pa);
+  if (inode->flags & I_EXTENTS)
     {
-        for (i=N_DIRECT_BLOCKS;
-             i < N_DIRECT_BLOCKS+N_SINGLE_INDIRECT_BLOCKS;
-             i++)
-          {
-            block = inode_getblk(dev, sb, inode, i);
-            if (!unassigned_p(block))
-              freeblk(dev, sb, block);
-          }
-        freeblk(dev, sb, inode->single_indirect_blocks);
+      delalloc_truncate(sb, inode, 0);
+      extent_truncate(dev, sb, inode, 0);
     }
+  else
+    bmap_truncate(dev, sb, inode, 0);
 
-  if (sb->free_inode_index == FREE_INODE_LIST_SIZE)
-    {
-      DEBUG_VERBOSE(">> ialloc >> Lista de inodos libres llena...");
+  pthread_mutex_lock(&sb->inode_lock);
 
-      /* Si la lista está vacía y el nuevo inodo libre es anterior al
-         primero de esta lista, insertarlo (reemplazando) en dicha posición. */
-      if (sb->free_inode_list[0] > inode->n)
-        {
-          DEBUG_VERBOSE(" reemplazando primera entrada.");
-          sb->free_inode_list[0] = inode->n;
-        }
-    }
-  else
-    {
-      /* Si no, añadirlo a ella e incrementar el índice. */
-      sb->free_inode_list[sb->free_inode_index] = inode->n;
-      sb->free_inode_index++;
-    }
+  /* Que nadie herede las entradas de la caché de nombres de este
+     directorio si se reutiliza su número de inodo. */
+  if (inode->type == I_DIR)
+    dcache_purge(inode->n);
 
   inode->type = I_FREE;
-  iput(dev, sb, inode);
+  inode->modified = 1;
 
-  /* Incrementar contador de inodos libres. */
-  sb->free_inodes++;
+  res = ibitmap_free(dev, sb, inode->n);
 
-  return 0;
+  pthread_mutex_unlock(&sb->inode_lock);
+
+  return res;
 }
 
 
@@ -412,32 +1230,62 @@ ifree(int dev, superblock_t * const sb, inode_t *inode)
  */
 long
 inode_getblk(int dev, superblock_t * const sb, inode_t *inode, long blk)
+{
+  return inode_bmap(dev, sb, inode, blk, NULL);
+}
+
+
+
+
+/*-
+ *      Routine:       inode_bmap
+ *
+ *      Purpose:
+ *              Devuelve el número de bloque absoluto a partir de
+ *              un número de bloque relativo a un archivo, y cuántos
+ *              bloques del archivo a partir de él están seguidos en disco
+ *              (o cuánto mide el hueco, si no está asignado).
+ *      Conditions:
+ *              inode debe apuntar a un inodo válido.
+ *              blk debe ser un valor no negativo y dentro del rango permitido.
+ *              count puede ser NULL.
+ *      Returns:
+ *              El número de bloque absoluto.
+ *              -1 on error
+ *
+ */
+long
+inode_bmap(int dev, superblock_t * const sb, inode_t *inode, long blk, long *count)
 {
   block_t *block;
-  long ablk=-1;
+  long ablk, path[4];
+  int i, depth;
 
-  /* DEBUG_VERBOSE(">> inode_getblk(blk = %d)\n", blk); */
+  /* DEBUG_VERBOSE(">> inode_bmap(blk = %d)\n", blk); */
 
-  if (blk < 0 || blk >= BLOCKS_PER_INODE)
-    return -1;
+  if (inode->flags & I_EXTENTS)
+    return extent_bmap(dev, sb, inode, blk, count);
 
-  if (blk < N_DIRECT_BLOCKS)
-    return inode->direct_blocks[blk];
+  /* Con el mapeo de bloques de toda la vida, de uno en uno. */
+  if (count)
+    *count = 1;
 
-  blk -= N_DIRECT_BLOCKS;
-  if (blk < N_SINGLE_INDIRECT_BLOCKS)
-    {
-      if (unassigned_p(inode->single_indirect_blocks))
-        return BLK_UNASSIGNED;
+  depth = bmap_path(blk, path);
+  if (depth < 0)
+    return -1;
 
-      /* Leer bloque indirecto y sacar de él el bloque absoluto. */
-      block = getblk(dev, sb, inode->single_indirect_blocks);
-      if (block < 0)
+  /* Bajar por los indirectos, que se quedan en la caché de bloques para
+     las siguientes búsquedas por la misma zona del archivo. */
+  ablk = *bmap_slot(inode, path[0]);
+  for (i=1; i<depth && !unassigned_p(ablk); i++)
+    {
+      block = getblk(dev, sb, ablk);
+      if (!block)
         return -1;
 
-      ablk = *(long *) &block->data[blk*sizeof(long)];
+      ablk = ((long *) block->data)[path[i]];
 
-      free(block);
+      brelse(block);
     }
 
   return ablk;
@@ -450,74 +1298,89 @@ inode_getblk(int dev, superblock_t * const sb, inode_t *inode, long blk)
  *      Routine:       inode_allocblk
  *
  *      Purpose:
- *              Reserva un bloque de datos para el inodo dado.
+ *              Reserva bloques de datos para el inodo dado a partir de su
+ *              bloque blk, a ser posible justo detrás del que tiene en
+ *              disco el bloque anterior. Con extents se reservan hasta
+ *              *count bloques seguidos; con el mapa de bloques, uno.
+ *              reserved dice si el llamante los tiene apartados con
+ *              breserve() (ver balloc_win()).
  *      Conditions:
  *              dev debe corresponder a un gnordofs válido.
  *              sb debe apuntar a un superbloque válido.
  *              inode debe apuntar a un inodo válido.
  *              blk debe ser un valor no negativo y dentro del rango permitido.
+ *              Ninguno de los bloques de blk a blk+*count-1 debe estar
+ *              mapeado.
+ *              count puede ser NULL (un bloque).
  *      Returns:
- *              El número de bloque absoluto.
+ *              El número de bloque absoluto del primero, y en *count
+ *              cuántos se han reservado.
  *              -1 on error
  *
  */
 long
 inode_allocblk(int dev, superblock_t * const sb,
-               inode_t * inode, long blk)
+               inode_t * inode, long blk, long *count, int reserved)
 {
-  int i;
   block_t *block;
-  long ablk, iblk;
+  long ablk, iblk, cur, goal, path[4], *slot;
+  int i, depth;
 
-  if (blk < 0 | blk >= BLOCKS_PER_INODE)
-    return -1;
-
-  ablk = allocblk(dev, sb);
+  if (inode->flags & I_EXTENTS)
+    return extent_allocblk(dev, sb, inode, blk, count, reserved);
 
-  if (blk < N_DIRECT_BLOCKS)
-    inode->direct_blocks[blk] = ablk;
+  depth = bmap_path(blk, path);
+  if (depth < 0)
+    return -1;
 
-  blk -= N_DIRECT_BLOCKS;
-  if (blk < N_SINGLE_INDIRECT_BLOCKS)
+  goal = blk > 0 ? inode_getblk(dev, sb, inode, blk-1) : -1;
+  ablk = balloc_win(dev, sb, inode->type == I_FILE ? &inode->pa : NULL,
+                    goal >= 0 ? goal + 1 : BALLOC_NO_GOAL, NULL, reserved);
+  if (ablk < 0)
+    return -1;
+  if (count)
+    *count = 1;
+
+  /* Asignar los indirectos que falten por el camino. Los que se
+     reserven aquí se quedan aunque falle algo más adelante: no
+     estorban, y se liberan al truncar. */
+  slot = bmap_slot(inode, path[0]);
+  block = NULL;
+  for (i=1; i<depth; i++)
     {
-      /* Asignar bloque indirecto si no lo está. */
-      iblk = inode->single_indirect_blocks;
+      iblk = *slot;
       if (unassigned_p(iblk))
         {
-          iblk = allocblk(dev, sb);
-          if (iblk < 0)
-            {
-              freeblk(dev, sb, ablk);
-              return -1;
-            }
-
-          /* Marcar todas las entradas del indirecto como BLK_UNASSIGNED. */
-          block = getblk(dev, sb, iblk);
-          if (block < 0)
+          iblk = bmap_new_indirect(dev, sb);
+          if (iblk >= 0)
             {
-              freeblk(dev, sb, ablk);
-              freeblk(dev, sb, iblk);
-              return -1;
+              *slot = iblk;
+              if (block)
+                writemeta(dev, sb, cur, block, inode->n);
             }
-          for (i=0; i<N_SINGLE_INDIRECT_BLOCKS; i++)
-            *(long *) &(block->data[i*sizeof(long)]) = BLK_UNASSIGNED;
-          /* ¡Y salvar el maldito iblk! (¡¬¬)*/
-          writeblk(dev, sb, iblk, block);
-
-          inode->single_indirect_blocks = iblk;
+        }
+      if (block)
+        brelse(block);
+      block = iblk < 0 ? NULL : getblk(dev, sb, iblk);
+      if (!block)
+        {
+          freeblk(dev, sb, ablk);
+          inode->modified = 1;
+          return -1;
         }
 
-      /* Leer bloque indirecto. */
-      block = getblk(dev, sb, iblk);
-      if (block < 0)
-        return -1;
-
-      /* Escribir nueva referencia en el bloque indirecto. */
-      *(long *) &(block->data[blk*sizeof(long)]) = ablk;
-      writeblk(dev, sb, iblk, block);
+      cur = iblk;
+      slot = &((long *) block->data)[path[i]];
+    }
 
-      free(block);
+  /* Escribir nueva referencia en el inodo o en el último indirecto. */
+  *slot = ablk;
+  if (block)
+    {
+      writemeta(dev, sb, cur, block, inode->n);
+      brelse(block);
     }
+  inode->modified = 1;
 
   return ablk;
 }
@@ -540,43 +1403,52 @@ inode_allocblk(int dev, superblock_t * const sb,
 int
 inode_freeblk(int dev, superblock_t * const sb, inode_t * inode, long blk)
 {
-  long iblk;
-  block_t *block;
+  block_t *block = NULL;
+  long iblk, path[4], *slot;
+  int i, depth;
 
   /* DEBUG_VERBOSE(">> inode_getblk(blk = %d)\n", blk); */
 
-  if (blk < 0 || blk >= BLOCKS_PER_INODE)
+  depth = bmap_path(blk, path);
+  if (depth < 0)
     return -1;
 
-  if (blk < N_DIRECT_BLOCKS)
+  slot = bmap_slot(inode, path[0]);
+  if (depth == 1)
     {
-      if (unassigned_p(inode->direct_blocks[blk]))
+      if (unassigned_p(*slot))
         return -1;
 
-      inode->direct_blocks[blk] = BLK_UNASSIGNED;
+      *slot = BLK_UNASSIGNED;
+      inode->modified = 1;
       return 0;
     }
 
-  blk -= N_DIRECT_BLOCKS;
-  if (blk < N_SINGLE_INDIRECT_BLOCKS)
+  /* Bajar hasta el último indirecto. */
+  iblk = *slot;
+  for (i=1; i<depth; i++)
     {
-      iblk = inode->single_indirect_blocks;
       if (unassigned_p(iblk))
         return -1;
 
-      /* Leer bloque indirecto. */
       block = getblk(dev, sb, iblk);
-      if (block < 0)
+      if (!block)
         return -1;
 
-      /* Escribir nueva referencia en el bloque indirecto. */
-      *(long *) &block->data[blk*sizeof(long)] = BLK_UNASSIGNED;
-      writeblk(dev, sb, iblk, block);
+      slot = &((long *) block->data)[path[i]];
+      if (i == depth - 1)
+        break;
 
-      free(block);
+      iblk = *slot;
+      brelse(block);
     }
 
-  return -1;
+  /* Escribir nueva referencia en el bloque indirecto. */
+  *slot = BLK_UNASSIGNED;
+  writemeta(dev, sb, iblk, block, inode->n);
+  brelse(block);
+
+  return 0;
 }
 
 
@@ -597,10 +1469,11 @@ inode_freeblk(int dev, superblock_t * const sb, inode_t * inode, long blk)
  *
  */
 int
-inode_truncate(int dev, superblock_t * const sb, inode_t *inode, int size)
+inode_truncate(int dev, superblock_t * const sb, inode_t *inode, off_t size)
 {
-  int blk, last_blk;
-  int absolute_blk;
+  block_t *block;
+  long blk, ablk;
+  int res;
 
   if (size < 0)
     return -1;
@@ -615,27 +1488,33 @@ inode_truncate(int dev, superblock_t * const sb, inode_t *inode, int size)
     }
 
   /* Para truncar de toda la vida, hay que liberar los bloques que quedan fuera
-     tras meter las tijeras. */
+     tras meter las tijeras: a partir del primero que ya no tiene nada del
+     archivo. */
+  blk = (size + sizeof(struct block) - 1) / sizeof(struct block);
 
-  /* Calcular último bloque interno que hay que liberar. */
-  last_blk = (inode->size-1) / sizeof(struct block);
-  /* Calcular primer bloque interno que hay que liberar. */
-  blk = size  ?  (size-1)/sizeof(struct block)  :  0;
-  while (blk <= last_blk)
+  bwindow_release(sb, &inode->pa);
+  if (inode->flags & I_EXTENTS)
     {
-      absolute_blk = inode_getblk(dev, sb, inode, blk);
-      if (absolute_blk == -1)
-        return -1;
+      delalloc_truncate(sb, inode, size);
+      res = extent_truncate(dev, sb, inode, blk);
+    }
+  else
+    res = bmap_truncate(dev, sb, inode, blk);
+  if (res < 0)
+    return -1;
 
-      if (!unassigned_p(absolute_blk))
+  /* Lo que queda del bloque cortado tras size tiene que leerse como ceros
+     si luego se vuelve a alargar el archivo. */
+  if (size % sizeof(struct block))
+    {
+      ablk = inode_getblk(dev, sb, inode, size / sizeof(struct block));
+      if (ablk >= 0 && (block = getblk(dev, sb, ablk)))
         {
-          if (freeblk(dev, sb, absolute_blk) < 0)
-            return -1;
-
-          inode_freeblk(dev, sb, inode, blk);
+          memset(&block->data[size % sizeof(struct block)], 0,
+                 sizeof(struct block) - size % sizeof(struct block));
+          writeblk(dev, sb, ablk, block, inode->n);
+          brelse(block);
         }
-
-      blk++;
     }
 
   inode->size = size;
@@ -663,19 +1542,167 @@ inode_list_init(int fd, const superblock_t * const sb)
 {
   int i;
   unsigned long last_inode;
-  inode_t idummy;
-  
-  lseek(fd, sb->inode_zone_base, SEEK_SET);
+  off_t offset;
+  struct persistent_inode idummy;
   
-  memset(&idummy, 0, sizeof(struct inode));
+  memset(&idummy, 0, sizeof(struct persistent_inode));
 
+  offset = sb->inode_zone_base;
   last_inode = sb->inode_count;
   for (i=0; i < last_inode; i++)
     {
-      if (write(fd, &idummy, sizeof(struct inode)) < sizeof(struct inode))
+      if (pwrite(fd, &idummy, sizeof(struct persistent_inode), offset)
+          < sizeof(struct persistent_inode))
         return -1;
       idummy.n++;
+      offset += sizeof(struct persistent_inode);
     }
 
   return 0;
 }
+
+
+
+
+/*-
+ *      Routine:       inode_convert
+ *
+ *      Purpose:
+ *              Pasa los inodos de un sistema de archivos de la revisión 0
+ *              al formato actual, y sus directorios a registros de
+ *              longitud variable (ver dir_convert()). Los inodos nuevos
+ *              no caben donde estaban los viejos, así que la tabla se
+ *              lleva a bloques seguidos de la zona de bloques; la zona de
+ *              inodos vieja se queda sin usar. Todo se escribe en bloques
+ *              que estaban libres, y el superbloque no cambia hasta
+ *              ibitmap_load(): si se cae a medias, el sistema sigue siendo
+ *              de la revisión 0. En las demás revisiones no hace nada.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa de bloques
+ *              cargado (ver balloc_load()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+inode_convert(int dev, superblock_t * const sb)
+{
+  struct inode_v0 *old;
+  struct persistent_inode *new;
+  unsigned long n, i, count, blocks, ndirs = 0;
+  unsigned *dirs;
+  long base, got;
+  off_t zone;
+  ssize_t size;
+  inode_t *inode;
+  int j, res = 0;
+
+  if (sb->magic2 != MAGIC_NUMBER)
+    return 0;
+
+  DEBUG(">> inode_convert >> Pasando los inodos de la revisión 0 al formato actual\n");
+
+  blocks = (sb->inode_count * sizeof(struct persistent_inode)
+            + sizeof(struct block) - 1) / sizeof(struct block);
+  got = blocks;
+  base = balloc(dev, sb, BALLOC_NO_GOAL, &got);
+  if (base < 0)
+    return -1;
+  if (got < blocks)
+    {
+      DEBUG(">> inode_convert >> Error: no hay sitio seguido para la tabla de inodos\n");
+      bfree(dev, sb, base, got);
+      return -1;
+    }
+  zone = sb->block_zone_base + (off_t) base * sizeof(struct block);
+
+  old = malloc(INODE_CONVERT_CHUNK * sizeof(struct inode_v0));
+  new = malloc(INODE_CONVERT_CHUNK * sizeof(struct persistent_inode));
+  dirs = malloc(sb->inode_count * sizeof(unsigned));
+  if (!old || !new || !dirs)
+    {
+      free(old);
+      free(new);
+      free(dirs);
+      return -1;
+    }
+
+  for (n = 0; n < sb->inode_count; n += count)
+    {
+      count = sb->inode_count - n;
+      if (count > INODE_CONVERT_CHUNK)
+        count = INODE_CONVERT_CHUNK;
+
+      size = count * sizeof(struct inode_v0);
+      if (pread(dev, old, size,
+                sb->inode_zone_base + (off_t) n * sizeof(struct inode_v0)) < size)
+        {
+          DEBUG(">> inode_convert >> Error al leer los inodos desde el %lu\n", n);
+          res = -1;
+          break;
+        }
+
+      memset(new, 0, count * sizeof(struct persistent_inode));
+      for (i = 0; i < count; i++)
+        {
+          new[i].type = old[i].type;
+          new[i].size = old[i].size;
+          new[i].link_counter = old[i].link_counter;
+          new[i].atime = old[i].atime;
+          new[i].ctime = old[i].ctime;
+          new[i].mtime = old[i].mtime;
+          new[i].owner = old[i].owner;
+          new[i].group = old[i].group;
+          new[i].perms = old[i].perms;
+          new[i].flags = 0;
+          for (j=0; j < N_DIRECT_BLOCKS; j++)
+            new[i].direct_blocks[j] = old[i].direct_blocks[j];
+          new[i].single_indirect_blocks = old[i].single_indirect_blocks;
+          new[i].double_indirect_blocks = BLK_UNASSIGNED;
+          new[i].triple_indirect_blocks = BLK_UNASSIGNED;
+          new[i].n = n + i;
+
+          if (old[i].type == I_DIR)
+            dirs[ndirs++] = n + i;
+        }
+
+      size = count * sizeof(struct persistent_inode);
+      if (pwrite(dev, new, size,
+                 zone + (off_t) n * sizeof(struct persistent_inode)) < size)
+        {
+          DEBUG(">> inode_convert >> Error al escribir los inodos desde el %lu\n", n);
+          res = -1;
+          break;
+        }
+    }
+
+  free(old);
+  free(new);
+
+  /* En memoria ya se usa la tabla nueva; en disco, cuando se escriba el
+     superbloque. */
+  if (res == 0)
+    sb->inode_zone_base = zone;
+
+  for (i = 0; res == 0 && i < ndirs; i++)
+    {
+      inode = iget(dev, sb, dirs[i]);
+      if (!inode)
+        res = -1;
+      else
+        {
+          if (dir_convert(dev, sb, inode) < 0 || iwrite(dev, sb, inode) < 0)
+            {
+              DEBUG(">> inode_convert >> Error al convertir el directorio %u\n", dirs[i]);
+              res = -1;
+            }
+          iput(dev, sb, inode);
+        }
+    }
+
+  free(dirs);
+
+  return res;
+}
@@ -0,0 +1,1339 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-22 20:13:52 holzplatten"
+ *
+ *       File:         journal.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Sep 22 10:47:18 2013
+ *
+ *       Diario de metadatos, con confirmación en grupo.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <balloc.h>
+#include <block.h>
+#include <journal.h>
+#include <misc.h>
+#include <superblock.h>
+#include <uring.h>
+#include <writeback.h>
+
+
+#define JHASH(offset) ((unsigned long long) (offset) % JOURNAL_HASH_SIZE)
+
+#define TAGS_PER_BLOCK (sizeof(struct block) / sizeof(struct journal_tag))
+
+/* Una escritura pendiente de llegar a su sitio, y el inodo del archivo
+   cuyos bloques señala (B_NO_OWNER si no es de ninguno). */
+struct jrec {
+  off_t offset;
+  unsigned len;
+  int owner;
+  unsigned char *data;
+
+  struct jrec *hash_next;
+  struct jrec *next, *prev;
+};
+
+/* Bloques liberados en una transacción (ver journal_free()). */
+struct jfree {
+  long n;
+  long count;
+  struct jfree *next;
+};
+
+/* Conjunto de escrituras de una transacción, en el orden en que llegaron,
+   y bloques que libera. */
+struct jtrans {
+  struct jrec *hash[JOURNAL_HASH_SIZE];
+  struct jrec *head, *tail;
+  unsigned long count;
+  unsigned long bytes;
+  struct jfree *frees;
+};
+
+static struct {
+  /* Protege running, committing y los registros de ambas. */
+  pthread_mutex_t lock;
+  /* Sólo una confirmación a la vez. */
+  pthread_mutex_t commit_lock;
+  /* Las lecturas lo tienen en modo compartido mientras leen de disco y
+     superponen lo pendiente, para que no se suelte una transacción entre
+     medias. */
+  pthread_rwlock_t cp_lock;
+  /* Protege handles y barrier, y señala cuándo cambian. */
+  pthread_mutex_t handle_lock;
+  pthread_cond_t handle_cond;
+  /* Operaciones en curso (ver journal_begin()). Mientras barrier está
+     puesto, una confirmación espera a que acaben las que hay y no se
+     deja empezar ninguna más. */
+  unsigned long handles;
+  int barrier;
+
+  int active;
+  /* Falló una confirmación: ya no se escribe nada más (ver
+     journal_abort()). */
+  int aborted;
+  /* running ha pasado de la mitad del diario: se confirma en cuanto
+     acabe la operación (ver jfull()). */
+  int full;
+  int dev;
+  superblock_t *sb;
+  unsigned long long sequence;
+
+  struct jtrans trans[2];
+  struct jtrans *running, *committing;
+  /* Donde se monta cada transacción: journal_blocks - 1 bloques. Lo
+     protege commit_lock. */
+  unsigned char *buf;
+} journal = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .commit_lock = PTHREAD_MUTEX_INITIALIZER,
+  .cp_lock = PTHREAD_RWLOCK_INITIALIZER,
+  .handle_lock = PTHREAD_MUTEX_INITIALIZER,
+  .handle_cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Operaciones anidadas del hilo (ver journal_begin()). */
+static __thread unsigned jdepth;
+
+static int jcommit(int full);
+
+
+
+
+/*-
+ *      Routine:       jofs
+ *
+ *      Purpose:
+ *              Calcula la posición en el dispositivo del bloque i del
+ *              diario.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque con diario.
+ *      Returns:
+ *              El desplazamiento en bytes.
+ *
+ */
+static off_t
+jofs(const superblock_t * const sb, unsigned long i)
+{
+  return sb->block_zone_base
+    + (off_t) (sb->journal_base + i) * sizeof(struct block);
+}
+
+
+
+
+/*-
+ *      Routine:       jchecksum
+ *
+ *      Purpose:
+ *              Calcula la suma de comprobación (FNV-1a) de las etiquetas y
+ *              los datos de una transacción.
+ *      Conditions:
+ *              data debe apuntar a len bytes.
+ *      Returns:
+ *              La suma.
+ *
+ */
+static unsigned
+jchecksum(const unsigned char *data, size_t len)
+{
+  unsigned h = 2166136261u;
+  size_t i;
+
+  for (i=0; i < len; i++)
+    {
+      h ^= data[i];
+      h *= 16777619u;
+    }
+
+  return h;
+}
+
+
+
+
+/*-
+ *      Routine:       jblocks
+ *
+ *      Purpose:
+ *              Calcula cuántos bloques del diario ocupa una transacción
+ *              con ntags etiquetas y bytes bytes de datos, cabecera
+ *              incluida.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              El número de bloques.
+ *
+ */
+static unsigned long
+jblocks(unsigned long ntags, unsigned long bytes)
+{
+  return 1 + (ntags + TAGS_PER_BLOCK - 1) / TAGS_PER_BLOCK
+    + (bytes + sizeof(struct block) - 1) / sizeof(struct block);
+}
+
+
+
+
+/*-
+ *      Routine:       jfull
+ *
+ *      Purpose:
+ *              Dice si la transacción en curso ya ocupa más de la mitad
+ *              del diario: hay que confirmarla antes de que una operación
+ *              la llene del todo (ver jfits()).
+ *      Conditions:
+ *              El llamante debe tener journal.lock y el diario debe estar
+ *              en marcha.
+ *      Returns:
+ *              Distinto de cero si hay que confirmarla.
+ *
+ */
+static int
+jfull(void)
+{
+  return 2 * jblocks(journal.running->count, journal.running->bytes)
+    > journal.sb->journal_blocks - 1;
+}
+
+
+
+
+/*-
+ *      Routine:       jfind
+ *
+ *      Purpose:
+ *              Busca en una transacción la escritura pendiente en offset.
+ *      Conditions:
+ *              El llamante debe tener journal.lock.
+ *      Returns:
+ *              Un puntero al registro.
+ *              NULL si no hay ninguno.
+ *
+ */
+static struct jrec *
+jfind(struct jtrans *t, off_t offset)
+{
+  struct jrec *r;
+
+  for (r = t->hash[JHASH(offset)]; r; r = r->hash_next)
+    if (r->offset == offset)
+      return r;
+
+  return NULL;
+}
+
+
+
+
+/*-
+ *      Routine:       jfits
+ *
+ *      Purpose:
+ *              Dice si a la transacción en curso le cabe todavía una
+ *              escritura de len bytes en offset sin dejar de caber, entera,
+ *              en una sola confirmación.
+ *      Conditions:
+ *              El llamante debe tener journal.lock y el diario debe estar
+ *              en marcha.
+ *      Returns:
+ *              Distinto de cero si cabe.
+ *
+ */
+static int
+jfits(off_t offset, unsigned len)
+{
+  struct jtrans *t = journal.running;
+  struct jrec *r;
+
+  r = jfind(t, offset);
+  if (r)
+    return jblocks(t->count, t->bytes - r->len + len)
+      <= journal.sb->journal_blocks - 1;
+
+  return jblocks(t->count + 1, t->bytes + len)
+    <= journal.sb->journal_blocks - 1;
+}
+
+
+
+
+/*-
+ *      Routine:       jtrans_free
+ *
+ *      Purpose:
+ *              Suelta todos los registros de una transacción y la deja
+ *              vacía.
+ *      Conditions:
+ *              El llamante debe tener journal.lock, o ser el único que
+ *              conoce la transacción.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+jtrans_free(struct jtrans *t)
+{
+  struct jrec *r, *next;
+  struct jfree *f, *fnext;
+
+  for (r = t->head; r; r = next)
+    {
+      next = r->next;
+      free(r->data);
+      free(r);
+    }
+  for (f = t->frees; f; f = fnext)
+    {
+      fnext = f->next;
+      free(f);
+    }
+
+  memset(t, 0, sizeof(struct jtrans));
+}
+
+
+
+
+/*-
+ *      Routine:       jtrans_remove
+ *
+ *      Purpose:
+ *              Quita de una transacción la escritura pendiente en offset,
+ *              si la hay.
+ *      Conditions:
+ *              El llamante debe tener journal.lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+jtrans_remove(struct jtrans *t, off_t offset)
+{
+  struct jrec **p, *r;
+
+  for (p = &t->hash[JHASH(offset)]; *p; p = &(*p)->hash_next)
+    if ((*p)->offset == offset)
+      break;
+  r = *p;
+  if (!r)
+    return;
+  *p = r->hash_next;
+
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    t->head = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  else
+    t->tail = r->prev;
+
+  t->count--;
+  t->bytes -= r->len;
+  free(r->data);
+  free(r);
+}
+
+
+
+
+/*-
+ *      Routine:       jtrans_add
+ *
+ *      Purpose:
+ *              Anota en una transacción una escritura de len bytes en
+ *              offset, de owner. Si ya había una en el mismo sitio, se
+ *              sustituye.
+ *      Conditions:
+ *              El llamante debe tener journal.lock.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+jtrans_add(struct jtrans *t, off_t offset, const void *data, unsigned len,
+           int owner)
+{
+  struct jrec *r;
+
+  r = jfind(t, offset);
+  if (r && r->len != len)
+    {
+      jtrans_remove(t, offset);
+      r = NULL;
+    }
+
+  if (!r)
+    {
+      r = calloc(1, sizeof(struct jrec));
+      if (!r)
+        return -1;
+      r->data = malloc(len);
+      if (!r->data)
+        {
+          free(r);
+          return -1;
+        }
+      r->offset = offset;
+      r->len = len;
+
+      r->hash_next = t->hash[JHASH(offset)];
+      t->hash[JHASH(offset)] = r;
+      r->prev = t->tail;
+      if (t->tail)
+        t->tail->next = r;
+      else
+        t->head = r;
+      t->tail = r;
+      t->count++;
+      t->bytes += len;
+    }
+
+  memcpy(r->data, data, len);
+  r->owner = owner;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_create
+ *
+ *      Purpose:
+ *              Busca sitio seguido para el diario en la zona de bloques y
+ *              lo deja vacío.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con el mapa de bloques
+ *              cargado.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+journal_create(int dev, superblock_t * const sb)
+{
+  struct journal_super *js;
+  block_t *zeros;
+  long base, count, blocks;
+  int res;
+
+  blocks = JOURNAL_DEFAULT_BLOCKS;
+  if (blocks > sb->block_count / 8)
+    blocks = sb->block_count / 8;
+  if (blocks < JOURNAL_MIN_BLOCKS)
+    {
+      DEBUG(">> journal_create >> Error: no hay sitio para el diario\n");
+      return -1;
+    }
+
+  count = blocks;
+  base = balloc(dev, sb, BALLOC_NO_GOAL, &count);
+  if (base < 0)
+    return -1;
+  if (count < blocks)
+    {
+      DEBUG(">> journal_create >> Error: no hay sitio seguido para el diario\n");
+      bfree(dev, sb, base, count);
+      return -1;
+    }
+
+  zeros = calloc(blocks, sizeof(struct block));
+  if (!zeros)
+    {
+      bfree(dev, sb, base, count);
+      return -1;
+    }
+  js = (struct journal_super *) zeros[0].data;
+  js->magic = JOURNAL_MAGIC;
+  js->sequence = 0;
+
+  res = writeblks(dev, sb, base, blocks, zeros);
+  free(zeros);
+  if (res < 0)
+    return -1;
+
+  sb->journal_base = base;
+  sb->journal_blocks = blocks;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_init
+ *
+ *      Purpose:
+ *              Crea el diario de un sistema de archivos nuevo. El diario
+ *              no se usa hasta que se monte (ver journal_start()).
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs recién creado.
+ *              sb debe apuntar al superbloque devuelto por
+ *              superblock_init(), después de balloc_init().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+journal_init(int dev, superblock_t * const sb)
+{
+  return journal_create(dev, sb);
+}
+
+
+
+
+/*-
+ *      Routine:       journal_replay
+ *
+ *      Purpose:
+ *              Si en el diario hay una transacción confirmada que no llegó
+ *              a escribirse en su sitio, la escribe, y vuelve a leer el
+ *              superbloque por si venía en ella.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar al superbloque devuelto por
+ *              superblock_read(), antes de cargar los mapas de bits.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+journal_replay(int dev, superblock_t * const sb)
+{
+  struct journal_super js;
+  struct journal_header jh;
+  struct journal_tag *tags;
+  unsigned char *buf, *data;
+  unsigned long i, size;
+
+  if (sb->magic2 != GNORDOFS_REVISION)
+    return 0;
+
+  if (pread(dev, &js, sizeof(js), jofs(sb, 0)) < sizeof(js)
+      || pread(dev, &jh, sizeof(jh), jofs(sb, 1)) < sizeof(jh)
+      || js.magic != JOURNAL_MAGIC)
+    {
+      DEBUG(">> journal_replay >> Error: el diario no es válido\n");
+      return -1;
+    }
+  journal.sequence = js.sequence;
+
+  if (jh.magic != JOURNAL_MAGIC || jh.sequence != js.sequence + 1)
+    return 0;
+
+  if (2 + jh.tag_blocks + jh.payload_blocks > sb->journal_blocks
+      || jh.ntags > jh.tag_blocks * TAGS_PER_BLOCK)
+    {
+      DEBUG(">> journal_replay >> Transacción %llu rota: se ignora\n", jh.sequence);
+      return 0;
+    }
+
+  size = (jh.tag_blocks + jh.payload_blocks) * sizeof(struct block);
+  buf = malloc(size ? size : 1);
+  if (!buf)
+    return -1;
+  if (pread(dev, buf, size, jofs(sb, 2)) < size)
+    {
+      free(buf);
+      return -1;
+    }
+
+  /* Si no se llegó a escribir entera, la cabecera no puede estar; pero
+     por si acaso. */
+  if (jchecksum(buf, size) != jh.checksum)
+    {
+      DEBUG(">> journal_replay >> Transacción %llu incompleta: se ignora\n", jh.sequence);
+      free(buf);
+      return 0;
+    }
+
+  DEBUG(">> journal_replay >> Repitiendo la transacción %llu (%lu escrituras)\n",
+        jh.sequence, jh.ntags);
+
+  tags = (struct journal_tag *) buf;
+  data = buf + jh.tag_blocks * sizeof(struct block);
+  for (i=0; i < jh.ntags; i++)
+    {
+      if (data + tags[i].len > buf + size
+          || pwrite(dev, data, tags[i].len, tags[i].offset) < tags[i].len)
+        {
+          free(buf);
+          return -1;
+        }
+      data += tags[i].len;
+    }
+  free(buf);
+
+  js.sequence = jh.sequence;
+  if (fdatasync(dev) < 0
+      || pwrite(dev, &js, sizeof(js), jofs(sb, 0)) < sizeof(js)
+      || fdatasync(dev) < 0)
+    return -1;
+  journal.sequence = js.sequence;
+
+  /* El superbloque pudo cambiar con la transacción. */
+  if (pread(dev, sb, sizeof(struct persistent_superblock), 0)
+      < sizeof(struct persistent_superblock))
+    return -1;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_start
+ *
+ *      Purpose:
+ *              Empieza a usar el diario: desde aquí, journal_write() ya no
+ *              escribe directamente en su sitio. Si el sistema de
+ *              archivos es de la revisión 0xCA04, antes le crea el diario.
+ *              También reserva el sitio donde se montan las transacciones
+ *              al confirmarlas.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque con los mapas de bits
+ *              cargados.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+journal_start(int dev, superblock_t * const sb)
+{
+  if (sb->magic2 == GNORDOFS_REVISION_NO_JOURNAL)
+    {
+      DEBUG(">> journal_start >> Creando el diario\n");
+
+      /* El diario y el mapa que lo marca como ocupado, en disco antes que
+         el superbloque que lo señala. */
+      if (journal_create(dev, sb) < 0
+          || bflush(dev, sb) < 0
+          || fdatasync(dev) < 0)
+        return -1;
+
+      sb->magic2 = GNORDOFS_REVISION;
+      if (superblock_write(dev, sb) < 0 || fdatasync(dev) < 0)
+        return -1;
+    }
+
+  journal.buf = malloc((sb->journal_blocks - 1) * sizeof(struct block));
+  if (!journal.buf)
+    return -1;
+
+  pthread_mutex_lock(&journal.lock);
+  journal.dev = dev;
+  journal.sb = sb;
+  journal.running = &journal.trans[0];
+  journal.committing = NULL;
+  journal.active = 1;
+  pthread_mutex_unlock(&journal.lock);
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_begin
+ *
+ *      Purpose:
+ *              Empieza una operación que puede modificar metadatos: hasta
+ *              el journal_end() que le corresponde, journal_commit() no
+ *              cambia de transacción, así que todo lo que escriba se
+ *              confirma junto. Se pueden anidar; sólo cuenta la de fuera.
+ *              Si hay una confirmación esperando, espera a que cambie de
+ *              transacción, y si la transacción en curso ya pasa de la
+ *              mitad del diario, la confirma antes.
+ *      Conditions:
+ *              La de fuera se debe llamar sin tener bloqueado ningún
+ *              inodo ni ningún otro cerrojo: si no, una operación en curso
+ *              que lo esté esperando no acabaría nunca.
+ *      Returns:
+ *              none
+ *
+ */
+void
+journal_begin(void)
+{
+  if (jdepth > 0)
+    {
+      jdepth++;
+      return;
+    }
+
+  /* Que empiece con sitio en la transacción (ver jfits()). */
+  if (__atomic_load_n(&journal.full, __ATOMIC_RELAXED))
+    jcommit(1);
+  jdepth = 1;
+
+  pthread_mutex_lock(&journal.handle_lock);
+  while (journal.barrier)
+    pthread_cond_wait(&journal.handle_cond, &journal.handle_lock);
+  journal.handles++;
+  pthread_mutex_unlock(&journal.handle_lock);
+}
+
+
+
+
+/*-
+ *      Routine:       journal_end
+ *
+ *      Purpose:
+ *              Termina una operación empezada con journal_begin(). Al
+ *              terminar la de fuera, si la transacción en curso se ha
+ *              hecho demasiado grande, se confirma.
+ *      Conditions:
+ *              Las de journal_begin().
+ *      Returns:
+ *              none
+ *
+ */
+void
+journal_end(void)
+{
+  if (--jdepth > 0)
+    return;
+
+  pthread_mutex_lock(&journal.handle_lock);
+  if (--journal.handles == 0 && journal.barrier)
+    pthread_cond_broadcast(&journal.handle_cond);
+  pthread_mutex_unlock(&journal.handle_lock);
+
+  if (__atomic_load_n(&journal.full, __ATOMIC_RELAXED))
+    jcommit(1);
+}
+
+
+
+
+/*-
+ *      Routine:       journal_overlay
+ *
+ *      Purpose:
+ *              Copia sobre lo leído de disco en offset las escrituras
+ *              pendientes que le correspondan.
+ *      Conditions:
+ *              El llamante debe tener journal.lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+journal_overlay(unsigned char *buf, size_t len, off_t offset)
+{
+  struct jrec *r;
+  off_t o, end = offset + len;
+  size_t step;
+
+  /* En la zona de bloques, bloque a bloque; inodos y superbloque se leen
+     siempre con el mismo tamaño con el que se escriben (los inodos
+     pueden estar también en la zona de bloques, ver inode_convert()). */
+  step = (offset >= journal.sb->block_zone_base
+          && len % sizeof(struct block) == 0) ? sizeof(struct block) : len;
+
+  for (o = offset; o + step <= end; o += step)
+    {
+      r = jfind(journal.running, o);
+      if (!r && journal.committing)
+        r = jfind(journal.committing, o);
+      if (r && r->len == step)
+        memcpy(buf + (o - offset), r->data, step);
+    }
+}
+
+
+
+
+/*-
+ *      Routine:       journal_readops
+ *
+ *      Purpose:
+ *              Como uring_readv(), pero viendo las escrituras de
+ *              metadatos que todavía están sólo en el diario.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              v debe apuntar a n operaciones que no se solapen.
+ *      Returns:
+ *              Lo mismo que uring_readv().
+ *
+ */
+int
+journal_readops(int dev, struct uring_op *v, unsigned long n)
+{
+  unsigned long i;
+  off_t offset;
+  ssize_t len;
+  int res, k;
+
+  if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+    return uring_readv(dev, v, n);
+
+  pthread_rwlock_rdlock(&journal.cp_lock);
+  res = uring_readv(dev, v, n);
+  pthread_mutex_lock(&journal.lock);
+  for (i=0; i<n; i++)
+    {
+      for (len=0, k=0; k<v[i].iovcnt; k++)
+        len += v[i].iov[k].iov_len;
+      if (v[i].res != len)
+        continue;
+
+      offset = v[i].offset;
+      for (k=0; k<v[i].iovcnt; k++)
+        {
+          journal_overlay(v[i].iov[k].iov_base, v[i].iov[k].iov_len, offset);
+          offset += v[i].iov[k].iov_len;
+        }
+    }
+  pthread_mutex_unlock(&journal.lock);
+  pthread_rwlock_unlock(&journal.cp_lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_read
+ *
+ *      Purpose:
+ *              Como pread(), pero viendo las escrituras de metadatos que
+ *              todavía están sólo en el diario.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *      Returns:
+ *              Lo mismo que pread().
+ *
+ */
+ssize_t
+journal_read(int dev, void *buf, size_t len, off_t offset)
+{
+  struct iovec iov = { buf, len };
+  struct uring_op op = { &iov, 1, offset, 0 };
+
+  journal_readops(dev, &op, 1);
+
+  return op.res;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_readv
+ *
+ *      Purpose:
+ *              Como preadv(), pero viendo las escrituras de metadatos que
+ *              todavía están sólo en el diario.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *      Returns:
+ *              Lo mismo que preadv().
+ *
+ */
+ssize_t
+journal_readv(int dev, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  struct uring_op op = { iov, iovcnt, offset, 0 };
+
+  journal_readops(dev, &op, 1);
+
+  return op.res;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_write
+ *
+ *      Purpose:
+ *              Como pwrite(), para metadatos: la escritura se anota en la
+ *              transacción en curso y llega a su sitio después de
+ *              confirmarla. owner es el inodo del archivo cuyos bloques
+ *              señala, o B_NO_OWNER: sus datos se escriben antes de
+ *              confirmarla (ver journal_order()). Si la transacción pasa de la mitad del
+ *              diario, se confirma al acabar la operación (ver
+ *              journal_end()); y si ya no cabría entera en él, o si se ha
+ *              dejado el diario por un fallo, la escritura falla.
+ *              Sin diario (en mkfs, o antes de journal_start()), escribe
+ *              directamente.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *      Returns:
+ *              Lo mismo que pwrite().
+ *
+ */
+ssize_t
+journal_write(int dev, const void *buf, size_t len, off_t offset,
+              int owner)
+{
+  int res;
+
+  if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+    return pwrite(dev, buf, len, offset);
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.aborted)
+    res = -1;
+  else if (!jfits(offset, len))
+    {
+      DEBUG(">> journal_write >> Error: la operación no cabe en el diario\n");
+      res = -1;
+    }
+  else
+    {
+      res = jtrans_add(journal.running, offset, buf, len, owner);
+      if (res == 0 && jfull())
+        __atomic_store_n(&journal.full, 1, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock(&journal.lock);
+
+  return res < 0 ? -1 : len;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_pending
+ *
+ *      Purpose:
+ *              Dice cuántos bytes hay anotados en la transacción en curso,
+ *              pendientes de confirmar.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              El número de bytes (0 sin diario).
+ *
+ */
+unsigned long
+journal_pending(void)
+{
+  unsigned long bytes = 0;
+
+  if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+    return 0;
+
+  pthread_mutex_lock(&journal.lock);
+  bytes = journal.running->bytes;
+  pthread_mutex_unlock(&journal.lock);
+
+  return bytes;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_free
+ *
+ *      Purpose:
+ *              Anota que count bloques a partir de n se liberan con la
+ *              transacción en curso, y olvida las escrituras que tuviera
+ *              pendientes en ellos. Hasta que no se confirme, no se pueden
+ *              volver a usar: si se escribieran datos en ellos y se
+ *              perdiera la transacción, el dueño de antes los vería
+ *              (ver bfree_commit()). Las de la transacción que se está
+ *              confirmando no molestan: acaba antes que la que está en curso.
+ *      Conditions:
+ *              sb debe apuntar a un superbloque válido.
+ *              Se debe llamar dentro de la misma operación que escribe el
+ *              mapa de bits con esos bloques libres.
+ *      Returns:
+ *              0 si se liberarán al confirmar.
+ *              1 si no hay diario: se pueden usar ya.
+ *              -1 on error (no se pueden volver a usar hasta que se
+ *              vuelva a montar).
+ *
+ */
+int
+journal_free(superblock_t * const sb, long n, long count)
+{
+  struct jfree *f;
+  long i;
+
+  if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+    return 1;
+
+  f = malloc(sizeof(struct jfree));
+
+  pthread_mutex_lock(&journal.lock);
+  for (i=0; i < count; i++)
+    jtrans_remove(journal.running,
+                  sb->block_zone_base + (off_t) (n + i) * sizeof(struct block));
+  if (f)
+    {
+      f->n = n;
+      f->count = count;
+      f->next = journal.running->frees;
+      journal.running->frees = f;
+    }
+  pthread_mutex_unlock(&journal.lock);
+
+  return f ? 0 : -1;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_abort
+ *
+ *      Purpose:
+ *              Deja de usar el diario tras un fallo al confirmar:
+ *              committing se queda en memoria, para que las lecturas lo
+ *              sigan viendo, pero no se escribe en su sitio ni se
+ *              confirma nada más. Si la transacción llegó a confirmarse en
+ *              el diario, se repetirá al montar (ver journal_replay()).
+ *      Conditions:
+ *              El llamante debe tener journal.commit_lock.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+journal_abort(const char *what)
+{
+  DEBUG(">> journal_commit >> Error al escribir %s de la transacción %llu: se deja el diario\n",
+        what, journal.sequence + 1);
+
+  pthread_mutex_lock(&journal.lock);
+  journal.aborted = 1;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+
+
+
+/*-
+ *      Routine:       journal_order
+ *
+ *      Purpose:
+ *              Escribe en su sitio los datos sucios de los archivos cuyos
+ *              metadatos van en committing, para que al confirmarla no
+ *              quede ninguno señalando bloques sin escribir (que tendrían
+ *              lo que dejó su dueño anterior). Los de los demás archivos
+ *              se quedan en la caché. Si no hay memoria para la lista,
+ *              los escribe todos.
+ *      Conditions:
+ *              El llamante debe tener journal.commit_lock.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+journal_order(void)
+{
+  struct jrec *r;
+  int *owners;
+  unsigned long n = 0;
+  int res = 0;
+
+  owners = malloc(journal.committing->count * sizeof(int));
+  if (!owners)
+    return bflush(journal.dev, journal.sb);
+
+  pthread_mutex_lock(&journal.lock);
+  for (r = journal.committing->head; r; r = r->next)
+    if (r->owner != B_NO_OWNER)
+      owners[n++] = r->owner;
+  pthread_mutex_unlock(&journal.lock);
+
+  if (n > 0)
+    res = bflush_owners(journal.dev, journal.sb, owners, n);
+
+  free(owners);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_commit_trans
+ *
+ *      Purpose:
+ *              Escribe committing en el diario como una sola transacción,
+ *              después de los datos a los que apunta (ver journal_order()),
+ *              y, una vez confirmada, la escribe en su sitio. Si falla
+ *              algo, se deja el diario (ver journal_abort()): lo que no
+ *              esté confirmado no llega nunca a su sitio.
+ *      Conditions:
+ *              El llamante debe tener journal.commit_lock.
+ *              committing debe caber en el diario (ver jfits()).
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+journal_commit_trans(void)
+{
+  superblock_t *sb = journal.sb;
+  int dev = journal.dev;
+  unsigned char *buf = journal.buf;
+  struct journal_header *jh;
+  struct journal_super js;
+  struct journal_tag *tags;
+  struct jrec *r;
+  struct wb_extent *v;
+  unsigned char *data;
+  unsigned long ntags = 0, bytes = 0, tag_blocks, size, n;
+  int res = 0;
+
+  if (journal_order() < 0)
+    {
+      journal_abort("los datos");
+      return -1;
+    }
+
+  pthread_mutex_lock(&journal.lock);
+  for (r = journal.committing->head; r; r = r->next)
+    {
+      ntags++;
+      bytes += r->len;
+    }
+
+  tag_blocks = (ntags + TAGS_PER_BLOCK - 1) / TAGS_PER_BLOCK;
+  size = (tag_blocks + (bytes + sizeof(struct block) - 1) / sizeof(struct block))
+    * sizeof(struct block);
+  memset(buf, 0, sizeof(struct block) + size);
+
+  jh = (struct journal_header *) buf;
+  tags = (struct journal_tag *) (buf + sizeof(struct block));
+  data = buf + sizeof(struct block) + tag_blocks * sizeof(struct block);
+  ntags = 0;
+  for (r = journal.committing->head; r; r = r->next)
+    {
+      tags[ntags].offset = r->offset;
+      tags[ntags].len = r->len;
+      memcpy(data, r->data, r->len);
+      data += r->len;
+      ntags++;
+    }
+  pthread_mutex_unlock(&journal.lock);
+
+  jh->magic = JOURNAL_MAGIC;
+  jh->sequence = journal.sequence + 1;
+  jh->ntags = ntags;
+  jh->tag_blocks = tag_blocks;
+  jh->payload_blocks = size / sizeof(struct block) - tag_blocks;
+  jh->checksum = jchecksum(buf + sizeof(struct block), size);
+
+  /* Primero el cuerpo y después la cabecera, que es la que confirma. */
+  if (pwrite(dev, buf + sizeof(struct block), size, jofs(sb, 2)) < size
+      || fdatasync(dev) < 0
+      || pwrite(dev, buf, sizeof(struct block), jofs(sb, 1)) < sizeof(struct block)
+      || fdatasync(dev) < 0)
+    {
+      journal_abort("el diario");
+      return -1;
+    }
+
+  /* Ahora, cada cosa a su sitio, de una pasada y juntando lo que vaya
+     seguido. Los registros de committing no cambian hasta que se
+     suelta, así que no hace falta el cerrojo mientras se escriben. */
+  v = malloc((ntags ? ntags : 1) * sizeof(struct wb_extent));
+  pthread_mutex_lock(&journal.lock);
+  for (n = 0, r = journal.committing->head; r; r = r->next)
+    {
+      if (v)
+        {
+          v[n].offset = r->offset;
+          v[n].data = r->data;
+          v[n].len = r->len;
+          n++;
+        }
+      else if (pwrite(dev, r->data, r->len, r->offset) < r->len)
+        res = -1;
+    }
+  pthread_mutex_unlock(&journal.lock);
+
+  if (v && writeback(dev, v, n) < 0)
+    res = -1;
+  free(v);
+
+  js.magic = JOURNAL_MAGIC;
+  js.sequence = jh->sequence;
+  if (res < 0
+      || fdatasync(dev) < 0
+      || pwrite(dev, &js, sizeof(js), jofs(sb, 0)) < sizeof(js)
+      || fdatasync(dev) < 0)
+    {
+      journal_abort("en su sitio");
+      return -1;
+    }
+  journal.sequence = js.sequence;
+
+  return 0;
+}
+
+
+
+
+/*-
+ *      Routine:       jcommit
+ *
+ *      Purpose:
+ *              Hace el trabajo de journal_commit(). Con full distinto de
+ *              cero, sólo si la transacción en curso ha pasado de la mitad
+ *              del diario (ver jfull()): así, de las operaciones que se la
+ *              encuentran llena a la vez, sólo la confirma la primera.
+ *      Conditions:
+ *              Las de journal_commit().
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+static int
+jcommit(int full)
+{
+  struct jfree *frees, *f;
+  int swapped = 0, res;
+
+  if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+    return 0;
+
+  if (jdepth > 0)
+    {
+      DEBUG(">> journal_commit >> Error: llamado dentro de una operación\n");
+      return -1;
+    }
+
+  pthread_mutex_lock(&journal.commit_lock);
+
+  if (journal.aborted
+      || (full && !__atomic_load_n(&journal.full, __ATOMIC_RELAXED)))
+    {
+      res = journal.aborted ? -1 : 0;
+      pthread_mutex_unlock(&journal.commit_lock);
+      return res;
+    }
+
+  /* Que no quede ninguna operación a medias en la transacción. */
+  pthread_mutex_lock(&journal.handle_lock);
+  journal.barrier = 1;
+  while (journal.handles > 0)
+    pthread_cond_wait(&journal.handle_cond, &journal.handle_lock);
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.running->head)
+    {
+      journal.committing = journal.running;
+      journal.running = journal.committing == &journal.trans[0]
+        ? &journal.trans[1] : &journal.trans[0];
+      __atomic_store_n(&journal.full, 0, __ATOMIC_RELAXED);
+      swapped = 1;
+    }
+  pthread_mutex_unlock(&journal.lock);
+
+  journal.barrier = 0;
+  pthread_cond_broadcast(&journal.handle_cond);
+  pthread_mutex_unlock(&journal.handle_lock);
+
+  if (!swapped)
+    {
+      pthread_mutex_unlock(&journal.commit_lock);
+      return 0;
+    }
+
+  res = journal_commit_trans();
+
+  if (res == 0)
+    {
+      pthread_rwlock_wrlock(&journal.cp_lock);
+      pthread_mutex_lock(&journal.lock);
+      frees = journal.committing->frees;
+      journal.committing->frees = NULL;
+      jtrans_free(journal.committing);
+      journal.committing = NULL;
+      pthread_mutex_unlock(&journal.lock);
+      pthread_rwlock_unlock(&journal.cp_lock);
+
+      /* Ya se pueden volver a usar los bloques que liberó. */
+      for (; frees; frees = f)
+        {
+          f = frees->next;
+          bfree_commit(journal.sb, frees->n, frees->count);
+          free(frees);
+        }
+    }
+
+  pthread_mutex_unlock(&journal.commit_lock);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       journal_commit
+ *
+ *      Purpose:
+ *              Confirma de una vez todas las escrituras de metadatos
+ *              acumuladas desde la última confirmación y las escribe en su
+ *              sitio. Siempre caben en el diario como una sola transacción
+ *              (ver journal_write()). Antes de cambiar de transacción
+ *              espera a que acaben las operaciones en curso (ver
+ *              journal_begin()); después, las nuevas escrituras van a la
+ *              otra. Si falla la escritura, no se confirma nada más (ver
+ *              journal_abort()).
+ *      Conditions:
+ *              No se puede llamar dentro de una operación.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+journal_commit(void)
+{
+  return jcommit(0);
+}
@@ -34,9 +34,13 @@
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 
+#include <balloc.h>
 #include <dir.h>
+#include <ibitmap.h>
 #include <inode.h>
+#include <journal.h>
 #include <superblock.h>
 
 int main(int argc, char **argv)
@@ -65,24 +69,37 @@ int main(int argc, char **argv)
   //superblock_print_dump(sb);
 
   /* Poner cero toda la zona de bloques, por si acaso. */
-  if (lseek(dev, sb->block_zone_base, SEEK_SET) < 0)
-    {
-      printf("Dude, WTF???\n");
-      exit(1);
-    }
   zeros = malloc(BLOCK_SIZE);
   memset(zeros, 0, BLOCK_SIZE);
   for (i=sb->block_zone_base;
        i < size - BLOCK_SIZE;
        i += BLOCK_SIZE)
     {
-      write(dev, zeros, BLOCK_SIZE);
+      if (pwrite(dev, zeros, BLOCK_SIZE, i) < BLOCK_SIZE)
+        {
+          printf("Dude, WTF???\n");
+          exit(1);
+        }
     }
   if (size > i)
-    write(dev, zeros, size - i);
+    pwrite(dev, zeros, size - i, i);
 
-  /* Inicializar lista de bloques libres. */
-  free_block_list_init(dev, sb);
+  /* Inicializar mapa de bits de bloques libres. */
+  if (balloc_init(dev, sb) < 0)
+    {
+      printf("No se pudo crear el mapa de bits\n");
+      exit(1);
+    }
+  if (ibitmap_init(dev, sb) < 0)
+    {
+      printf("No se pudo crear el mapa de inodos\n");
+      exit(1);
+    }
+  if (journal_init(dev, sb) < 0)
+    {
+      printf("No se pudo crear el diario\n");
+      exit(1);
+    }
 
   /* ¡Que no se me olvide salvar el maldito superbloque! */
   superblock_write(dev, sb);
@@ -100,19 +117,25 @@ int main(int argc, char **argv)
   add_dir_entry(dev, sb, rootdir, rootdir, ".");
   add_dir_entry(dev, sb, rootdir, rootdir, "..");
   rootdir->atime = rootdir->ctime = rootdir->mtime = time(NULL);
-  iput(dev, sb, rootdir);
+  rootdir->modified = 1;
 
   sb->first_inode = rootdir->n;
-  superblock_write(dev, sb);
 
   printf("rootdir->type = %d\n", rootdir->type);
-  printf("rootdir->size = %d\n", rootdir->size);
+  printf("rootdir->size = %llu\n", rootdir->size);
   printf("rootdir->link_counter = %d\n", rootdir->link_counter);
   printf("rootdir->owner = %d\n", rootdir->owner);
   printf("rootdir->group = %d\n", rootdir->group);
   printf("rootdir->perms = %o\n", rootdir->perms);
   printf("rootdir->n = %d\n", rootdir->n);
-  printf("rootdir->offset_ptr = %d\n", rootdir->offset_ptr);
+
+  /* Al soltar la última referencia se guarda en disco. */
+  iput(dev, sb, rootdir);
+
+  /* Vaciar la caché de bloques antes de tocar el disco por debajo. */
+  bflush(dev, sb);
+
+  superblock_write(dev, sb);
 
   /* Comprobar que se puede leer el superbloque. */
   sb_dup = superblock_read(dev);
@@ -123,8 +146,11 @@ int main(int argc, char **argv)
       exit(1);
     }
   superblock_print_dump(sb_dup);
-  print_free_block_list(dev, sb);
 
+  free(sb->bitmap);
+  free(sb->prealloc);
+  free(sb->freeing);
+  free(sb->ibitmap);
   free(sb);
   free(sb_dup);
 
@@ -0,0 +1,172 @@
+/* -*- mode: C -*- Time-stamp: "2013-09-29 19:02:26 holzplatten"
+ *
+ *       File:         readahead.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Sep 29 16:35:41 2013
+ *
+ *       Lectura anticipada de los archivos que se leen seguidos.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <pthread.h>
+#include <syslog.h>
+
+#include <block.h>
+#include <inode.h>
+#include <misc.h>
+#include <readahead.h>
+#include <superblock.h>
+
+
+
+
+/*-
+ *      Routine:       readahead_init
+ *
+ *      Purpose:
+ *              Prepara el estado de lectura anticipada de un archivo que
+ *              se acaba de abrir. Leer desde el principio cuenta como
+ *              lectura seguida.
+ *      Conditions:
+ *              ra debe apuntar a una struct readahead.
+ *      Returns:
+ *              none
+ *
+ */
+void
+readahead_init(struct readahead *ra)
+{
+  pthread_mutex_init(&ra->lock, NULL);
+  ra->next = 0;
+  ra->size = 0;
+  ra->end = 0;
+  ra->mark = 0;
+}
+
+
+
+
+/*-
+ *      Routine:       readahead_destroy
+ *
+ *      Purpose:
+ *              Libera el estado de lectura anticipada de un archivo.
+ *      Conditions:
+ *              ra debe haberse inicializado con readahead_init().
+ *      Returns:
+ *              none
+ *
+ */
+void
+readahead_destroy(struct readahead *ra)
+{
+  pthread_mutex_destroy(&ra->lock);
+}
+
+
+
+
+/*-
+ *      Routine:       readahead
+ *
+ *      Purpose:
+ *              Anota una lectura de size bytes a partir de offset y, si
+ *              toca, pide a la caché la siguiente ventana de bloques del
+ *              archivo. Los bloques se traducen con inode_bmap(), y cada
+ *              tramo seguido en disco se pide de una vez; los huecos y
+ *              los bloques con asignación retardada se saltan.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              sb debe apuntar a un superbloque válido.
+ *              inode debe estar bloqueado por el llamante (basta en modo
+ *              compartido).
+ *              ra debe haberse inicializado con readahead_init().
+ *      Returns:
+ *              none
+ *
+ */
+void
+readahead(int dev, superblock_t * const sb, inode_t *inode,
+          struct readahead *ra, off_t offset, size_t size)
+{
+  long last, eof, start = 0, count = 0, window, blk, run, absolute_blk;
+
+  if (size == 0)
+    return;
+
+  last = (offset + size + sizeof(struct block) - 1) / sizeof(struct block);
+  eof = (inode->size + sizeof(struct block) - 1) / sizeof(struct block);
+
+  pthread_mutex_lock(&ra->lock);
+
+  if (offset == ra->next)
+    {
+      if (ra->size == 0)
+        ra->size = RA_MIN_BLOCKS;
+
+      if (last > ra->mark)
+        {
+          start = ra->end > last ? ra->end : last;
+          count = ra->size;
+          if (start + count > eof)
+            count = eof - start;
+
+          ra->end = start + (count > 0 ? count : 0);
+          ra->mark = start;
+          if (ra->size < RA_MAX_BLOCKS)
+            ra->size *= 2;
+        }
+    }
+  else
+    {
+      /* A saltos: lo pedido por delante ya no sirve. */
+      ra->size /= 2;
+      if (ra->size < RA_MIN_BLOCKS)
+        ra->size = 0;
+      ra->end = ra->mark = last;
+    }
+
+  ra->next = offset + size;
+  window = ra->size;
+
+  pthread_mutex_unlock(&ra->lock);
+
+  if (count > 0)
+    DEBUG_VERBOSE(">> readahead(%d) >> %ld bloques desde %ld (ventana %ld)\n",
+                  inode->n, count, start, window);
+
+  for (blk = start; count > 0; blk += run, count -= run)
+    {
+      absolute_blk = inode_bmap(dev, sb, inode, blk, &run);
+      if (absolute_blk == -1)
+        break;
+
+      if (run < 1)
+        run = 1;
+      if (run > count)
+        run = count;
+
+      if (!unassigned_p(absolute_blk))
+        breadahead(dev, sb, absolute_blk, run);
+    }
+}
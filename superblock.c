@@ -32,7 +32,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <block.h>
 #include <inode.h>
+#include <journal.h>
 #include <misc.h>
 #include <superblock.h>
 
@@ -43,7 +45,8 @@
  *      Routine:       superblock_write
  *
  *      Purpose:
- *              Escribe a disco un superbloque.
+ *              Escribe a disco un superbloque (a través del diario, si
+ *              está en marcha).
  *      Conditions:
  *              fd debe corresponder a un fichero abierto para escritura.
  *              sb debe apuntar a un superblock_t válido.
@@ -53,19 +56,24 @@
  *
  */
 int
-superblock_write(int fd, const superblock_t * const sb)
+superblock_write(int fd, superblock_t * const sb)
 {
   int size;
+  ssize_t res;
 
   size = sizeof(struct persistent_superblock);
 
-  if (lseek(fd, 0, SEEK_SET) < 0)
-    return -1;
+  /* Que nadie toque las listas de libres mientras se escriben. */
+  pthread_mutex_lock(&sb->inode_lock);
+  pthread_mutex_lock(&sb->block_lock);
+  res = journal_write(fd, sb, size, 0, B_NO_OWNER);
+  if (res == size)
+    __atomic_store_n(&sb->modified, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sb->block_lock);
+  pthread_mutex_unlock(&sb->inode_lock);
 
-  if (write(fd, sb, size) < size)
+  if (res < size)
     return -1;
-  
-  superblock_print_dump_debug(sb);
 
   return 0;
 }
@@ -73,6 +81,32 @@ superblock_write(int fd, const superblock_t * const sb)
 
 
 
+/*-
+ *      Routine:       superblock_sync
+ *
+ *      Purpose:
+ *              Escribe a disco un superbloque sólo si ha cambiado desde la
+ *              última vez.
+ *      Conditions:
+ *              fd debe corresponder a un fichero abierto para escritura.
+ *              sb debe apuntar a un superblock_t válido.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error.
+ *
+ */
+int
+superblock_sync(int fd, superblock_t * const sb)
+{
+  if (!__atomic_load_n(&sb->modified, __ATOMIC_RELAXED))
+    return 0;
+
+  return superblock_write(fd, sb);
+}
+
+
+
+
 /*-
  *      Routine:       superblock_read
  *
@@ -97,26 +131,46 @@ superblock_read(int fd)
   if (!sb)
     return NULL;
   
-  if (lseek(fd, 0, SEEK_SET) < 0)
+  if (pread(fd, sb, size, 0) < size)
     {
       free(sb);
       return NULL;
     }
-
-  if (read(fd, sb, size) < size)
+  
+  if (sb->magic != MAGIC_NUMBER)
     {
       free(sb);
       return NULL;
     }
-  
-  if (sb->magic != MAGIC_NUMBER)
+
+  if (sb->magic2 != GNORDOFS_REVISION
+      && sb->magic2 != GNORDOFS_REVISION_NO_JOURNAL
+      && sb->magic2 != GNORDOFS_REVISION_INODE_LIST
+      && sb->magic2 != GNORDOFS_REVISION_FREE_LIST
+      && sb->magic2 != MAGIC_NUMBER)
     {
+      DEBUG("Revisión del formato no soportada (%x): hay que volver a crear el sistema de archivos\n",
+            sb->magic2);
       free(sb);
       return NULL;
     }
 
-  sb->lock = 0;
+  pthread_mutex_init(&sb->block_lock, NULL);
+  pthread_mutex_init(&sb->inode_lock, NULL);
   sb->modified = 0;
+  sb->bitmap = NULL;
+  sb->alloc_rotor = 0;
+  sb->prealloc = NULL;
+  sb->prealloc_blocks = 0;
+  sb->prealloc_gen = 0;
+  sb->freeing = NULL;
+  sb->freeing_blocks = 0;
+  sb->reserved_blocks = 0;
+  sb->ibitmap = NULL;
+  sb->ialloc_rotor = 0;
+
+  sb->atime_mode = ATIME_RELATIME;
+  sb->lazytime = 0;
   
   return sb;
 }
@@ -143,7 +197,6 @@ superblock_init(unsigned long size)
 {
   superblock_t *sb;
   unsigned long block_count, inode_count;
-  int i;
 
   sb = (superblock_t *) malloc(sizeof(superblock_t));
   if (!sb)
@@ -153,41 +206,47 @@ superblock_init(unsigned long size)
   
   /* Coger tamaño. Restar superbloque e inodos. */
   size -= sizeof(struct persistent_superblock);
-  size -= inode_count * sizeof(inode_t);
+  size -= inode_count * sizeof(struct persistent_inode);
   block_count = size / sizeof(block_t);
 
-  /* Se garantiza que el número de bloques será múltiplo entero del tamaño de
-     la lista de bloques libres almacenada en el superblock. */
-  block_count -= block_count % FREE_BLOCK_LIST_SIZE;
-
-  sb->magic2 = sb->magic = MAGIC_NUMBER;
+  sb->magic = MAGIC_NUMBER;
+  sb->magic2 = GNORDOFS_REVISION;
 
+  /* El mapa de bits lo monta balloc_init(). */
   sb->block_count = block_count;
   sb->free_blocks = block_count;
-  for (i=1;
-       i <= FREE_BLOCK_LIST_SIZE;
-       i++)
-    {
-      sb->free_block_list[FREE_BLOCK_LIST_SIZE-i] = i-1;
-    }
-  sb->free_block_index = FREE_BLOCK_LIST_SIZE-1;
+  sb->bitmap_base = 0;
+  sb->bitmap_blocks = 0;
+  /* Y el diario, journal_init(). */
+  sb->journal_base = 0;
+  sb->journal_blocks = 0;
 
   sb->inode_count = inode_count;
   sb->free_inodes = inode_count;
-  for (i=1;
-       i <= FREE_INODE_LIST_SIZE;
-       i++)
-    {
-      sb->free_inode_list[FREE_INODE_LIST_SIZE-i] = i-1;
-    }
-  sb->free_inode_index = FREE_INODE_LIST_SIZE;    // Sí, sin el -1.
+  /* Y el de inodos, ibitmap_init(). */
+  sb->ibitmap_base = 0;
+  sb->ibitmap_blocks = 0;
 
   sb->inode_zone_base = sizeof(struct persistent_superblock);
   sb->block_zone_base = sizeof(struct persistent_superblock)
-                            + inode_count * sizeof(inode_t);
+                            + inode_count * sizeof(struct persistent_inode);
 
-  sb->lock = 0;
+  pthread_mutex_init(&sb->block_lock, NULL);
+  pthread_mutex_init(&sb->inode_lock, NULL);
   sb->modified = 0;
+  sb->bitmap = NULL;
+  sb->alloc_rotor = 0;
+  sb->prealloc = NULL;
+  sb->prealloc_blocks = 0;
+  sb->prealloc_gen = 0;
+  sb->freeing = NULL;
+  sb->freeing_blocks = 0;
+  sb->reserved_blocks = 0;
+  sb->ibitmap = NULL;
+  sb->ialloc_rotor = 0;
+
+  sb->atime_mode = ATIME_RELATIME;
+  sb->lazytime = 0;
 
   return sb;
 }
@@ -214,26 +273,49 @@ superblock_print_dump(const superblock_t * const sb)
   printf("> block_count = %u\n", sb->block_count);
   printf(">\n> free_blocks = %u\n", sb->free_blocks);
 
-  printf("> free_block_list = {");
-  for (i=0; i<FREE_BLOCK_LIST_SIZE-1; i++)
-    printf("%u,", sb->free_block_list[i]);
-  printf("%u}\n", sb->free_block_list[i]);
+  if (sb->magic2 == GNORDOFS_REVISION_FREE_LIST
+      || sb->magic2 == MAGIC_NUMBER)
+    {
+      printf("> free_block_list = {");
+      for (i=0; i<FREE_BLOCK_LIST_SIZE-1; i++)
+        printf("%u,", sb->free_block_list[i]);
+      printf("%u}\n", sb->free_block_list[i]);
 
-  printf("> free_block_index = %u\n", sb->free_block_index);
+      printf("> free_block_index = %u\n", sb->free_block_index);
+    }
+  else
+    {
+      printf("> bitmap_base = %lu\n", sb->bitmap_base);
+      printf("> bitmap_blocks = %lu\n", sb->bitmap_blocks);
+      if (sb->magic2 == GNORDOFS_REVISION)
+        {
+          printf("> journal_base = %lu\n", sb->journal_base);
+          printf("> journal_blocks = %lu\n", sb->journal_blocks);
+        }
+    }
   printf(">\n> inode_count = %u\n", sb->inode_count);
   printf("> free_inodes = %u\n", sb->free_inodes);
 
-  printf("> free_inode_list = {");
-  for (i=0; i<FREE_INODE_LIST_SIZE-1; i++)
-    printf("%u,", sb->free_inode_list[i]);
-  printf("%u}\n", sb->free_inode_list[i]);
+  if (sb->magic2 == GNORDOFS_REVISION_FREE_LIST
+      || sb->magic2 == GNORDOFS_REVISION_INODE_LIST
+      || sb->magic2 == MAGIC_NUMBER)
+    {
+      printf("> free_inode_list = {");
+      for (i=0; i<FREE_INODE_LIST_SIZE-1; i++)
+        printf("%u,", sb->free_inode_list[i]);
+      printf("%u}\n", sb->free_inode_list[i]);
 
-  printf("> free_inode_index = %u\n", sb->free_inode_index);
+      printf("> free_inode_index = %u\n", sb->free_inode_index);
+    }
+  else
+    {
+      printf("> ibitmap_base = %lu\n", sb->ibitmap_base);
+      printf("> ibitmap_blocks = %lu\n", sb->ibitmap_blocks);
+    }
   printf(">\n> inode_zone_base = %u\n", sb->inode_zone_base);
   printf("> block_zone_base = %u\n", sb->block_zone_base);
 
-  printf(">\n> (in core) lock = %s\n", sb->lock ? "Locked" : "Unlocked");
-  printf("> (in core) modified = %s\n", sb->modified ? "YES" : "NO");
+  printf(">\n> (in core) modified = %s\n", sb->modified ? "YES" : "NO");
 }
 
 
@@ -258,23 +340,46 @@ superblock_print_dump_debug(const superblock_t * const sb)
   DEBUG("# block_count = %u\n", sb->block_count);
   DEBUG("# free_blocks = %u\n", sb->free_blocks);
 
-  DEBUG("# free_block_list = {");
-  for (i=0; i < sb->free_block_index; i++)
-    DEBUG("%u,", sb->free_block_list[i]);
-  DEBUG("%u}\n", sb->free_block_list[i]);
-  DEBUG("# free_block_index = %u\n", sb->free_block_index);
+  if (sb->magic2 == GNORDOFS_REVISION_FREE_LIST
+      || sb->magic2 == MAGIC_NUMBER)
+    {
+      DEBUG("# free_block_list = {");
+      for (i=0; i < sb->free_block_index; i++)
+        DEBUG("%u,", sb->free_block_list[i]);
+      DEBUG("%u}\n", sb->free_block_list[i]);
+      DEBUG("# free_block_index = %u\n", sb->free_block_index);
+    }
+  else
+    {
+      DEBUG("# bitmap_base = %lu\n", sb->bitmap_base);
+      DEBUG("# bitmap_blocks = %lu\n", sb->bitmap_blocks);
+      if (sb->magic2 == GNORDOFS_REVISION)
+        {
+          DEBUG("# journal_base = %lu\n", sb->journal_base);
+          DEBUG("# journal_blocks = %lu\n", sb->journal_blocks);
+        }
+    }
   DEBUG("# inode_count = %u\n", sb->inode_count);
   DEBUG("# free_inodes = %u\n", sb->free_inodes);
 
-  DEBUG("# free_inode_list = {");
-  for (i=0; i < sb->free_inode_index-1; i++)
-    DEBUG("%u,", sb->free_inode_list[i]);
-  DEBUG("%u}\n", sb->free_inode_list[i]);
+  if (sb->magic2 == GNORDOFS_REVISION_FREE_LIST
+      || sb->magic2 == GNORDOFS_REVISION_INODE_LIST
+      || sb->magic2 == MAGIC_NUMBER)
+    {
+      DEBUG("# free_inode_list = {");
+      for (i=0; i < sb->free_inode_index-1; i++)
+        DEBUG("%u,", sb->free_inode_list[i]);
+      DEBUG("%u}\n", sb->free_inode_list[i]);
 
-  DEBUG("# free_inode_index = %u\n", sb->free_inode_index);
+      DEBUG("# free_inode_index = %u\n", sb->free_inode_index);
+    }
+  else
+    {
+      DEBUG("# ibitmap_base = %lu\n", sb->ibitmap_base);
+      DEBUG("# ibitmap_blocks = %lu\n", sb->ibitmap_blocks);
+    }
   DEBUG("# inode_zone_base = %u\n", sb->inode_zone_base);
   DEBUG("# block_zone_base = %u\n", sb->block_zone_base);
 
-  /* DEBUG("#\n# (in core) lock = %s\n", sb->lock ? "Locked" : "Unlocked"); */
   /* DEBUG("# (in core) modified = %s\n", sb->modified ? "YES" : "NO"); */
 }
@@ -0,0 +1,692 @@
+/* -*- mode: C -*- Time-stamp: "2013-10-13 20:41:09 holzplatten"
+ *
+ *       File:         uring.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Oct 13 16:02:37 2013
+ *
+ *       E/S del dispositivo con io_uring, con vuelta a preadv() y
+ *       pwritev() si no se puede.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <misc.h>
+#include <uring.h>
+
+
+/* Anillo de un hilo: las colas de envío y de terminadas, compartidas
+   con el núcleo. */
+struct ring
+{
+  int fd;
+  unsigned depth;
+  /* La zona de buffers fijos está registrada en este anillo. */
+  char fixed;
+  /* Falló io_uring_enter(): el hilo sigue por la vía síncrona. */
+  char broken;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static struct
+{
+  pthread_once_t once;
+  /* Anillo de cada hilo. */
+  pthread_key_t key;
+  /* No hay io_uring, o no se quiere: todo va por la vía síncrona. */
+  int disabled;
+
+  /* Zona que se registra como buffers fijos en cada anillo nuevo. */
+  void *base;
+  size_t len;
+
+  struct uring_stats stats;
+} uring = {
+  .once = PTHREAD_ONCE_INIT
+};
+
+
+
+
+/*-
+ *      Routine:       ring_free
+ *
+ *      Purpose:
+ *              Desmonta un anillo y libera su memoria.
+ *      Conditions:
+ *              r debe apuntar a un anillo sin operaciones en vuelo.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+ring_free(void *arg)
+{
+  struct ring *r = arg;
+
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_key_init
+ *
+ *      Purpose:
+ *              Crea la clave de los anillos de cada hilo, que se
+ *              desmontan solos cuando el hilo termina.
+ *      Conditions:
+ *              Se llama una sola vez, con pthread_once().
+ *      Returns:
+ *              none
+ *
+ */
+static void
+uring_key_init(void)
+{
+  if (pthread_key_create(&uring.key, ring_free) != 0)
+    __atomic_store_n(&uring.disabled, 1, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       ring_setup
+ *
+ *      Purpose:
+ *              Monta un anillo de URING_DEPTH entradas con
+ *              io_uring_setup() y proyecta sus colas en memoria. Si hay
+ *              zona de buffers fijos, la registra; si no se puede (por el
+ *              límite de memoria bloqueada, por ejemplo), el anillo sirve
+ *              igual, sin ellos.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              Un puntero al anillo.
+ *              NULL on error.
+ *
+ */
+static struct ring *
+ring_setup(void)
+{
+  struct io_uring_params p;
+  struct iovec region;
+  struct ring *r;
+  unsigned char *sq, *cq;
+
+  r = calloc(1, sizeof(struct ring));
+  if (!r)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+  if (r->fd < 0)
+    {
+      DEBUG(">> ring_setup >> io_uring_setup: %s\n", strerror(errno));
+      free(r);
+      return NULL;
+    }
+
+  r->depth = p.sq_entries;
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (r->cq_ring_size > r->sq_ring_size)
+        r->sq_ring_size = r->cq_ring_size;
+      r->cq_ring_size = r->sq_ring_size;
+    }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    {
+      r->sq_ring = NULL;
+      ring_free(r);
+      return NULL;
+    }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    {
+      r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if (r->cq_ring == MAP_FAILED)
+        {
+          r->cq_ring = NULL;
+          ring_free(r);
+          return NULL;
+        }
+    }
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    {
+      r->sqes = NULL;
+      ring_free(r);
+      return NULL;
+    }
+
+  sq = r->sq_ring;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+  cq = r->cq_ring;
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  region.iov_base = __atomic_load_n(&uring.base, __ATOMIC_ACQUIRE);
+  region.iov_len = uring.len;
+  if (region.iov_base
+      && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                 &region, 1) == 0)
+    r->fixed = 1;
+
+  __atomic_add_fetch(&uring.stats.rings, 1, __ATOMIC_RELAXED);
+
+  return r;
+}
+
+
+
+
+/*-
+ *      Routine:       ring_get
+ *
+ *      Purpose:
+ *              Devuelve el anillo del hilo que llama, montándolo si es la
+ *              primera vez. Si no se puede montar, ya no se intenta más
+ *              en ningún hilo.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              Un puntero al anillo.
+ *              NULL si hay que usar la vía síncrona.
+ *
+ */
+static struct ring *
+ring_get(void)
+{
+  struct ring *r;
+
+  if (__atomic_load_n(&uring.disabled, __ATOMIC_RELAXED))
+    return NULL;
+
+  pthread_once(&uring.once, uring_key_init);
+  if (__atomic_load_n(&uring.disabled, __ATOMIC_RELAXED))
+    return NULL;
+
+  r = pthread_getspecific(uring.key);
+  if (r)
+    return r->broken ? NULL : r;
+
+  r = ring_setup();
+  if (!r || pthread_setspecific(uring.key, r) != 0)
+    {
+      if (r)
+        ring_free(r);
+      DEBUG(">> ring_get >> Sin io_uring: E/S síncrona\n");
+      __atomic_store_n(&uring.disabled, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+
+  return r;
+}
+
+
+
+
+/*-
+ *      Routine:       op_len
+ *
+ *      Purpose:
+ *              Calcula cuántos bytes mueve una operación.
+ *      Conditions:
+ *              op debe apuntar a una struct uring_op.
+ *      Returns:
+ *              El número de bytes.
+ *
+ */
+static ssize_t
+op_len(const struct uring_op *op)
+{
+  ssize_t len = 0;
+  int i;
+
+  for (i=0; i<op->iovcnt; i++)
+    len += op->iov[i].iov_len;
+
+  return len;
+}
+
+
+
+
+/*-
+ *      Routine:       op_sync
+ *
+ *      Purpose:
+ *              Hace una operación con preadv() o pwritev().
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *              op debe apuntar a una struct uring_op.
+ *      Returns:
+ *              none (el resultado queda en op->res).
+ *
+ */
+static void
+op_sync(int dev, struct uring_op *op, int write)
+{
+  op->res = write ? pwritev(dev, op->iov, op->iovcnt, op->offset)
+    : preadv(dev, op->iov, op->iovcnt, op->offset);
+
+  __atomic_add_fetch(&uring.stats.sync, 1, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       op_prep
+ *
+ *      Purpose:
+ *              Rellena la entrada de envío de una operación. Si es de un
+ *              solo trozo dentro de la zona registrada, con buffer fijo.
+ *      Conditions:
+ *              r debe apuntar a un anillo válido.
+ *              sqe debe apuntar a una entrada libre de su cola de envío.
+ *      Returns:
+ *              none
+ *
+ */
+static void
+op_prep(struct ring *r, struct io_uring_sqe *sqe, int dev,
+        const struct uring_op *op, unsigned long i, int write)
+{
+  uintptr_t start = (uintptr_t) uring.base, p;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = dev;
+  sqe->off = op->offset;
+  sqe->user_data = i;
+
+  p = (uintptr_t) op->iov[0].iov_base;
+  if (r->fixed && op->iovcnt == 1
+      && p >= start && p + op->iov[0].iov_len <= start + uring.len)
+    {
+      sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = p;
+      sqe->len = op->iov[0].iov_len;
+      sqe->buf_index = 0;
+      __atomic_add_fetch(&uring.stats.fixed, 1, __ATOMIC_RELAXED);
+    }
+  else
+    {
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = (uintptr_t) op->iov;
+      sqe->len = op->iovcnt;
+    }
+}
+
+
+
+
+/*-
+ *      Routine:       uring_rw
+ *
+ *      Purpose:
+ *              Hace n operaciones sobre el dispositivo. Con anillo, se
+ *              envían todas las que quepan, se espera a que termine
+ *              alguna, se recogen todas las que hayan terminado y se
+ *              rellena el hueco, hasta acabar. Las operaciones pueden
+ *              terminar en cualquier orden.
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *              v debe apuntar a n operaciones que no se solapen.
+ *      Returns:
+ *              0 on success.
+ *              -1 si alguna no movió todos sus bytes.
+ *
+ */
+static int
+uring_rw(int dev, struct uring_op *v, unsigned long n, int write)
+{
+  struct ring *r;
+  struct io_uring_cqe *cqe;
+  unsigned long i, next = 0, done = 0;
+  unsigned tail, head, inflight = 0, pending = 0;
+  int ret, res = 0;
+
+  r = ring_get();
+  if (!r)
+    {
+      for (i=0; i<n; i++)
+        {
+          op_sync(dev, &v[i], write);
+          if (v[i].res != op_len(&v[i]))
+            res = -1;
+        }
+      return res;
+    }
+
+  while (done < n)
+    {
+      /* Llenar la cola de envío. Sólo este hilo toca su cola, así que
+         la cola se lee sin más; el núcleo ve lo nuevo al publicarla. */
+      tail = *r->sq_tail;
+      while (!r->broken && next < n && inflight < r->depth)
+        {
+          op_prep(r, &r->sqes[tail & *r->sq_mask], dev, &v[next], next, write);
+          r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+          tail++;
+          next++;
+          inflight++;
+          pending++;
+        }
+      __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+      ret = syscall(__NR_io_uring_enter, r->fd, pending, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+      __atomic_add_fetch(&uring.stats.enters, 1, __ATOMIC_RELAXED);
+      if (ret >= 0)
+        pending -= (unsigned) ret > pending ? pending : (unsigned) ret;
+      else if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        ;
+      else if (!r->broken)
+        {
+          /* Las que el núcleo no llegó a coger se retiran de la cola y,
+             con las que faltan, se hacen a mano; a las que ya están en
+             vuelo se las sigue esperando. El hilo no vuelve a usar el
+             anillo. */
+          DEBUG(">> uring_rw >> io_uring_enter: %s\n", strerror(errno));
+          r->broken = 1;
+          __atomic_store_n(r->sq_tail, tail - pending, __ATOMIC_RELEASE);
+          for (i = next - pending; i < n; i++)
+            {
+              op_sync(dev, &v[i], write);
+              if (v[i].res != op_len(&v[i]))
+                res = -1;
+              done++;
+            }
+          inflight -= pending;
+          pending = 0;
+          next = n;
+        }
+      else
+        {
+          /* Ni siquiera se puede esperar a las que están en vuelo. */
+          res = -1;
+          break;
+        }
+
+      /* Recoger de golpe todas las que hayan terminado. */
+      head = *r->cq_head;
+      while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+          cqe = &r->cqes[head & *r->cq_mask];
+          i = cqe->user_data;
+          v[i].res = cqe->res;
+          if (cqe->res < 0)
+            {
+              v[i].res = -1;
+              errno = -cqe->res;
+            }
+          if (v[i].res != op_len(&v[i]))
+            res = -1;
+          head++;
+          inflight--;
+          done++;
+        }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  __atomic_add_fetch(&uring.stats.ops, n, __ATOMIC_RELAXED);
+
+  return res;
+}
+
+
+
+
+/*-
+ *      Routine:       uring_disable
+ *
+ *      Purpose:
+ *              Hace que, a partir de ahora, toda la E/S vaya por la vía
+ *              síncrona (opción de montaje nouring).
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+uring_disable(void)
+{
+  __atomic_store_n(&uring.disabled, 1, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_register_buffers
+ *
+ *      Purpose:
+ *              Apunta la zona de memoria (len bytes desde base) que los
+ *              anillos registran como buffers fijos al montarse. Las
+ *              operaciones de un solo trozo dentro de ella se ahorran el
+ *              mapear y desmapear las páginas en cada una.
+ *      Conditions:
+ *              Hay que llamarla antes de la primera E/S, y la zona debe
+ *              durar tanto como el programa.
+ *      Returns:
+ *              none
+ *
+ */
+void
+uring_register_buffers(void *base, size_t len)
+{
+  uring.len = len;
+  __atomic_store_n(&uring.base, base, __ATOMIC_RELEASE);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_readv
+ *
+ *      Purpose:
+ *              Hace n lecturas del dispositivo a la vez (ver uring_rw()).
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *              v debe apuntar a n operaciones que no se solapen.
+ *      Returns:
+ *              0 on success.
+ *              -1 si alguna no leyó todos sus bytes.
+ *
+ */
+int
+uring_readv(int dev, struct uring_op *v, unsigned long n)
+{
+  return uring_rw(dev, v, n, 0);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_writev
+ *
+ *      Purpose:
+ *              Hace n escrituras en el dispositivo a la vez (ver
+ *              uring_rw()).
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *              v debe apuntar a n operaciones que no se solapen.
+ *      Returns:
+ *              0 on success.
+ *              -1 si alguna no escribió todos sus bytes.
+ *
+ */
+int
+uring_writev(int dev, struct uring_op *v, unsigned long n)
+{
+  return uring_rw(dev, v, n, 1);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_pread
+ *
+ *      Purpose:
+ *              Como pread(), a través del anillo del hilo.
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *      Returns:
+ *              Lo mismo que pread().
+ *
+ */
+ssize_t
+uring_pread(int dev, void *buf, size_t len, off_t offset)
+{
+  struct iovec iov = { buf, len };
+  struct uring_op op = { &iov, 1, offset, 0 };
+
+  uring_rw(dev, &op, 1, 0);
+
+  return op.res;
+}
+
+
+
+
+/*-
+ *      Routine:       uring_pwrite
+ *
+ *      Purpose:
+ *              Como pwrite(), a través del anillo del hilo.
+ *      Conditions:
+ *              dev debe ser un descriptor abierto.
+ *      Returns:
+ *              Lo mismo que pwrite().
+ *
+ */
+ssize_t
+uring_pwrite(int dev, const void *buf, size_t len, off_t offset)
+{
+  struct iovec iov = { (void *) buf, len };
+  struct uring_op op = { &iov, 1, offset, 0 };
+
+  uring_rw(dev, &op, 1, 1);
+
+  return op.res;
+}
+
+
+
+
+/*-
+ *      Routine:       uring_get_stats
+ *
+ *      Purpose:
+ *              Copia los contadores de la E/S con io_uring.
+ *      Conditions:
+ *              stats debe apuntar a una struct uring_stats.
+ *      Returns:
+ *              none
+ *
+ */
+void
+uring_get_stats(struct uring_stats *stats)
+{
+  stats->rings = __atomic_load_n(&uring.stats.rings, __ATOMIC_RELAXED);
+  stats->ops = __atomic_load_n(&uring.stats.ops, __ATOMIC_RELAXED);
+  stats->fixed = __atomic_load_n(&uring.stats.fixed, __ATOMIC_RELAXED);
+  stats->enters = __atomic_load_n(&uring.stats.enters, __ATOMIC_RELAXED);
+  stats->sync = __atomic_load_n(&uring.stats.sync, __ATOMIC_RELAXED);
+}
+
+
+
+
+/*-
+ *      Routine:       uring_print_stats_debug
+ *
+ *      Purpose:
+ *              Vuelca al log los contadores de la E/S con io_uring.
+ *      Conditions:
+ *              none
+ *      Returns:
+ *              none
+ *
+ */
+void
+uring_print_stats_debug(void)
+{
+  struct uring_stats stats;
+
+  uring_get_stats(&stats);
+
+  DEBUG("# uring: %lu anillos, %lu operaciones (%lu con buffer fijo)\n",
+        stats.rings, stats.ops, stats.fixed);
+  DEBUG("# uring: %lu llamadas a io_uring_enter, %lu síncronas\n",
+        stats.enters, stats.sync);
+}
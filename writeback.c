@@ -0,0 +1,134 @@
+/* -*- mode: C -*- Time-stamp: "2013-10-06 13:27:50 holzplatten"
+ *
+ *       File:         writeback.c
+ *       Author:       Pedro J. Ruiz Lopez (holzplatten@es.gnu.org)
+ *       Date:         Sun Oct  6 11:14:02 2013
+ *
+ *       Escritura ordenada y agrupada de trozos sueltos.
+ *
+ */
+
+/*
+  Copyright (C) 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This file is part of GnordoFS.
+
+  GnordoFS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GnordoFS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GnordoFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+#include <misc.h>
+#include <uring.h>
+#include <writeback.h>
+
+
+
+
+/*-
+ *      Routine:       wb_compare
+ *
+ *      Purpose:
+ *              Compara dos trozos por su posición, para qsort().
+ *      Conditions:
+ *              a y b deben apuntar a struct wb_extent.
+ *      Returns:
+ *              <0, 0 ó >0 según a vaya antes, en el mismo sitio o
+ *              después que b.
+ *
+ */
+static int
+wb_compare(const void *a, const void *b)
+{
+  const struct wb_extent *x = a, *y = b;
+
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+
+
+
+/*-
+ *      Routine:       writeback
+ *
+ *      Purpose:
+ *              Escribe n trozos en el dispositivo ordenados por posición,
+ *              juntando en una misma operación los que quedan seguidos.
+ *              Las operaciones se mandan todas a la vez (ver
+ *              uring_writev()), de modo que el dispositivo tiene varias
+ *              en cola; si no hay memoria para prepararlas juntas, van
+ *              de una en una, en orden creciente. v se reordena.
+ *      Conditions:
+ *              dev debe corresponder a un gnordofs válido.
+ *              v debe apuntar a n trozos que no se solapen.
+ *      Returns:
+ *              0 on success.
+ *              -1 on error (se intentan escribir todos igualmente).
+ *
+ */
+int
+writeback(int dev, struct wb_extent *v, unsigned long n)
+{
+  struct iovec one[WRITEBACK_MAX_IOV], *iov, *run;
+  struct uring_op *ops, op;
+  unsigned long i, j, calls = 0;
+  off_t end;
+  int res = 0;
+
+  qsort(v, n, sizeof(struct wb_extent), wb_compare);
+
+  iov = malloc((n ? n : 1) * sizeof(struct iovec));
+  ops = malloc((n ? n : 1) * sizeof(struct uring_op));
+  if (!iov || !ops)
+    {
+      free(iov);
+      free(ops);
+      iov = NULL;
+      ops = NULL;
+    }
+
+  for (i=0; i<n; i=j)
+    {
+      run = iov ? &iov[i] : one;
+      end = v[i].offset;
+      for (j=i; j<n && j-i < WRITEBACK_MAX_IOV && v[j].offset == end; j++)
+        {
+          run[j-i].iov_base = (void *) v[j].data;
+          run[j-i].iov_len = v[j].len;
+          end += v[j].len;
+        }
+
+      op.iov = run;
+      op.iovcnt = j-i;
+      op.offset = v[i].offset;
+      if (ops)
+        ops[calls] = op;
+      else if (uring_writev(dev, &op, 1) < 0)
+        res = -1;
+      calls++;
+    }
+
+  if (ops && uring_writev(dev, ops, calls) < 0)
+    res = -1;
+
+  DEBUG_VERBOSE(">> writeback >> %lu trozos en %lu escrituras\n", n, calls);
+
+  free(iov);
+  free(ops);
+
+  return res;
+}